@@ -3,21 +3,337 @@
 #include <ngx_http.h>
 #include "ngx_s3_auth.h"
 
+static void* ngx_http_s3_auth_create_main_conf(ngx_conf_t *cf);
+static void* ngx_http_s3_auth_create_srv_conf(ngx_conf_t *cf);
 static void* ngx_http_s3_auth_create_loc_conf(ngx_conf_t *cf);
 static char* ngx_http_s3_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
 static ngx_int_t ngx_s3_auth_req_init(ngx_conf_t *cf);
 static char * ngx_http_s3_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char* ngx_http_s3_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_s3_auth_init_process(ngx_cycle_t *cycle);
+static void ngx_http_s3_auth_rotate_keys(ngx_event_t *ev);
+static ngx_int_t ngx_http_s3_auth_add_variables(ngx_conf_t *cf);
+static ngx_int_t ngx_http_s3_auth_content_length_variable(ngx_http_request_t *r,
+                                                          ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_s3_auth_presigned_url_variable(ngx_http_request_t *r,
+                                                         ngx_http_variable_value_t *v, uintptr_t data);
+static char* ngx_http_s3_verify_credential(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_verify_replay_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_signature_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_credentials_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_s3_auth_reload_credentials(ngx_event_t *ev);
+static char* ngx_http_s3_temporary_credentials(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_s3_auth_refresh_credentials(ngx_event_t *ev);
+static char* ngx_http_s3_sign_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_signed_headers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_sign_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_hash_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_s3_auth_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void ngx_http_s3_auth_batch_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_s3_auth_signature_cache_variable(ngx_http_request_t *r,
+                                                           ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_s3_auth_trace_variable(ngx_http_request_t *r,
+                                                 ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_s3_auth_header_variable(ngx_http_request_t *r,
+                                                  ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_s3_auth_signature_cache_counter_variable(ngx_http_request_t *r,
+                                                                   ngx_http_variable_value_t *v, uintptr_t data);
+
+/* s3_auth_status, summed over all workers and only ever updated with atomic adds */
+#define NGX_HTTP_S3_AUTH_SIGNED            0
+#define NGX_HTTP_S3_AUTH_REJECTED          1
+#define NGX_HTTP_S3_AUTH_ERRORS            2
+#define NGX_HTTP_S3_AUTH_KEY_CACHE_HITS    3
+#define NGX_HTTP_S3_AUTH_KEY_CACHE_MISSES  4
+#define NGX_HTTP_S3_AUTH_CREDENTIAL_HITS   5
+#define NGX_HTTP_S3_AUTH_CREDENTIAL_MISSES 6
+#define NGX_HTTP_S3_AUTH_BYTES_HASHED      7
+#define NGX_HTTP_S3_AUTH_DEFERRED          8
+#define NGX_HTTP_S3_AUTH_PEER_SIGNED       9
+#define NGX_HTTP_S3_AUTH_COUNTERS          10
+
+typedef struct {
+  ngx_atomic_t buckets[NGX_S3_AUTH_LATENCY_BUCKETS + 1]; /* not cumulative */
+  ngx_atomic_t nsec;
+} ngx_http_s3_auth_stage_stats_t;
+
+typedef struct {
+  ngx_atomic_t counters[NGX_HTTP_S3_AUTH_COUNTERS];
+  ngx_http_s3_auth_stage_stats_t stages[NGX_S3_AUTH_STAGES];
+} ngx_http_s3_auth_stats_t;
+
+typedef struct {
+  ngx_array_t key_caches; /* of struct S3SigningKeyCache* */
+  ngx_event_t key_rotation;
+  struct S3RequestTimeCache *time_cache; /* per worker, every worker has its copy after fork */
+  ngx_shm_zone_t *replay_zone;
+  ngx_array_t credentials_maps; /* of ngx_http_s3_auth_creds_ctx_t* */
+  ngx_array_t providers; /* of ngx_http_s3_auth_provider_t* */
+  ngx_queue_t batch; /* of ngx_http_s3_auth_batch_entry_t waiting for s3_sign_batch */
+  ngx_uint_t batched;
+  ngx_event_t batch_flush; /* posted, runs once this event loop iteration is done */
+  ngx_array_t signature_caches; /* of ngx_shm_zone_t*, for s3_auth_status */
+  ngx_shm_zone_t *status_zone;
+  ngx_http_s3_auth_stats_t *stats; /* NULL without s3_auth_status */
+  ngx_uint_t trace; /* the configuration uses $s3_canonical_request and friends */
+  ngx_uint_t sign_peers; /* some upstream has s3_sign_peers */
+} ngx_http_s3_auth_main_conf_t;
+
+typedef struct {
+  ngx_str_t access_key;
+  ngx_str_t secret_key; /* "AWS4" + secret, as the key derivation wants it */
+} ngx_http_s3_auth_credential_t;
+
+/* signatures accepted in the last NGX_S3_AUTH_MAX_SKEW seconds, a request
+   carrying one of them again is a replay */
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t queue; /* most recent first */
+} ngx_http_s3_auth_replay_sh_t;
+
+typedef struct {
+  ngx_http_s3_auth_replay_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_http_s3_auth_replay_ctx_t;
+
+typedef struct {
+  ngx_rbtree_node_t node; /* key is crc32 of the signature */
+  ngx_queue_t queue;
+  time_t expires;
+  u_char signature[NGX_S3_AUTH_SIGNATURE_LEN];
+} ngx_http_s3_auth_replay_node_t;
+
+/* signatures of the current second, a request signed with the same inputs
+   in the same second gets the same signature without hashing anything */
+typedef struct {
+  ngx_rbtree_t rbtree;
+  ngx_rbtree_node_t sentinel;
+  ngx_queue_t queue; /* most recently used first */
+  ngx_atomic_t hits;
+  ngx_atomic_t misses;
+} ngx_http_s3_auth_sig_cache_sh_t;
+
+typedef struct {
+  ngx_http_s3_auth_sig_cache_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+} ngx_http_s3_auth_sig_cache_ctx_t;
+
+typedef struct {
+  ngx_rbtree_node_t node; /* key is murmur2 of the cache key */
+  ngx_queue_t queue;
+  time_t sec;
+  u_char signature[NGX_S3_AUTH_SIGNATURE_LEN];
+  size_t len;
+  u_char data[1]; /* the cache key */
+} ngx_http_s3_auth_sig_cache_node_t;
+
+/* s3_credentials_map, the table is replaced as a whole when the file changes */
+typedef struct {
+  struct S3CredentialsTable *table;
+  time_t mtime;
+  off_t size;
+} ngx_http_s3_auth_creds_sh_t;
+
+typedef struct {
+  ngx_http_s3_auth_creds_sh_t *sh;
+  ngx_slab_pool_t *shpool;
+  ngx_str_t file;
+  ngx_msec_t interval;
+  ngx_event_t reload; /* per worker */
+} ngx_http_s3_auth_creds_ctx_t;
+
+/* one set of temporary credentials, replaced as a whole on refresh */
+typedef struct {
+  ngx_pool_t *pool; /* everything below lives in it */
+  ngx_str_t access_key;
+  ngx_str_t session_token;
+  time_t expiration; /* 0 if they don't expire */
+  struct S3SigningKeyCache *key_cache;
+} ngx_http_s3_auth_temp_creds_t;
+
+/* s3_temporary_credentials, every worker keeps its own copy up to date */
+typedef struct {
+  ngx_str_t source; /* for the log */
+  ngx_str_t file;
+  ngx_url_t *url; /* or the credentials endpoint */
+  time_t refresh; /* before the expiration */
+  ngx_msec_t timeout;
+  ngx_str_t region;
+  ngx_str_t service;
+  ngx_http_s3_auth_temp_creds_t *current; /* NULL until the first refresh */
+  ngx_event_t timer;
+
+  /* IMDSv2: the session token sent with the credentials request */
+  time_t token_ttl; /* 0 without */
+  ngx_str_t token;
+  time_t token_expires;
+  unsigned fetching_token:1;
+  unsigned token_fresh:1; /* fetched for this refresh, a 401 with it is final */
+
+  /* a request to the endpoint in progress */
+  ngx_peer_connection_t peer;
+  ngx_pool_t *fetch_pool;
+  ngx_buf_t *request;
+  ngx_buf_t *response;
+} ngx_http_s3_auth_provider_t;
+
+#define NGX_HTTP_S3_AUTH_REFRESH_RETRY 10      /* seconds */
+#define NGX_HTTP_S3_AUTH_CREDENTIALS_MAX 16384 /* response size */
+#define NGX_HTTP_S3_AUTH_TOKEN_MAX 1024
+#define NGX_HTTP_S3_AUTH_TOKEN_TTL 21600       /* seconds, the most IMDS allows */
+#define NGX_HTTP_S3_AUTH_TOKEN_URI "/latest/api/token"
+
+static ngx_int_t ngx_http_s3_auth_fetch_credentials(ngx_http_s3_auth_provider_t *provider, ngx_log_t *log);
+
+/* client headers of s3_signed_headers */
+typedef struct {
+  ngx_hash_t hash;   /* name to its entry in names */
+  ngx_array_t names; /* of header_pair_t, sorted, values empty */
+} ngx_http_s3_auth_signed_headers_t;
+
+/* what a request is signed with, see ngx_http_s3_auth_signing_key */
+typedef struct {
+  const ngx_s3_auth__hmac_key_t *signing_key;
+  const ngx_str_t *key_scope;
+  const ngx_str_t *raw_key;
+  const ngx_str_t *key_fingerprint; /* stands in for raw_key in signature cache keys */
+  const ngx_str_t *access_key;
+  const ngx_str_t *session_token; /* of temporary credentials, NULL otherwise */
+  const ngx_array_t *extra_headers; /* x-amz-security-token and s3_signed_headers, sorted */
+  const struct S3AuthTemplate *auth_template; /* set to key_scope, NULL if it does not apply */
+  time_t sec; /* the x-amz-date, key_scope is of its day */
+  unsigned transient:1; /* signing_key may be gone before the request ends */
+} ngx_http_s3_auth_key_t;
+
+/* s3_sign_peers, in upstream{} */
+typedef struct {
+  ngx_http_upstream_init_pt original_init_upstream;
+  ngx_http_upstream_init_peer_pt original_init_peer;
+  ngx_array_t hosts; /* of ngx_http_s3_auth_peer_host_t */
+} ngx_http_s3_auth_srv_conf_t;
+
+/* a peer address and the name its server was given */
+typedef struct {
+  ngx_str_t addr;
+  ngx_str_t name;
+} ngx_http_s3_auth_peer_host_t;
+
+/* the balancer of an s3_sign_peers upstream, wrapped for a request */
+typedef struct {
+  ngx_http_request_t *r;
+  ngx_http_s3_auth_srv_conf_t *scf;
+  void *data;
+  ngx_event_get_peer_pt original_get_peer;
+  ngx_event_free_peer_pt original_free_peer;
+#if (NGX_HTTP_SSL)
+  ngx_event_set_peer_session_pt original_set_session;
+  ngx_event_save_peer_session_pt original_save_session;
+#endif
+  struct S3PeerSigner *signer; /* made for the first peer which needs it */
+  ngx_buf_t *request; /* the request headers the proxy module made */
+  ngx_str_t host; /* the request in u->request_bufs is signed for */
+} ngx_http_s3_auth_peer_data_t;
+
+/* a request waiting for its signature, see ngx_http_s3_auth_sign_batched */
+typedef struct {
+  ngx_queue_t queue;
+  ngx_http_request_t *r; /* NULL once signed */
+  ngx_http_s3_auth_main_conf_t *mcf;
+  const ngx_str_t *access_key;
+  const ngx_str_t *key_scope;
+  struct S3PendingSignature pending;
+} ngx_http_s3_auth_batch_entry_t;
+
+static void ngx_http_s3_auth_flush_batch(ngx_http_s3_auth_main_conf_t *mcf);
+
+#define NGX_HTTP_S3_AUTH_SIG_CACHE_MISS 1
+#define NGX_HTTP_S3_AUTH_SIG_CACHE_HIT  2
 
 typedef struct {
   ngx_str_t access_key;
   ngx_str_t key_scope;
   ngx_str_t signing_key;
   ngx_str_t signing_key_decoded;
+  ngx_str_t signing_key_fingerprint;
+  ngx_s3_auth__hmac_key_t *signing_hmac_key;
   ngx_str_t endpoint;
+  ngx_str_t secret_key;
+  ngx_str_t region;
+  ngx_str_t service;
+  struct S3SigningKeyCache *key_cache;
+  struct S3AuthTemplate *auth_template; /* of the static or derived key */
+  ngx_flag_t streaming;
+  size_t chunk_size;
+  time_t presign_expires;
+  ngx_str_t presign_scheme;
+  ngx_flag_t verify;
+  ngx_array_t *verify_credentials; /* of ngx_http_s3_auth_credential_t */
+  ngx_shm_zone_t *signature_cache;
+  ngx_http_complex_value_t *credentials_key;
+  ngx_shm_zone_t *credentials_map;
+  ngx_http_s3_auth_provider_t *temporary_credentials;
+  ngx_uint_t sign_batch;
+  ngx_http_s3_auth_signed_headers_t *signed_headers;
+  ngx_flag_t set_headers;
+#if (NGX_THREADS)
+  ngx_thread_pool_t *hash_thread_pool;
+#endif
   ngx_uint_t enabled;
 } ngx_http_s3_auth_conf_t;
 
+typedef struct {
+  ngx_s3_auth__sha256_ctx_t *body_hash; /* set while the request body is being read */
+  unsigned hash_in_thread:1; /* body_hash is left to ngx_http_s3_auth_hash_body */
+  const ngx_str_t *declared_hash; /* s3_verify: the x-amz-content-sha256 the body has to match */
+  ngx_int_t status;
+  ngx_uint_t signature_cache_status;
+
+  /* s3_set_headers off: the payload hash to sign with once a variable asks */
+  const ngx_str_t *payload_hash;
+
+  /* for $s3_authorization, $s3_date, $s3_content_sha256 and $s3_security_token */
+  const ngx_str_t *authorization;
+  const ngx_str_t *date;
+  const ngx_str_t *content_sha256;
+  const ngx_str_t *security_token;
+
+  /* what the request was signed with, kept with mcf->sign_peers only */
+  const ngx_http_s3_auth_key_t *peer_key;
+  const ngx_str_t *peer_payload_hash;
+
+  /* what went into the signature, kept with mcf->trace only */
+  const ngx_str_t *canonical_request;
+  const ngx_str_t *string_to_sign;
+  const ngx_str_t *signed_headers;
+  const ngx_str_t *signature;
+
+  /* aws-chunked uploads */
+  struct S3ChunkSigner *chunk_signer;
+  ngx_chain_t *chunk; /* being filled */
+  ngx_chain_t *free;
+  ngx_chain_t *busy;
+  size_t chunk_size;
+  ngx_str_t content_length;
+} ngx_http_s3_auth_ctx_t;
+
+/* signed headers which are also given out as variables */
+typedef struct {
+  const ngx_str_t *name;
+  size_t offset; /* in ngx_http_s3_auth_ctx_t */
+} ngx_http_s3_auth_header_var_t;
+
+static ngx_http_s3_auth_header_var_t ngx_http_s3_auth_header_vars[] = {
+  { &AUTHZ_HEADER, offsetof(ngx_http_s3_auth_ctx_t, authorization) },
+  { &DATE_HEADER, offsetof(ngx_http_s3_auth_ctx_t, date) },
+  { &HASH_HEADER, offsetof(ngx_http_s3_auth_ctx_t, content_sha256) },
+  { &SECURITY_TOKEN_HEADER, offsetof(ngx_http_s3_auth_ctx_t, security_token) },
+};
+
+static struct S3SigningKeyCache* ngx_http_s3_auth_add_key_cache(ngx_conf_t *cf, ngx_http_s3_auth_conf_t *conf);
+
+static ngx_http_request_body_filter_pt ngx_http_next_request_body_filter;
+
 
 static ngx_command_t  ngx_http_s3_auth_commands[] = {
   { ngx_string("s3_access_key"),
@@ -41,6 +357,139 @@ static ngx_command_t  ngx_http_s3_auth_commands[] = {
     offsetof(ngx_http_s3_auth_conf_t, signing_key),
     NULL },
 
+  { ngx_string("s3_secret_key"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, secret_key),
+    NULL },
+
+  { ngx_string("s3_region"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, region),
+    NULL },
+
+  { ngx_string("s3_service"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, service),
+    NULL },
+
+  { ngx_string("s3_streaming_upload"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, streaming),
+    NULL },
+
+  { ngx_string("s3_streaming_chunk_size"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_size_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, chunk_size),
+    NULL },
+
+  { ngx_string("s3_presign_expires"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_sec_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, presign_expires),
+    NULL },
+
+  { ngx_string("s3_presign_scheme"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_conf_set_str_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, presign_scheme),
+    NULL },
+
+  { ngx_string("s3_verify"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, verify),
+    NULL },
+
+  { ngx_string("s3_verify_credential"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+    ngx_http_s3_verify_credential,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_verify_replay_zone"),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_http_s3_verify_replay_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_signature_cache"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+    ngx_http_s3_signature_cache,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_credentials_map"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+    ngx_http_s3_credentials_map,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_temporary_credentials"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    ngx_http_s3_temporary_credentials,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_sign_batch"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_s3_sign_batch,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_set_headers"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+    ngx_conf_set_flag_slot,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    offsetof(ngx_http_s3_auth_conf_t, set_headers),
+    NULL },
+
+  { ngx_string("s3_signed_headers"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+    ngx_http_s3_signed_headers,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_sign_peers"),
+    NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS,
+    ngx_http_s3_sign_peers,
+    NGX_HTTP_SRV_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_hash_thread_pool"),
+    NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+    ngx_http_s3_hash_thread_pool,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
+  { ngx_string("s3_auth_status"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_http_s3_auth_status,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+
   { ngx_string("s3_endpoint"),
     NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
     ngx_http_s3_endpoint,
@@ -58,12 +507,82 @@ static ngx_command_t  ngx_http_s3_auth_commands[] = {
   ngx_null_command
 };
 
+static ngx_http_variable_t  ngx_http_s3_auth_vars[] = {
+  { ngx_string("s3_content_length"), NULL,
+    ngx_http_s3_auth_content_length_variable, 0,
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_presigned_url"), NULL,
+    ngx_http_s3_auth_presigned_url_variable, 0, 0, 0 },
+
+  { ngx_string("s3_signature_cache_status"), NULL,
+    ngx_http_s3_auth_signature_cache_variable, 0,
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_signature_cache_hits"), NULL,
+    ngx_http_s3_auth_signature_cache_counter_variable,
+    offsetof(ngx_http_s3_auth_sig_cache_sh_t, hits),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_signature_cache_misses"), NULL,
+    ngx_http_s3_auth_signature_cache_counter_variable,
+    offsetof(ngx_http_s3_auth_sig_cache_sh_t, misses),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_canonical_request"), NULL,
+    ngx_http_s3_auth_trace_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, canonical_request),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_string_to_sign"), NULL,
+    ngx_http_s3_auth_trace_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, string_to_sign),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_signed_headers"), NULL,
+    ngx_http_s3_auth_trace_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, signed_headers),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_signature"), NULL,
+    ngx_http_s3_auth_trace_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, signature),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_authorization"), NULL,
+    ngx_http_s3_auth_header_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, authorization),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_date"), NULL,
+    ngx_http_s3_auth_header_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, date),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_content_sha256"), NULL,
+    ngx_http_s3_auth_header_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, content_sha256),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  { ngx_string("s3_security_token"), NULL,
+    ngx_http_s3_auth_header_variable,
+    offsetof(ngx_http_s3_auth_ctx_t, security_token),
+    NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+  ngx_http_null_variable
+};
+
+static ngx_str_t ngx_http_s3_auth_proxy_length = ngx_string("proxy_internal_body_length");
+static ngx_str_t ngx_http_s3_auth_content_encoding = ngx_string("Content-Encoding");
+static ngx_str_t ngx_http_s3_auth_aws_chunked = ngx_string("aws-chunked");
+static ngx_str_t ngx_http_s3_auth_host = ngx_string("Host");
+
 static ngx_http_module_t  ngx_http_s3_auth_module_ctx = {
-  NULL,                                 /* preconfiguration */
+  ngx_http_s3_auth_add_variables,       /* preconfiguration */
   ngx_s3_auth_req_init,                 /* postconfiguration */
-  NULL,                                 /* create main configuration */
+  ngx_http_s3_auth_create_main_conf,    /* create main configuration */
   NULL,                                 /* init main configuration */
-  NULL,                                 /* create server configuration */
+  ngx_http_s3_auth_create_srv_conf,     /* create server configuration */
   NULL,                                 /* merge server configuration */
   ngx_http_s3_auth_create_loc_conf,     /* create location configuration */
   ngx_http_s3_auth_merge_loc_conf       /* merge location configuration */
@@ -77,7 +596,7 @@ ngx_module_t  ngx_http_s3_auth_module = {
   NGX_HTTP_MODULE,                       /* module type */
   NULL,                                  /* init master */
   NULL,                                  /* init module */
-  NULL,                                  /* init process */
+  ngx_http_s3_auth_init_process,         /* init process */
   NULL,                                  /* init thread */
   NULL,                                  /* exit thread */
   NULL,                                  /* exit process */
@@ -85,6 +604,49 @@ ngx_module_t  ngx_http_s3_auth_module = {
   NGX_MODULE_V1_PADDING
 };
 
+static void *
+ngx_http_s3_auth_create_main_conf(ngx_conf_t *cf)
+{
+  ngx_http_s3_auth_main_conf_t *mcf;
+
+  mcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_main_conf_t));
+  if (mcf == NULL) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&mcf->key_caches, cf->pool, 4, sizeof(struct S3SigningKeyCache *)) != NGX_OK) {
+    return NULL;
+  }
+
+  mcf->time_cache = ngx_s3_auth__time_cache_create(cf->pool);
+  if (mcf->time_cache == NULL) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&mcf->credentials_maps, cf->pool, 1, sizeof(ngx_http_s3_auth_creds_ctx_t *)) != NGX_OK) {
+    return NULL;
+  }
+
+  if (ngx_array_init(&mcf->providers, cf->pool, 1, sizeof(ngx_http_s3_auth_provider_t *)) != NGX_OK) {
+    return NULL;
+  }
+
+  ngx_queue_init(&mcf->batch);
+
+  if (ngx_array_init(&mcf->signature_caches, cf->pool, 1, sizeof(ngx_shm_zone_t *)) != NGX_OK) {
+    return NULL;
+  }
+
+  return mcf;
+}
+
+static void *
+ngx_http_s3_auth_create_srv_conf(ngx_conf_t *cf)
+{
+  /* only upstream{} blocks with s3_sign_peers use it */
+  return ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_srv_conf_t));
+}
+
 static void *
 ngx_http_s3_auth_create_loc_conf(ngx_conf_t *cf)
 {
@@ -96,9 +658,44 @@ ngx_http_s3_auth_create_loc_conf(ngx_conf_t *cf)
     return NGX_CONF_ERROR;
   }
 
+  conf->streaming = NGX_CONF_UNSET;
+  conf->chunk_size = NGX_CONF_UNSET_SIZE;
+  conf->presign_expires = NGX_CONF_UNSET;
+  conf->verify = NGX_CONF_UNSET;
+  conf->verify_credentials = NGX_CONF_UNSET_PTR;
+  conf->signature_cache = NGX_CONF_UNSET_PTR;
+  conf->credentials_key = NGX_CONF_UNSET_PTR;
+  conf->credentials_map = NGX_CONF_UNSET_PTR;
+  conf->temporary_credentials = NGX_CONF_UNSET_PTR;
+  conf->sign_batch = NGX_CONF_UNSET_UINT;
+  conf->signed_headers = NGX_CONF_UNSET_PTR;
+  conf->set_headers = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+  conf->hash_thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+
   return conf;
 }
 
+/* the header list and Authorization prefix of the static or derived key,
+   a derived key gets its date into the scope on the first request of a day */
+static struct S3AuthTemplate *
+ngx_http_s3_auth_create_template(ngx_conf_t *cf, ngx_http_s3_auth_conf_t *conf)
+{
+  ngx_str_t key_scope = conf->key_scope;
+
+  if(conf->key_cache != NULL) {
+    key_scope.len = 8 + 1 + conf->region.len + 1 + conf->service.len + 1 + KEY_SCOPE_TERMINATOR.len;
+    key_scope.data = ngx_pnalloc(cf->pool, key_scope.len);
+    if(key_scope.data == NULL) {
+      return NULL;
+    }
+    ngx_sprintf(key_scope.data, "00000000/%V/%V/%V", &conf->region, &conf->service, &KEY_SCOPE_TERMINATOR);
+  }
+
+  return ngx_s3_auth__auth_template_create(cf->pool, &conf->endpoint, &conf->access_key, &key_scope);
+}
+
 static char *
 ngx_http_s3_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
@@ -109,6 +706,86 @@ ngx_http_s3_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
   ngx_conf_merge_str_value(conf->key_scope, prev->key_scope, "");
   ngx_conf_merge_str_value(conf->signing_key, prev->signing_key, "");
   ngx_conf_merge_str_value(conf->endpoint, prev->endpoint, "");
+  ngx_conf_merge_str_value(conf->secret_key, prev->secret_key, "");
+  ngx_conf_merge_str_value(conf->region, prev->region, "");
+  ngx_conf_merge_str_value(conf->service, prev->service, "s3");
+  ngx_conf_merge_value(conf->streaming, prev->streaming, 0);
+  ngx_conf_merge_size_value(conf->chunk_size, prev->chunk_size, 64 * 1024);
+  ngx_conf_merge_sec_value(conf->presign_expires, prev->presign_expires, 3600);
+  ngx_conf_merge_str_value(conf->presign_scheme, prev->presign_scheme, "https");
+  ngx_conf_merge_value(conf->verify, prev->verify, 0);
+  ngx_conf_merge_ptr_value(conf->verify_credentials, prev->verify_credentials, NULL);
+  ngx_conf_merge_ptr_value(conf->signature_cache, prev->signature_cache, NULL);
+  ngx_conf_merge_ptr_value(conf->credentials_key, prev->credentials_key, NULL);
+  ngx_conf_merge_ptr_value(conf->credentials_map, prev->credentials_map, NULL);
+  ngx_conf_merge_ptr_value(conf->temporary_credentials, prev->temporary_credentials, NULL);
+  ngx_conf_merge_uint_value(conf->sign_batch, prev->sign_batch, 0);
+  ngx_conf_merge_ptr_value(conf->signed_headers, prev->signed_headers, NULL);
+  ngx_conf_merge_value(conf->set_headers, prev->set_headers, 1);
+#if (NGX_THREADS)
+  ngx_conf_merge_ptr_value(conf->hash_thread_pool, prev->hash_thread_pool, NULL);
+#endif
+
+  if(conf->verify && conf->verify_credentials == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_verify\" requires \"s3_verify_credential\"");
+    return NGX_CONF_ERROR;
+  }
+
+  if(conf->temporary_credentials != NULL && conf->region.len > 0) {
+    /* keys are derived once per refresh, for the region of the first location using them */
+    if(conf->temporary_credentials->region.len == 0) {
+      conf->temporary_credentials->region = conf->region;
+      conf->temporary_credentials->service = conf->service;
+    } else if(conf->temporary_credentials->region.len != conf->region.len
+              || ngx_strncmp(conf->temporary_credentials->region.data, conf->region.data, conf->region.len) != 0
+              || conf->temporary_credentials->service.len != conf->service.len
+              || ngx_strncmp(conf->temporary_credentials->service.data, conf->service.data,
+                             conf->service.len) != 0)
+      {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_temporary_credentials\" of \"%V\" are used "
+                           "with different \"s3_region\" or \"s3_service\"", &conf->temporary_credentials->source);
+        return NGX_CONF_ERROR;
+      }
+  }
+
+  if(conf->presign_expires < 1 || conf->presign_expires > NGX_S3_AUTH_PRESIGN_MAX_EXPIRES) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_presign_expires\" must be between 1s and 7d");
+    return NGX_CONF_ERROR;
+  }
+
+  if(conf->chunk_size < NGX_S3_AUTH_CHUNK_MIN_SIZE) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_streaming_chunk_size\" must be at least %uz",
+                       (size_t) NGX_S3_AUTH_CHUNK_MIN_SIZE);
+    return NGX_CONF_ERROR;
+  }
+
+  if(conf->secret_key.len > 0) {
+    if(conf->signing_key.len > 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_secret_key\" and \"s3_signing_key\" are mutually exclusive");
+      return NGX_CONF_ERROR;
+    }
+
+    if(conf->region.len == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_secret_key\" requires \"s3_region\"");
+      return NGX_CONF_ERROR;
+    }
+
+    if(prev->key_cache != NULL
+       && conf->secret_key.data == prev->secret_key.data
+       && conf->region.data == prev->region.data
+       && conf->service.data == prev->service.data)
+      {
+        /* nothing changed since the enclosing level, share its keys */
+        conf->key_cache = prev->key_cache;
+      }
+    else
+      {
+        conf->key_cache = ngx_http_s3_auth_add_key_cache(cf, conf);
+        if(conf->key_cache == NULL) {
+          return NGX_CONF_ERROR;
+        }
+      }
+  }
 
   if(conf->signing_key_decoded.data == NULL)
     {
@@ -125,83 +802,3794 @@ ngx_http_s3_auth_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_decode_base64(&conf->signing_key_decoded, &conf->signing_key);
   }
 
+  if(prev->signing_hmac_key != NULL && conf->signing_key.data == prev->signing_key.data) {
+    conf->signing_hmac_key = prev->signing_hmac_key;
+    conf->signing_key_fingerprint = prev->signing_key_fingerprint;
+  } else if(conf->signing_key.len > 0) {
+    /* ipad/opad are absorbed once here, workers inherit the state on fork */
+    conf->signing_hmac_key = ngx_s3_auth__hmac_key_create(cf->pool);
+    conf->signing_key_fingerprint.data = ngx_pnalloc(cf->pool, NGX_S3_AUTH_FINGERPRINT_LEN);
+    if(conf->signing_hmac_key == NULL || conf->signing_key_fingerprint.data == NULL
+       || ngx_s3_auth__hmac_key_set(conf->signing_hmac_key, &conf->signing_key_decoded) != NGX_OK)
+      {
+        return NGX_CONF_ERROR;
+      }
+    ngx_s3_auth__key_fingerprint(&conf->signing_key_decoded, conf->signing_key_fingerprint.data);
+    conf->signing_key_fingerprint.len = NGX_S3_AUTH_FINGERPRINT_LEN;
+  }
+
+  if(prev->auth_template != NULL && conf->access_key.data == prev->access_key.data
+     && conf->key_scope.data == prev->key_scope.data && conf->endpoint.data == prev->endpoint.data
+     && conf->key_cache == prev->key_cache)
+    {
+      conf->auth_template = prev->auth_template;
+    }
+  else if(conf->signing_hmac_key != NULL || conf->key_cache != NULL)
+    {
+      conf->auth_template = ngx_http_s3_auth_create_template(cf, conf);
+      if(conf->auth_template == NULL) {
+        return NGX_CONF_ERROR;
+      }
+    }
+
   return NGX_CONF_OK;
 }
 
-static ngx_int_t
-ngx_http_s3_proxy_sign(ngx_http_request_t *r)
+static struct S3SigningKeyCache *
+ngx_http_s3_auth_add_key_cache(ngx_conf_t *cf, ngx_http_s3_auth_conf_t *conf)
 {
-  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
-  if(!conf->enabled) {
-    /* return directly if module is not enabled */
-    return NGX_DECLINED;
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+  struct S3SigningKeyCache *cache, **cache_ptr;
+
+  cache = ngx_s3_auth__signing_key_cache_create(cf->pool, &conf->secret_key, &conf->region, &conf->service);
+  if(cache == NULL) {
+    return NULL;
   }
-  ngx_table_elt_t *h;
-  header_pair_t *hv;
 
-  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-    /* We do not wish to support anything with a body as signing for a body is unimplemented */
-    return NGX_HTTP_NOT_ALLOWED;
+  cache_ptr = ngx_array_push(&mcf->key_caches);
+  if(cache_ptr == NULL) {
+    return NULL;
   }
+  *cache_ptr = cache;
 
-  const ngx_array_t* headers_out = ngx_s3_auth__sign(
-    r->pool, r,
-    &conf->access_key,
-    &conf->signing_key_decoded,
-    &conf->key_scope,
-    &conf->endpoint);
+  return cache;
+}
 
-  ngx_uint_t i;
-  for(i = 0; i < headers_out->nelts; i++)
-    {
-      hv = (header_pair_t*)((u_char *) headers_out->elts + headers_out->size * i);
-      ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                     "header name %s, value %s", hv->key.data, hv->value.data);
+/* s3_auth_status */
 
-      if(ngx_strncmp(hv->key.data, HOST_HEADER.data, hv->key.len) == 0) {
-        /* host header is controlled by proxy pass directive and hence
-           cannot be set by our module */
-        continue;
-      }
+typedef struct {
+  ngx_str_t name;
+  ngx_str_t help;
+} ngx_http_s3_auth_metric_t;
 
-      h = ngx_list_push(&r->headers_in.headers);
-      if (h == NULL) {
-        return NGX_ERROR;
-      }
+static ngx_http_s3_auth_metric_t ngx_http_s3_auth_counter_metrics[NGX_HTTP_S3_AUTH_COUNTERS] = {
+  { ngx_string("s3_auth_requests_signed_total"), ngx_string("Requests signed.") },
+  { ngx_string("s3_auth_requests_rejected_total"), ngx_string("Requests rejected for a method that is not signed.") },
+  { ngx_string("s3_auth_signing_errors_total"), ngx_string("Requests which failed to be signed.") },
+  { ngx_string("s3_auth_key_cache_hits_total"), ngx_string("Signing keys found derived for the day.") },
+  { ngx_string("s3_auth_key_cache_misses_total"), ngx_string("Signing keys derived while signing a request.") },
+  { ngx_string("s3_auth_credentials_map_hits_total"), ngx_string("Buckets found in s3_credentials_map.") },
+  { ngx_string("s3_auth_credentials_map_misses_total"), ngx_string("Buckets missing from s3_credentials_map.") },
+  { ngx_string("s3_auth_hashed_bytes_total"), ngx_string("Request body bytes hashed.") },
+  { ngx_string("s3_auth_requests_deferred_total"),
+    ngx_string("Requests left to be signed when the upstream request is made.") },
+  { ngx_string("s3_auth_peer_signatures_total"),
+    ngx_string("Requests signed again for the upstream server they were sent to.") },
+};
 
-      h->hash = 1;
-      h->key = hv->key;
-      h->lowcase_key = hv->key.data; /* We ensure that header names are already lowercased */
-      h->value = hv->value;
-    }
-  return NGX_OK;
-}
+static ngx_str_t ngx_http_s3_auth_stage_names[NGX_S3_AUTH_STAGES] = {
+  ngx_string("canonical_request"),
+  ngx_string("string_to_sign"),
+  ngx_string("hmac"),
+};
 
-static char *
-ngx_http_s3_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+#define NGX_HTTP_S3_AUTH_METRIC_LINE_LEN (128 + NGX_ATOMIC_T_LEN)
+
+static ngx_int_t
+ngx_http_s3_auth_init_status_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
-  char *p = conf;
-  ngx_str_t *field, *value;
+  ngx_http_s3_auth_main_conf_t *omcf = data;
+  ngx_http_s3_auth_main_conf_t *mcf = shm_zone->data;
+  ngx_slab_pool_t *shpool;
 
-  field = (ngx_str_t *)(p + cmd->offset);
+  if(omcf != NULL) {
+    /* reload, the counters keep counting */
+    mcf->stats = omcf->stats;
+    return NGX_OK;
+  }
+
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if(shm_zone->shm.exists) {
+    mcf->stats = shpool->data;
+    return NGX_OK;
+  }
+
+  mcf->stats = ngx_slab_calloc(shpool, sizeof(ngx_http_s3_auth_stats_t));
+  if(mcf->stats == NULL) {
+    return NGX_ERROR;
+  }
+  shpool->data = mcf->stats;
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_s3_auth_count(ngx_http_request_t *r, ngx_uint_t counter, ngx_atomic_int_t n)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+
+  if(mcf->stats != NULL) {
+    (void) ngx_atomic_fetch_add(&mcf->stats->counters[counter], n);
+  }
+}
+
+static void
+ngx_http_s3_auth_observe(ngx_http_s3_auth_stats_t *stats, const struct S3SignTimings *timings)
+{
+  ngx_uint_t i;
+
+  for(i = 0; i < NGX_S3_AUTH_STAGES; i++) {
+    (void) ngx_atomic_fetch_add(&stats->stages[i].buckets[ngx_s3_auth__latency_bucket(timings->nsec[i])], 1);
+    (void) ngx_atomic_fetch_add(&stats->stages[i].nsec, (ngx_atomic_int_t) timings->nsec[i]);
+  }
+}
+
+static u_char *
+ngx_http_s3_auth_write_metric_header(u_char *p, const ngx_http_s3_auth_metric_t *metric, const char *type)
+{
+  return ngx_sprintf(p, "# HELP %V %V\n# TYPE %V %s\n", &metric->name, &metric->help, &metric->name, type);
+}
+
+/* the Prometheus text format, version 0.0.4 */
+static ngx_int_t
+ngx_http_s3_auth_status_handler(ngx_http_request_t *r)
+{
+  static ngx_http_s3_auth_metric_t duration = {
+    ngx_string("s3_auth_signing_duration_seconds"), ngx_string("Time spent in each stage of signing a request.")
+  };
+  static ngx_http_s3_auth_metric_t cache_metrics[] = {
+    { ngx_string("s3_auth_signature_cache_hits_total"), ngx_string("Signatures reused from s3_signature_cache.") },
+    { ngx_string("s3_auth_signature_cache_misses_total"), ngx_string("Signatures missing from s3_signature_cache.") },
+  };
+
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_stats_t *stats = mcf->stats;
+  ngx_http_s3_auth_sig_cache_ctx_t *cache;
+  ngx_atomic_uint_t count, nsec;
+  ngx_shm_zone_t **zones;
+  ngx_uint_t i, j;
+  ngx_chain_t out;
+  ngx_int_t rc;
+  ngx_buf_t *b;
+  size_t len;
+
+  if(!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  if(stats == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  zones = mcf->signature_caches.elts;
+
+  len = (NGX_HTTP_S3_AUTH_COUNTERS * 3
+         + 2 + NGX_S3_AUTH_STAGES * (NGX_S3_AUTH_LATENCY_BUCKETS + 3)
+         + 2 * (2 + mcf->signature_caches.nelts)) * NGX_HTTP_S3_AUTH_METRIC_LINE_LEN;
+  for(i = 0; i < mcf->signature_caches.nelts; i++) {
+    len += 2 * zones[i]->shm.name.len;
+  }
+
+  b = ngx_create_temp_buf(r->pool, len);
+  if(b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  for(i = 0; i < NGX_HTTP_S3_AUTH_COUNTERS; i++) {
+    b->last = ngx_http_s3_auth_write_metric_header(b->last, &ngx_http_s3_auth_counter_metrics[i], "counter");
+    b->last = ngx_sprintf(b->last, "%V %uA\n", &ngx_http_s3_auth_counter_metrics[i].name, stats->counters[i]);
+  }
+
+  b->last = ngx_http_s3_auth_write_metric_header(b->last, &duration, "histogram");
+  for(i = 0; i < NGX_S3_AUTH_STAGES; i++) {
+    count = 0;
+    for(j = 0; j < NGX_S3_AUTH_LATENCY_BUCKETS; j++) {
+      count += stats->stages[i].buckets[j];
+      b->last = ngx_sprintf(b->last, "%V_bucket{stage=\"%V\",le=\"0.%09uL\"} %uA\n", &duration.name,
+                            &ngx_http_s3_auth_stage_names[i], ngx_s3_auth__latency_bucket_bound(j), count);
+    }
+    count += stats->stages[i].buckets[NGX_S3_AUTH_LATENCY_BUCKETS];
+    nsec = stats->stages[i].nsec;
+
+    b->last = ngx_sprintf(b->last, "%V_bucket{stage=\"%V\",le=\"+Inf\"} %uA\n"
+                          "%V_sum{stage=\"%V\"} %uA.%09uA\n"
+                          "%V_count{stage=\"%V\"} %uA\n",
+                          &duration.name, &ngx_http_s3_auth_stage_names[i], count,
+                          &duration.name, &ngx_http_s3_auth_stage_names[i], nsec / 1000000000, nsec % 1000000000,
+                          &duration.name, &ngx_http_s3_auth_stage_names[i], count);
+  }
+
+  for(i = 0; i < 2 && mcf->signature_caches.nelts > 0; i++) {
+    b->last = ngx_http_s3_auth_write_metric_header(b->last, &cache_metrics[i], "counter");
+    for(j = 0; j < mcf->signature_caches.nelts; j++) {
+      cache = zones[j]->data;
+      b->last = ngx_sprintf(b->last, "%V{zone=\"%V\"} %uA\n", &cache_metrics[i].name, &zones[j]->shm.name,
+                            i == 0 ? cache->sh->hits : cache->sh->misses);
+    }
+  }
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+  rc = ngx_http_send_header(r);
+  if(rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  b->last_buf = (r == r->main);
+  b->last_in_chain = 1;
+
+  out.buf = b;
+  out.next = NULL;
+
+  return ngx_http_output_filter(r, &out);
+}
+
+static ngx_int_t
+ngx_http_s3_auth_init_process(ngx_cycle_t *cycle)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_creds_ctx_t **maps;
+  ngx_http_s3_auth_provider_t **providers;
+  ngx_uint_t i;
+
+  if(mcf == NULL) {
+    return NGX_OK;
+  }
+
+  maps = mcf->credentials_maps.elts;
+  for(i = 0; i < mcf->credentials_maps.nelts; i++) {
+    maps[i]->reload.handler = ngx_http_s3_auth_reload_credentials;
+    maps[i]->reload.data = maps[i];
+    maps[i]->reload.log = cycle->log;
+    maps[i]->reload.cancelable = 1;
+
+    ngx_add_timer(&maps[i]->reload, maps[i]->interval);
+  }
+
+  mcf->batch_flush.handler = ngx_http_s3_auth_batch_handler;
+  mcf->batch_flush.data = mcf;
+  mcf->batch_flush.log = cycle->log;
+
+  providers = mcf->providers.elts;
+  for(i = 0; i < mcf->providers.nelts; i++) {
+    providers[i]->timer.handler = ngx_http_s3_auth_refresh_credentials;
+    providers[i]->timer.data = providers[i];
+    providers[i]->timer.log = cycle->log;
+    providers[i]->timer.cancelable = 1;
+
+    ngx_http_s3_auth_refresh_credentials(&providers[i]->timer);
+  }
+
+  if(mcf->key_caches.nelts == 0) {
+    return NGX_OK;
+  }
+
+  mcf->key_rotation.handler = ngx_http_s3_auth_rotate_keys;
+  mcf->key_rotation.data = mcf;
+  mcf->key_rotation.log = cycle->log;
+  mcf->key_rotation.cancelable = 1;
+
+  ngx_http_s3_auth_rotate_keys(&mcf->key_rotation);
+
+  return NGX_OK;
+}
+
+/* derives the keys for today and tomorrow and wakes up again right after
+   the next UTC midnight, so requests never pay for the derivation */
+static void
+ngx_http_s3_auth_rotate_keys(ngx_event_t *ev)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ev->data;
+  struct S3SigningKeyCache **caches = mcf->key_caches.elts;
+  time_t now = ngx_time();
+  ngx_uint_t i;
+
+  /* queued requests refer to the slots */
+  ngx_http_s3_auth_flush_batch(mcf);
+
+  for(i = 0; i < mcf->key_caches.nelts; i++) {
+    ngx_s3_auth__signing_key_rotate(caches[i], now);
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                 "s3 auth: rotated %ui signing keys", mcf->key_caches.nelts);
+
+  ngx_add_timer(ev, (NGX_S3_AUTH_DAY_SECONDS - now % NGX_S3_AUTH_DAY_SECONDS) * 1000);
+}
+
+/* the credentials of the bucket s3_credentials_map resolves the request to */
+static ngx_int_t
+ngx_http_s3_auth_mapped_key(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf, ngx_http_s3_auth_key_t *key)
+{
+  ngx_http_s3_auth_creds_ctx_t *ctx = conf->credentials_map->data;
+  ngx_s3_auth__hmac_key_t *hmac_key;
+  struct S3CredentialEntry *entry;
+  ngx_str_t bucket, *mapped;
+  ngx_int_t rc;
+
+  if(ngx_http_complex_value(r, conf->credentials_key, &bucket) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* key scope, signing key, access key, fingerprint */
+  mapped = ngx_palloc(r->pool, 4 * sizeof(ngx_str_t));
+  hmac_key = ngx_s3_auth__hmac_key_create(r->pool);
+  if(mapped == NULL || hmac_key == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  entry = ctx->sh->table != NULL ? ngx_s3_auth__credentials_lookup(ctx->sh->table, &bucket) : NULL;
+  if(entry == NULL) {
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_CREDENTIAL_MISSES, 1);
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: no credentials for \"%V\"", &bucket);
+    return NGX_HTTP_FORBIDDEN;
+  }
+
+  rc = ngx_s3_auth__credential_signing_key(r->pool, entry, key->sec, &mapped[0], &mapped[1], &mapped[3]);
+
+  mapped[2].len = entry->access_key.len;
+  mapped[2].data = ngx_pnalloc(r->pool, mapped[2].len);
+  if(mapped[2].data != NULL) {
+    ngx_memcpy(mapped[2].data, entry->access_key.data, mapped[2].len);
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+  ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_CREDENTIAL_HITS, 1);
+
+  if(rc != NGX_OK || mapped[2].data == NULL || ngx_s3_auth__hmac_key_set(hmac_key, &mapped[1]) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  key->signing_key = hmac_key;
+  key->key_scope = &mapped[0];
+  key->raw_key = &mapped[1];
+  key->key_fingerprint = &mapped[3];
+  key->access_key = &mapped[2];
+
+  return NGX_OK;
+}
+
+static const struct S3SigningKeySlot *
+ngx_http_s3_auth_key_lookup(ngx_http_request_t *r, struct S3SigningKeyCache *cache, time_t sec)
+{
+  const struct S3SigningKeySlot *slot;
+  ngx_uint_t misses = cache->misses;
+
+  slot = ngx_s3_auth__signing_key_find(cache, sec);
+  if(slot == NULL) {
+    /* queued requests refer to the slots the lookup rederives */
+    ngx_http_s3_auth_flush_batch(ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module));
+    slot = ngx_s3_auth__signing_key_lookup(cache, sec);
+  }
+
+  ngx_http_s3_auth_count(r, cache->misses == misses ? NGX_HTTP_S3_AUTH_KEY_CACHE_HITS
+                                                    : NGX_HTTP_S3_AUTH_KEY_CACHE_MISSES, 1);
+
+  return slot;
+}
+
+/* the current temporary credentials; the access key and the token are copied,
+   a refresh may replace them while the request is still around */
+static ngx_int_t
+ngx_http_s3_auth_temporary_key(ngx_http_request_t *r, ngx_http_s3_auth_provider_t *provider,
+                               ngx_http_s3_auth_key_t *key)
+{
+  ngx_http_s3_auth_temp_creds_t *creds = provider->current;
+  const struct S3SigningKeySlot *slot;
+  ngx_str_t *copy;
+
+  if(creds == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "s3 auth: no temporary credentials from \"%V\" yet",
+                  &provider->source);
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  slot = ngx_http_s3_auth_key_lookup(r, creds->key_cache, key->sec);
+  copy = ngx_palloc(r->pool, 2 * sizeof(ngx_str_t));
+  if(slot == NULL || copy == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  copy[0].len = creds->access_key.len;
+  copy[1].len = creds->session_token.len;
+  copy[0].data = ngx_pnalloc(r->pool, copy[0].len + copy[1].len);
+  if(copy[0].data == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  copy[1].data = ngx_cpymem(copy[0].data, creds->access_key.data, copy[0].len);
+  ngx_memcpy(copy[1].data, creds->session_token.data, copy[1].len);
+
+  key->signing_key = slot->hmac_key;
+  key->key_scope = &slot->key_scope;
+  key->raw_key = &slot->signing_key;
+  key->key_fingerprint = &slot->fingerprint;
+  key->access_key = &copy[0];
+  key->transient = 1;
+
+  if(copy[1].len > 0) {
+    key->session_token = &copy[1];
+    key->extra_headers = ngx_s3_auth__security_token_headers(r->pool, key->session_token);
+    if(key->extra_headers == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* the s3_signed_headers the client sent, merged into key->extra_headers;
+   one pass over the request headers, the names were sorted at configuration */
+static ngx_int_t
+ngx_http_s3_auth_client_headers(ngx_http_request_t *r, ngx_http_s3_auth_signed_headers_t *sh,
+                                ngx_http_s3_auth_key_t *key)
+{
+  header_pair_t *names = sh->names.elts, *found, *name;
+  const ngx_array_t *ours = key->extra_headers;
+  ngx_list_part_t *part = &r->headers_in.headers.part;
+  ngx_table_elt_t *h = part->elts;
+  ngx_array_t *headers;
+  ngx_str_t value;
+  ngx_uint_t i, n;
+
+  found = ngx_pcalloc(r->pool, sh->names.nelts * sizeof(header_pair_t));
+  if(found == NULL) {
+    return NGX_ERROR;
+  }
+
+  for(i = 0; /* void */; i++) {
+    if(i >= part->nelts) {
+      if(part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if(h[i].hash == 0) {
+      continue;
+    }
+
+    name = ngx_hash_find(&sh->hash, h[i].hash, h[i].lowcase_key, h[i].key.len);
+    if(name == NULL) {
+      continue;
+    }
+
+    value = ngx_s3_auth__trim_header_value(r->pool, h[i].value);
+    if(ngx_s3_auth__join_header_value(r->pool, &found[name - names], &value) != NGX_OK) {
+      return NGX_ERROR;
+    }
+    found[name - names].key = name->key;
+  }
+
+  /* headers the client did not send are not signed */
+  for(i = 0, n = 0; i < sh->names.nelts; i++) {
+    if(found[i].key.len > 0) {
+      found[n++] = found[i];
+    }
+  }
+
+  if(n == 0) {
+    return NGX_OK;
+  }
+
+  headers = ngx_array_create(r->pool, n + (ours != NULL ? ours->nelts : 0), sizeof(header_pair_t));
+  if(headers == NULL
+     || ngx_s3_auth__merge_headers(headers, found, n, ours != NULL ? ours->elts : NULL,
+                                   ours != NULL ? ours->nelts : 0) != NGX_OK)
+    {
+      return NGX_ERROR;
+    }
+
+  key->extra_headers = headers;
+
+  return NGX_OK;
+}
+
+/* the key to sign with at sec: the one of the mapped bucket, the
+   temporary one, the static one or that day's derived one */
+static ngx_int_t
+ngx_http_s3_auth_select_key(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf, ngx_http_s3_auth_key_t *key,
+                            time_t sec)
+{
+  ngx_memzero(key, sizeof(ngx_http_s3_auth_key_t));
+  key->sec = sec;
+
+  if(conf->credentials_map != NULL) {
+    return ngx_http_s3_auth_mapped_key(r, conf, key);
+  }
+
+  if(conf->temporary_credentials != NULL) {
+    return ngx_http_s3_auth_temporary_key(r, conf->temporary_credentials, key);
+  }
+
+  key->access_key = &conf->access_key;
+  key->signing_key = conf->signing_hmac_key;
+  key->key_scope = &conf->key_scope;
+  key->raw_key = &conf->signing_key_decoded;
+  key->key_fingerprint = &conf->signing_key_fingerprint;
+
+  if(conf->key_cache != NULL) {
+    const struct S3SigningKeySlot *slot = ngx_http_s3_auth_key_lookup(r, conf->key_cache, sec);
+    if(slot == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* the slot is rederived after midnight */
+    key->signing_key = slot->hmac_key;
+    key->key_scope = &slot->key_scope;
+    key->raw_key = &slot->signing_key;
+    key->key_fingerprint = &slot->fingerprint;
+    key->transient = 1;
+  }
+
+  if(key->signing_key == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "s3 auth: no signing key configured");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(conf->auth_template != NULL
+     && ngx_s3_auth__auth_template_scope(conf->auth_template, key->key_scope) == NGX_OK)
+    {
+      key->auth_template = conf->auth_template;
+    }
+
+  return NGX_OK;
+}
+
+/* the key and the headers to sign with */
+static ngx_int_t
+ngx_http_s3_auth_signing_key(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf, ngx_http_s3_auth_key_t *key,
+                             time_t sec)
+{
+  ngx_int_t rc;
+
+  rc = ngx_http_s3_auth_select_key(r, conf, key, sec);
+  if(rc != NGX_OK || conf->signed_headers == NULL) {
+    return rc;
+  }
+
+  if(ngx_http_s3_auth_client_headers(r, conf->signed_headers, key) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(key->extra_headers != NULL) {
+    key->auth_template = NULL;
+  }
+
+  return NGX_OK;
+}
+
+static ngx_http_s3_auth_ctx_t *
+ngx_http_s3_auth_get_ctx(ngx_http_request_t *r)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+
+  if(ctx == NULL) {
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_s3_auth_ctx_t));
+    if(ctx == NULL) {
+      return NULL;
+    }
+    ngx_http_set_ctx(r, ctx, ngx_http_s3_auth_module);
+  }
+
+  return ctx;
+}
+
+static ngx_table_elt_t *
+ngx_http_s3_auth_find_header(ngx_list_t *headers, const ngx_str_t *name)
+{
+  ngx_list_part_t *part = &headers->part;
+  ngx_table_elt_t *h = part->elts;
+  ngx_uint_t i;
+
+  for(i = 0; /* void */; i++) {
+    if(i >= part->nelts) {
+      if(part->next == NULL) {
+        return NULL;
+      }
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if(h[i].hash != 0 && h[i].key.len == name->len
+       && ngx_strncasecmp(h[i].key.data, name->data, name->len) == 0)
+      {
+        return &h[i];
+      }
+  }
+}
+
+static ngx_int_t
+ngx_http_s3_auth_set_headers(ngx_http_request_t *r, const ngx_array_t *headers_out)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_header_var_t *var;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_table_elt_t *h;
+  header_pair_t *hv;
+  ngx_uint_t i, j;
+
+  ctx = ngx_http_s3_auth_get_ctx(r);
+  if(ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  for(i = 0; i < headers_out->nelts; i++)
+    {
+      hv = (header_pair_t*)((u_char *) headers_out->elts + headers_out->size * i);
+      ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                     "header name %V, value %V", &hv->key, &hv->value);
+
+      if(ngx_strncmp(hv->key.data, HOST_HEADER.data, hv->key.len) == 0) {
+        /* host header is controlled by proxy pass directive and hence
+           cannot be set by our module */
+        continue;
+      }
+
+      if(conf->signed_headers != NULL
+         && ngx_hash_find(&conf->signed_headers->hash, ngx_hash_key(hv->key.data, hv->key.len),
+                          hv->key.data, hv->key.len) != NULL)
+        {
+          /* s3_signed_headers go to the backend the way the client sent them */
+          continue;
+        }
+
+      for(j = 0; j < sizeof(ngx_http_s3_auth_header_vars) / sizeof(ngx_http_s3_auth_header_vars[0]); j++) {
+        var = &ngx_http_s3_auth_header_vars[j];
+        if(hv->key.len == var->name->len && ngx_strncmp(hv->key.data, var->name->data, hv->key.len) == 0) {
+          *(const ngx_str_t **) ((u_char *) ctx + var->offset) = &hv->value;
+          break;
+        }
+      }
+
+      if(!conf->set_headers && j < sizeof(ngx_http_s3_auth_header_vars) / sizeof(ngx_http_s3_auth_header_vars[0])) {
+        /* left to proxy_set_header and the variables */
+        continue;
+      }
+
+      /* a client may have sent its own signature (s3_verify), ours replaces it */
+      h = ngx_http_s3_auth_find_header(&r->headers_in.headers, &hv->key);
+      if (h == NULL) {
+        h = ngx_list_push(&r->headers_in.headers);
+        if (h == NULL) {
+          return NGX_ERROR;
+        }
+      }
+
+      h->hash = 1;
+      h->key = hv->key;
+      h->lowcase_key = hv->key.data; /* We ensure that header names are already lowercased */
+      h->value = hv->value;
+    }
+
+  ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_SIGNED, 1);
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_init_sig_cache_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_s3_auth_sig_cache_ctx_t *octx = data;
+  ngx_http_s3_auth_sig_cache_ctx_t *ctx = shm_zone->data;
+  size_t len;
+
+  if(octx != NULL) {
+    /* reload, every entry is keyed on the signing key, stale ones never match */
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if(shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  ctx->sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_http_s3_auth_sig_cache_sh_t));
+  if(ctx->sh == NULL) {
+    return NGX_ERROR;
+  }
+  ctx->shpool->data = ctx->sh;
+
+  ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel, ngx_rbtree_insert_value);
+  ngx_queue_init(&ctx->sh->queue);
+
+  len = sizeof(" in s3 signature cache \"\"") + shm_zone->shm.name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if(ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(ctx->shpool->log_ctx, " in s3 signature cache \"%V\"%Z", &shm_zone->shm.name);
+
+  /* a full zone is handled by dropping the least recently used entries */
+  ctx->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+/* shpool is locked */
+static ngx_http_s3_auth_sig_cache_node_t *
+ngx_http_s3_auth_sig_cache_find(ngx_http_s3_auth_sig_cache_ctx_t *ctx, const ngx_str_t *key, uint32_t hash)
+{
+  ngx_http_s3_auth_sig_cache_node_t *sn;
+  ngx_rbtree_node_t *node, *sentinel;
+
+  node = ctx->sh->rbtree.root;
+  sentinel = ctx->sh->rbtree.sentinel;
+
+  while(node != sentinel) {
+    if(hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+
+    sn = (ngx_http_s3_auth_sig_cache_node_t *) node;
+    if(sn->len == key->len && ngx_memcmp(sn->data, key->data, key->len) == 0) {
+      return sn;
+    }
+
+    /* ngx_rbtree_insert_value puts equal keys to the right */
+    node = node->right;
+  }
+
+  return NULL;
+}
+
+/* drops the least recently used entries signed before sec, or the least
+   recently used one if force is set; shpool is locked */
+static void
+ngx_http_s3_auth_sig_cache_expire(ngx_http_s3_auth_sig_cache_ctx_t *ctx, time_t sec, ngx_uint_t force)
+{
+  ngx_http_s3_auth_sig_cache_node_t *sn;
+  ngx_queue_t *q;
+
+  while(!ngx_queue_empty(&ctx->sh->queue)) {
+    q = ngx_queue_last(&ctx->sh->queue);
+    sn = ngx_queue_data(q, ngx_http_s3_auth_sig_cache_node_t, queue);
+
+    if(!force && sn->sec >= sec) {
+      return;
+    }
+    force = 0;
+
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &sn->node);
+    ngx_slab_free_locked(ctx->shpool, sn);
+  }
+}
+
+/* NGX_OK and the signature if key was signed in second sec already */
+static ngx_int_t
+ngx_http_s3_auth_sig_cache_lookup(ngx_shm_zone_t *zone, const ngx_str_t *key, uint32_t hash,
+                                  time_t sec, u_char *signature)
+{
+  ngx_http_s3_auth_sig_cache_ctx_t *ctx = zone->data;
+  ngx_http_s3_auth_sig_cache_node_t *sn;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  sn = ngx_http_s3_auth_sig_cache_find(ctx, key, hash);
+  if(sn == NULL || sn->sec != sec) {
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    (void) ngx_atomic_fetch_add(&ctx->sh->misses, 1);
+    return NGX_DECLINED;
+  }
+
+  ngx_memcpy(signature, sn->signature, NGX_S3_AUTH_SIGNATURE_LEN);
+  ngx_queue_remove(&sn->queue);
+  ngx_queue_insert_head(&ctx->sh->queue, &sn->queue);
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+  (void) ngx_atomic_fetch_add(&ctx->sh->hits, 1);
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_s3_auth_sig_cache_store(ngx_http_request_t *r, ngx_shm_zone_t *zone, const ngx_str_t *key,
+                                 uint32_t hash, time_t sec, const u_char *signature)
+{
+  ngx_http_s3_auth_sig_cache_ctx_t *ctx = zone->data;
+  ngx_http_s3_auth_sig_cache_node_t *sn;
+  size_t size;
+
+  size = offsetof(ngx_http_s3_auth_sig_cache_node_t, data) + key->len;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  /* entries of past seconds never hit again */
+  ngx_http_s3_auth_sig_cache_expire(ctx, sec, 0);
+
+  sn = ngx_http_s3_auth_sig_cache_find(ctx, key, hash);
+  if(sn != NULL) {
+    /* a newer second, or another worker has been quicker */
+    ngx_queue_remove(&sn->queue);
+  } else {
+    sn = ngx_slab_alloc_locked(ctx->shpool, size);
+    if(sn == NULL) {
+      ngx_http_s3_auth_sig_cache_expire(ctx, 0, 1);
+      sn = ngx_slab_alloc_locked(ctx->shpool, size);
+      if(sn == NULL) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                      "s3 auth: could not allocate node%s", ctx->shpool->log_ctx);
+        return;
+      }
+    }
+
+    sn->node.key = hash;
+    sn->len = key->len;
+    ngx_memcpy(sn->data, key->data, key->len);
+    ngx_rbtree_insert(&ctx->sh->rbtree, &sn->node);
+  }
+
+  sn->sec = sec;
+  ngx_memcpy(sn->signature, signature, NGX_S3_AUTH_SIGNATURE_LEN);
+  ngx_queue_insert_head(&ctx->sh->queue, &sn->queue);
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+/* keeps what went into the signature for the trace variables; details must
+   not have the Authorization header yet */
+static ngx_int_t
+ngx_http_s3_auth_trace(ngx_http_request_t *r, const struct S3SignedRequestDetails *details,
+                       const ngx_str_t *key_scope, const ngx_str_t *payload_hash)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_ctx_t *ctx;
+  struct S3SignatureTrace trace;
+
+  if(!mcf->trace) {
+    return NGX_OK;
+  }
+
+  ctx = ngx_http_s3_auth_get_ctx(r);
+  if(ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  if(ngx_s3_auth__trace_signature(r->pool, r, details, key_scope, payload_hash, &trace) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ctx->canonical_request = trace.canonical_request;
+  ctx->string_to_sign = trace.string_to_sign;
+  ctx->signed_headers = details->signed_header_names;
+  ctx->signature = details->signature;
+
+  return NGX_OK;
+}
+
+/* with s3_auth_status every stage is timed */
+static struct S3SignedRequestDetails
+ngx_http_s3_auth_compute_signature(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf,
+                                   const ngx_http_s3_auth_key_t *key, const ngx_str_t *payload_hash)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  struct S3SignedRequestDetails details;
+  struct S3SignTimings timings;
+
+  details = ngx_s3_auth__compute_signature_timed(r->pool, r, key->sec, key->signing_key, key->key_scope,
+                                                 &conf->endpoint, payload_hash, key->extra_headers,
+                                                 key->auth_template, mcf->time_cache,
+                                                 mcf->stats != NULL ? &timings : NULL);
+
+  if(mcf->stats != NULL && details.signature != NULL) {
+    ngx_http_s3_auth_observe(mcf->stats, &timings);
+  }
+
+  return details;
+}
+
+/* for ngx_http_s3_auth_get_peer, the key of the day or of temporary
+   credentials may be rotated away before the request is sent */
+static ngx_int_t
+ngx_http_s3_auth_keep_key(ngx_http_request_t *r, const ngx_http_s3_auth_key_t *key,
+                          const ngx_str_t *payload_hash)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_s3_auth_get_ctx(r);
+  ngx_http_s3_auth_key_t *kept;
+  ngx_str_t *copy;
+
+  kept = ngx_palloc(r->pool, sizeof(ngx_http_s3_auth_key_t));
+  if(ctx == NULL || kept == NULL) {
+    return NGX_ERROR;
+  }
+
+  *kept = *key;
+
+  if(key->transient) {
+    copy = ngx_palloc(r->pool, 2 * sizeof(ngx_str_t));
+    if(copy == NULL) {
+      return NGX_ERROR;
+    }
+
+    copy[0].len = key->raw_key->len;
+    copy[0].data = ngx_pstrdup(r->pool, (ngx_str_t *) key->raw_key);
+    copy[1].len = key->key_scope->len;
+    copy[1].data = ngx_pstrdup(r->pool, (ngx_str_t *) key->key_scope);
+    if(copy[0].data == NULL || copy[1].data == NULL) {
+      return NGX_ERROR;
+    }
+
+    /* the HMAC key is made from raw_key again if a peer needs it */
+    kept->signing_key = NULL;
+    kept->raw_key = &copy[0];
+    kept->key_scope = &copy[1];
+  }
+
+  ctx->peer_key = kept;
+  ctx->peer_payload_hash = payload_hash;
+
+  return NGX_OK;
+}
+
+/* a body is read, and maybe hashed, before the request is signed: an upload
+   slower than the 15 minutes of clock skew S3 allows would be rejected with
+   the time it started */
+static time_t
+ngx_http_s3_auth_sign_time(ngx_http_request_t *r)
+{
+  return (r->method & (NGX_HTTP_PUT|NGX_HTTP_POST)) ? ngx_time() : r->start_sec;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_sign_request(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf,
+                              const ngx_str_t *payload_hash)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  u_char signature[NGX_S3_AUTH_SIGNATURE_LEN];
+  struct S3SignedRequestDetails details;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_http_s3_auth_key_t key;
+  const ngx_str_t *cache_key;
+  uint32_t hash;
+  ngx_int_t rc;
+
+  rc = ngx_http_s3_auth_signing_key(r, conf, &key, ngx_http_s3_auth_sign_time(r));
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  if(conf->signature_cache == NULL) {
+    details = ngx_http_s3_auth_compute_signature(r, conf, &key, payload_hash);
+    goto done;
+  }
+
+  /* for $s3_signature_cache_status */
+  ctx = ngx_http_s3_auth_get_ctx(r);
+  if(ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  cache_key = ngx_s3_auth__signature_cache_key(r->pool, r, &conf->endpoint, key.key_scope, payload_hash,
+                                               key.extra_headers, key.key_fingerprint);
+  if(cache_key == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  hash = ngx_murmur_hash2(cache_key->data, cache_key->len);
+
+  if(ngx_http_s3_auth_sig_cache_lookup(conf->signature_cache, cache_key, hash, key.sec, signature) == NGX_OK) {
+    ctx->signature_cache_status = NGX_HTTP_S3_AUTH_SIG_CACHE_HIT;
+    details = ngx_s3_auth__reuse_signature(r->pool, r, key.sec, key.key_scope, &conf->endpoint, payload_hash,
+                                           key.extra_headers, mcf->time_cache, signature);
+    goto done;
+  }
+
+  ctx->signature_cache_status = NGX_HTTP_S3_AUTH_SIG_CACHE_MISS;
+  details = ngx_http_s3_auth_compute_signature(r, conf, &key, payload_hash);
+  if(details.signature != NULL) {
+    /* a full zone only costs the next request its hit */
+    ngx_http_s3_auth_sig_cache_store(r, conf->signature_cache, cache_key, hash, key.sec,
+                                     details.signature->data);
+  }
+
+done:
+
+  if(details.signature == NULL || ngx_http_s3_auth_trace(r, &details, key.key_scope, payload_hash) != NGX_OK) {
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_ERRORS, 1);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  const ngx_array_t* headers_out = key.auth_template != NULL
+    ? ngx_s3_auth__add_auth_header_template(r->pool, &details, key.auth_template)
+    : ngx_s3_auth__add_auth_header(r->pool, &details, key.access_key, key.key_scope);
+  if(headers_out == NULL) {
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_ERRORS, 1);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(mcf->sign_peers && ngx_http_s3_auth_keep_key(r, &key, payload_hash) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  return ngx_http_s3_auth_set_headers(r, headers_out);
+}
+
+/* signs every queued request at once and wakes them up, they pick up
+   ctx->status in ngx_http_s3_proxy_sign */
+static void
+ngx_http_s3_auth_flush_batch(ngx_http_s3_auth_main_conf_t *mcf)
+{
+  ngx_http_s3_auth_batch_entry_t *entries[NGX_S3_AUTH_BATCH_MAX], *entry;
+  struct S3PendingSignature *pending[NGX_S3_AUTH_BATCH_MAX];
+  const ngx_array_t *headers_out;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_http_request_t *r;
+  ngx_queue_t *q;
+  ngx_uint_t i, n;
+  ngx_int_t rc;
+
+  if(mcf->batch_flush.posted) {
+    ngx_delete_posted_event(&mcf->batch_flush);
+  }
+
+  while(!ngx_queue_empty(&mcf->batch)) {
+    for(n = 0; n < NGX_S3_AUTH_BATCH_MAX && !ngx_queue_empty(&mcf->batch); n++) {
+      q = ngx_queue_head(&mcf->batch);
+      ngx_queue_remove(q);
+      entries[n] = ngx_queue_data(q, ngx_http_s3_auth_batch_entry_t, queue);
+      pending[n] = &entries[n]->pending;
+    }
+    mcf->batched -= n;
+
+    rc = ngx_s3_auth__complete_signatures(pending, n);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mcf->batch_flush.log, 0, "s3 auth: signed a batch of %ui", n);
+
+    for(i = 0; i < n; i++) {
+      entry = entries[i];
+      r = entry->r;
+      entry->r = NULL;
+
+      ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+      ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+      if(rc == NGX_OK && mcf->trace) {
+        ctx->canonical_request = &entry->pending.canonical_request;
+        ctx->string_to_sign = &entry->pending.string_to_sign;
+        ctx->signed_headers = entry->pending.details.signed_header_names;
+        ctx->signature = &entry->pending.signature;
+      }
+
+      if(rc == NGX_OK) {
+        headers_out = ngx_s3_auth__add_auth_header(r->pool, &entry->pending.details, entry->access_key,
+                                                   entry->key_scope);
+        if(headers_out != NULL) {
+          ctx->status = ngx_http_s3_auth_set_headers(r, headers_out);
+        }
+      }
+
+      if(ctx->status == NGX_HTTP_INTERNAL_SERVER_ERROR) {
+        ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_ERRORS, 1);
+      }
+
+      ngx_post_event(r->connection->write, &ngx_posted_events);
+    }
+  }
+}
+
+static void
+ngx_http_s3_auth_batch_handler(ngx_event_t *ev)
+{
+  ngx_http_s3_auth_flush_batch(ev->data);
+}
+
+/* the request went away before its batch was signed */
+static void
+ngx_http_s3_auth_batch_cleanup(void *data)
+{
+  ngx_http_s3_auth_batch_entry_t *entry = data;
+
+  if(entry->r != NULL) {
+    ngx_queue_remove(&entry->queue);
+    entry->mcf->batched--;
+  }
+}
+
+/* builds the canonical request and queues the request, hashing and HMAC of
+   everything queued during this event loop iteration run together right
+   after it, or as soon as s3_sign_batch requests are waiting */
+static ngx_int_t
+ngx_http_s3_auth_sign_batched(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_batch_entry_t *entry;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_http_s3_auth_key_t key;
+  ngx_pool_cleanup_t *cln;
+  ngx_int_t rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  if(ctx != NULL) {
+    /* resumed by ngx_http_s3_auth_flush_batch, or still NGX_AGAIN if woken up by something else */
+    return ctx->status;
+  }
+
+  rc = ngx_http_s3_auth_signing_key(r, conf, &key, r->start_sec);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_s3_auth_ctx_t));
+  entry = ngx_palloc(r->pool, sizeof(ngx_http_s3_auth_batch_entry_t));
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if(ctx == NULL || entry == NULL || cln == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(ngx_s3_auth__prepare_signature(r->pool, r, key.signing_key, key.key_scope, &conf->endpoint,
+                                    &EMPTY_STRING_SHA256, key.extra_headers, mcf->time_cache,
+                                    &entry->pending) != NGX_OK)
+    {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+  entry->r = r;
+  entry->mcf = mcf;
+  entry->access_key = key.access_key;
+  entry->key_scope = key.key_scope;
+
+  cln->handler = ngx_http_s3_auth_batch_cleanup;
+  cln->data = entry;
+
+  ctx->status = NGX_AGAIN;
+  ngx_http_set_ctx(r, ctx, ngx_http_s3_auth_module);
+
+  ngx_queue_insert_tail(&mcf->batch, &entry->queue);
+  mcf->batched++;
+
+  r->read_event_handler = ngx_http_test_reading;
+  r->write_event_handler = ngx_http_core_run_phases;
+
+  if(mcf->batched >= conf->sign_batch) {
+    ngx_http_s3_auth_flush_batch(mcf);
+  } else if(!mcf->batch_flush.posted) {
+    ngx_post_event(&mcf->batch_flush, &ngx_posted_events);
+  }
+
+  return NGX_AGAIN;
+}
+
+/* signs the headers of an aws-chunked upload, the body itself is framed and
+   signed chunk by chunk in ngx_http_s3_auth_chunked_body_filter while the
+   proxy module reads it */
+static ngx_int_t
+ngx_http_s3_auth_start_streaming(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf)
+{
+  const ngx_s3_auth__hmac_key_t *signing_key;
+  struct S3SignedRequestDetails details;
+  ngx_s3_auth__hmac_key_t *chunk_key;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_http_s3_auth_key_t key;
+  const ngx_str_t *date;
+  ngx_array_t *extra_headers;
+  ngx_table_elt_t *h;
+  header_pair_t decoded_length;
+  ngx_int_t rc;
+
+  if(r->headers_in.content_length_n < 0) {
+    /* the decoded length is signed before the body is read */
+    return NGX_HTTP_LENGTH_REQUIRED;
+  }
+
+  rc = ngx_http_s3_auth_signing_key(r, conf, &key, r->start_sec);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_s3_auth_ctx_t));
+  extra_headers = ngx_array_create(r->pool, 1 + (key.extra_headers != NULL ? key.extra_headers->nelts : 0),
+                                   sizeof(header_pair_t));
+  if(ctx == NULL || extra_headers == NULL) {
+    return NGX_ERROR;
+  }
+
+  decoded_length.key = DECODED_LENGTH_HEADER;
+  decoded_length.value.data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+  ctx->content_length.data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+  if(decoded_length.value.data == NULL || ctx->content_length.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  decoded_length.value.len = ngx_sprintf(decoded_length.value.data, "%O", r->headers_in.content_length_n)
+                             - decoded_length.value.data;
+  ctx->content_length.len = ngx_sprintf(ctx->content_length.data, "%O",
+                                        ngx_s3_auth__aws_chunked_length(r->headers_in.content_length_n,
+                                                                        conf->chunk_size))
+                            - ctx->content_length.data;
+
+  if(ngx_s3_auth__merge_headers(extra_headers, &decoded_length, 1,
+                                 key.extra_headers != NULL ? key.extra_headers->elts : NULL,
+                                 key.extra_headers != NULL ? key.extra_headers->nelts : 0) != NGX_OK)
+    {
+      return NGX_ERROR;
+    }
+
+  details = ngx_s3_auth__compute_signature(r->pool, r, key.signing_key, key.key_scope, &conf->endpoint,
+                                           &STREAMING_PAYLOAD, extra_headers, NULL);
+  if(details.signature == NULL) {
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_ERRORS, 1);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  signing_key = key.signing_key;
+  if(key.transient) {
+    /* an upload running past midnight or a refresh keeps its own key */
+    chunk_key = ngx_s3_auth__hmac_key_create(r->pool);
+    if(chunk_key == NULL || ngx_s3_auth__hmac_key_set(chunk_key, key.raw_key) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    signing_key = chunk_key;
+  }
+
+  date = ngx_s3_auth__compute_request_time(r->pool, &key.sec);
+  ctx->chunk_signer = ngx_s3_auth__chunk_signer_create(r->pool, signing_key, date, key.key_scope,
+                                                       details.signature);
+  if(ctx->chunk_signer == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ctx->chunk_size = conf->chunk_size;
+
+  ngx_http_set_ctx(r, ctx, ngx_http_s3_auth_module);
+
+  if(ngx_http_s3_auth_trace(r, &details, key.key_scope, &STREAMING_PAYLOAD) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  rc = ngx_http_s3_auth_set_headers(r, ngx_s3_auth__add_auth_header(r->pool, &details, key.access_key,
+                                                                    key.key_scope));
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  h = ngx_list_push(&r->headers_in.headers);
+  if (h == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  h->key = ngx_http_s3_auth_content_encoding;
+  h->lowcase_key = (u_char *) "content-encoding";
+  h->value = ngx_http_s3_auth_aws_chunked;
+
+  return NGX_OK;
+}
+
+/* s3_set_headers off: signed by ngx_http_s3_auth_header_variable once the
+   upstream request is made */
+static ngx_int_t
+ngx_http_s3_auth_defer_signing(ngx_http_request_t *r, const ngx_str_t *payload_hash)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_s3_auth_get_ctx(r);
+
+  if(ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ctx->payload_hash = payload_hash;
+  ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_DEFERRED, 1);
+
+  return NGX_OK;
+}
+
+/* S3 answers XAmzContentSHA256Mismatch, a signature over a declared hash
+   says nothing about the body that came with it */
+static ngx_uint_t
+ngx_http_s3_auth_payload_matches(ngx_http_request_t *r, const ngx_str_t *declared, const ngx_str_t *payload_hash)
+{
+  if(declared->len == payload_hash->len && ngx_strncasecmp(declared->data, payload_hash->data, declared->len) == 0) {
+    return 1;
+  }
+
+  ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: %V \"%V\" does not match the body, \"%V\"",
+                &HASH_HEADER, declared, payload_hash);
+  return 0;
+}
+
+/* the body hash is complete, check it and sign with it */
+static void
+ngx_http_s3_auth_body_hashed(ngx_http_request_t *r, ngx_http_s3_auth_ctx_t *ctx)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  const ngx_str_t *payload_hash;
+
+  payload_hash = ngx_s3_auth__sha256_final_hex(r->pool, ctx->body_hash);
+  ctx->body_hash = NULL;
+
+  if(payload_hash == NULL) {
+    ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  } else if(ctx->declared_hash != NULL && !ngx_http_s3_auth_payload_matches(r, ctx->declared_hash, payload_hash)) {
+    ctx->status = NGX_HTTP_BAD_REQUEST;
+  } else if(!conf->enabled) {
+    /* s3_verify alone, the body checked out */
+    ctx->status = NGX_DECLINED;
+  } else if(!conf->set_headers) {
+    ctx->status = ngx_http_s3_auth_defer_signing(r, payload_hash);
+  } else {
+    ctx->status = ngx_http_s3_auth_sign_request(r, conf, payload_hash);
+  }
+}
+
+/* signed for the method actually sent, a cache miss of a HEAD request
+   goes upstream as GET with proxy_cache_convert_head */
+static ngx_str_t
+ngx_http_s3_auth_upstream_method(ngx_http_request_t *r)
+{
+  if(r->upstream != NULL && r->upstream->method.len > 0) {
+    return r->upstream->method;
+  }
+
+  return r->method_name;
+}
+
+/* s3_sign_peers: the signature covers the Host header, a request the
+   balancer sends to another server of the upstream, first or on a retry,
+   is signed again with the name of that server as its host */
+
+static const ngx_str_t *
+ngx_http_s3_auth_peer_host(ngx_http_s3_auth_srv_conf_t *scf, const ngx_str_t *addr)
+{
+  ngx_http_s3_auth_peer_host_t *host = scf->hosts.elts;
+  ngx_uint_t i;
+
+  for(i = 0; i < scf->hosts.nelts; i++) {
+    if(host[i].addr.len == addr->len && ngx_strncmp(host[i].addr.data, addr->data, addr->len) == 0) {
+      return &host[i].name;
+    }
+  }
+
+  /* resolved at run time, known by its address only */
+  return addr;
+}
+
+/* the value of a header line in a request made by the proxy module */
+static ngx_int_t
+ngx_http_s3_auth_request_header(ngx_buf_t *b, const ngx_str_t *name, ngx_str_t *value)
+{
+  u_char *p, *eol, *colon;
+
+  p = ngx_strlchr(b->start, b->last, '\n'); /* the request line */
+
+  while(p != NULL && ++p < b->last && *p != CR && *p != LF) {
+    eol = ngx_strlchr(p, b->last, LF);
+    if(eol == NULL) {
+      break;
+    }
+
+    colon = ngx_strlchr(p, eol, ':');
+    if(colon != NULL && (size_t) (colon - p) == name->len
+       && ngx_strncasecmp(p, name->data, name->len) == 0)
+      {
+        for(p = colon + 1; p < eol && *p == ' '; p++) { /* void */ }
+        value->data = p;
+        value->len = (eol > p && eol[-1] == CR ? eol - 1 : eol) - p;
+        return NGX_OK;
+      }
+
+    p = eol;
+  }
+
+  return NGX_DECLINED;
+}
+
+/* a copy of the request with the value of a header line replaced */
+static ngx_buf_t *
+ngx_http_s3_auth_replace_header(ngx_pool_t *pool, ngx_buf_t *b, const ngx_str_t *name, const ngx_str_t *value)
+{
+  ngx_str_t old;
+  ngx_buf_t *copy;
+  u_char *p;
+
+  if(ngx_http_s3_auth_request_header(b, name, &old) != NGX_OK) {
+    return NULL;
+  }
+
+  copy = ngx_calloc_buf(pool);
+  p = ngx_pnalloc(pool, b->last - b->start - old.len + value->len);
+  if(copy == NULL || p == NULL) {
+    return NULL;
+  }
+
+  *copy = *b;
+  copy->start = p;
+  copy->pos = p;
+  p = ngx_cpymem(p, b->start, old.data - b->start);
+  p = ngx_cpymem(p, value->data, value->len);
+  p = ngx_cpymem(p, old.data + old.len, b->last - (old.data + old.len));
+  copy->last = p;
+  copy->end = p;
+  copy->temporary = 1;
+  copy->memory = 0;
+  copy->mmap = 0;
+
+  return copy;
+}
+
+/* the request goes to host, replaces u->request_bufs if it is signed for another */
+static ngx_int_t
+ngx_http_s3_auth_sign_for_peer(ngx_http_s3_auth_peer_data_t *pd, const ngx_str_t *host)
+{
+  ngx_http_request_t *r = pd->r;
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  const ngx_http_s3_auth_key_t *key = ctx->peer_key;
+  const ngx_s3_auth__hmac_key_t *signing_key;
+  ngx_s3_auth__hmac_key_t *peer_key;
+  const ngx_str_t *authorization;
+  ngx_str_t method;
+  ngx_buf_t *b;
+
+  if(pd->host.len == host->len && ngx_strncmp(pd->host.data, host->data, host->len) == 0) {
+    return NGX_OK;
+  }
+
+  if(pd->signer == NULL) {
+    signing_key = key->signing_key;
+    if(key->transient) {
+      peer_key = ngx_s3_auth__hmac_key_create(r->pool);
+      if(peer_key == NULL || ngx_s3_auth__hmac_key_set(peer_key, key->raw_key) != NGX_OK) {
+        return NGX_ERROR;
+      }
+      signing_key = peer_key;
+    }
+
+    method = r->method_name;
+    r->method_name = ngx_http_s3_auth_upstream_method(r);
+    pd->signer = ngx_s3_auth__peer_signer_create(r->pool, r, key->sec, key->access_key, signing_key,
+                                                 key->key_scope, ctx->peer_payload_hash, key->extra_headers);
+    r->method_name = method;
+
+    if(pd->signer == NULL) {
+      return NGX_ERROR;
+    }
+  }
+
+  authorization = ngx_s3_auth__peer_sign(r->pool, pd->signer, host);
+  if(authorization == NULL) {
+    return NGX_ERROR;
+  }
+
+  b = ngx_http_s3_auth_replace_header(r->pool, pd->request, &ngx_http_s3_auth_host, host);
+  if(b != NULL) {
+    b = ngx_http_s3_auth_replace_header(r->pool, b, &AUTHZ_HEADER, authorization);
+  }
+  if(b == NULL) {
+    return NGX_ERROR;
+  }
+
+  r->upstream->request_bufs->buf = b;
+  pd->host = *host;
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "s3 auth: signed for peer \"%V\", \"%V\"", host, authorization);
+  ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_PEER_SIGNED, 1);
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+  ngx_http_s3_auth_peer_data_t *pd = data;
+  ngx_int_t rc;
+
+  rc = pd->original_get_peer(pc, pd->data);
+  if(rc != NGX_OK && rc != NGX_DONE) {
+    return rc;
+  }
+
+  /* NGX_DONE is a cached keepalive connection, signed all the same */
+  if(ngx_http_s3_auth_sign_for_peer(pd, ngx_http_s3_auth_peer_host(pd->scf, pc->name)) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, pc->log, 0, "s3 auth: could not sign the request for peer \"%V\"", pc->name);
+    return NGX_ERROR;
+  }
+
+  return rc;
+}
+
+static void
+ngx_http_s3_auth_free_peer(ngx_peer_connection_t *pc, void *data, ngx_uint_t state)
+{
+  ngx_http_s3_auth_peer_data_t *pd = data;
+
+  pd->original_free_peer(pc, pd->data, state);
+}
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_s3_auth_set_peer_session(ngx_peer_connection_t *pc, void *data)
+{
+  ngx_http_s3_auth_peer_data_t *pd = data;
+
+  return pd->original_set_session(pc, pd->data);
+}
+
+static void
+ngx_http_s3_auth_save_peer_session(ngx_peer_connection_t *pc, void *data)
+{
+  ngx_http_s3_auth_peer_data_t *pd = data;
+
+  pd->original_save_session(pc, pd->data);
+}
+
+#endif
+
+static ngx_int_t
+ngx_http_s3_auth_init_peer(ngx_http_request_t *r, ngx_http_upstream_srv_conf_t *us)
+{
+  ngx_http_s3_auth_srv_conf_t *scf = ngx_http_conf_upstream_srv_conf(us, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  ngx_http_upstream_t *u = r->upstream;
+  ngx_http_s3_auth_peer_data_t *pd;
+  ngx_str_t host;
+
+  if(scf->original_init_peer(r, us) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  /* not signed here, or signed in a way which is not redone per peer:
+     batched and streamed requests keep the signature for s3_endpoint */
+  if(ctx == NULL || ctx->peer_key == NULL || u->request_bufs == NULL) {
+    return NGX_OK;
+  }
+
+  pd = ngx_pcalloc(r->pool, sizeof(ngx_http_s3_auth_peer_data_t));
+  if(pd == NULL) {
+    return NGX_ERROR;
+  }
+
+  pd->r = r;
+  pd->scf = scf;
+  pd->request = u->request_bufs->buf;
+
+  /* good as it is for a peer named after s3_endpoint */
+  if(ngx_http_s3_auth_request_header(pd->request, &ngx_http_s3_auth_host, &host) == NGX_OK
+     && host.len == conf->endpoint.len && ngx_strncmp(host.data, conf->endpoint.data, host.len) == 0)
+    {
+      pd->host = conf->endpoint;
+    }
+
+  pd->data = u->peer.data;
+  pd->original_get_peer = u->peer.get;
+  pd->original_free_peer = u->peer.free;
+
+  u->peer.data = pd;
+  u->peer.get = ngx_http_s3_auth_get_peer;
+  u->peer.free = ngx_http_s3_auth_free_peer;
+
+#if (NGX_HTTP_SSL)
+  pd->original_set_session = u->peer.set_session;
+  pd->original_save_session = u->peer.save_session;
+
+  u->peer.set_session = ngx_http_s3_auth_set_peer_session;
+  u->peer.save_session = ngx_http_s3_auth_save_peer_session;
+#endif
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_init_upstream(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+  ngx_http_s3_auth_srv_conf_t *scf = ngx_http_conf_upstream_srv_conf(us, ngx_http_s3_auth_module);
+  ngx_http_upstream_server_t *server;
+  ngx_http_s3_auth_peer_host_t *host;
+  ngx_uint_t i, j;
+
+  if(scf->original_init_upstream(cf, us) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  scf->original_init_peer = us->peer.init;
+  us->peer.init = ngx_http_s3_auth_init_peer;
+
+  if(ngx_array_init(&scf->hosts, cf->pool, 4, sizeof(ngx_http_s3_auth_peer_host_t)) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  /* the balancer names a peer by its address, the request goes out with
+     the name of its server as written */
+  server = us->servers->elts;
+  for(i = 0; i < us->servers->nelts; i++) {
+    for(j = 0; j < server[i].naddrs; j++) {
+      host = ngx_array_push(&scf->hosts);
+      if(host == NULL) {
+        return NGX_ERROR;
+      }
+      host->addr = server[i].addrs[j].name;
+      host->name = server[i].name;
+    }
+  }
+
+  return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+#define NGX_HTTP_S3_AUTH_HASH_READ_SIZE (1024 * 1024)
+
+typedef struct {
+  ngx_http_request_t *r;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_chain_t *bufs;
+  off_t hashed;
+  ngx_int_t rc;
+  ngx_err_t err; /* 0 with rc == NGX_ERROR if the file was shorter than expected */
+} ngx_http_s3_auth_hash_task_t;
+
+/* runs on the thread pool, only touches the task and the body chain, which
+   nothing else uses until the task is done */
+static void
+ngx_http_s3_auth_hash_thread_handler(void *data, ngx_log_t *log)
+{
+  ngx_http_s3_auth_hash_task_t *task = data;
+  ngx_chain_t *cl;
+  u_char *buf = NULL;
+  ssize_t n;
+  off_t pos;
+
+  task->rc = NGX_ERROR;
+
+  for(cl = task->bufs; cl; cl = cl->next) {
+    if(!cl->buf->in_file) {
+      ngx_s3_auth__sha256_update(task->ctx->body_hash, cl->buf->pos, cl->buf->last - cl->buf->pos);
+      task->hashed += cl->buf->last - cl->buf->pos;
+      continue;
+    }
+
+    if(buf == NULL) {
+      buf = ngx_alloc(NGX_HTTP_S3_AUTH_HASH_READ_SIZE, log);
+      if(buf == NULL) {
+        task->err = ngx_errno;
+        return;
+      }
+    }
+
+    for(pos = cl->buf->file_pos; pos < cl->buf->file_last; pos += n) {
+      n = pread(cl->buf->file->fd, buf,
+                (size_t) ngx_min(NGX_HTTP_S3_AUTH_HASH_READ_SIZE, cl->buf->file_last - pos), pos);
+
+      if(n == -1) {
+        task->err = ngx_errno;
+        if(task->err == NGX_EINTR) {
+          n = 0;
+          continue;
+        }
+        goto done;
+      }
+
+      if(n == 0) {
+        task->err = 0;
+        goto done;
+      }
+
+      ngx_s3_auth__sha256_update(task->ctx->body_hash, buf, n);
+      task->hashed += n;
+    }
+  }
+
+  task->rc = NGX_OK;
+
+done:
+
+  if(buf != NULL) {
+    ngx_free(buf);
+  }
+}
+
+static void
+ngx_http_s3_auth_hash_event_handler(ngx_event_t *ev)
+{
+  ngx_http_s3_auth_hash_task_t *task = ev->data;
+  ngx_http_request_t *r = task->r;
+  ngx_connection_t *c = r->connection;
+
+  r->main->blocked--;
+  r->aio = 0;
+
+  ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_BYTES_HASHED, task->hashed);
+
+  if(task->rc == NGX_OK) {
+    ngx_http_s3_auth_body_hashed(r, task->ctx);
+  } else {
+    ngx_log_error(NGX_LOG_CRIT, c->log, task->err, "s3 auth: failed to read the request body from \"%V\"",
+                  &r->request_body->temp_file->file.name);
+    task->ctx->body_hash = NULL;
+    task->ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* ngx_http_core_run_phases, unless the request was terminated meanwhile */
+  r->write_event_handler(r);
+  ngx_http_run_posted_requests(c);
+}
+
+/* with s3_hash_thread_pool the body is hashed once it is read: a body kept in
+   memory right away, one spooled to client_body_temp_path on the thread pool,
+   returns NGX_AGAIN then */
+static ngx_int_t
+ngx_http_s3_auth_hash_body(ngx_http_request_t *r, ngx_http_s3_auth_ctx_t *ctx)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_hash_task_t *task;
+  ngx_thread_task_t *t;
+  ngx_chain_t *cl;
+
+  if(r->request_body == NULL) {
+    return NGX_OK;
+  }
+
+  if(r->request_body->temp_file == NULL) {
+    for(cl = r->request_body->bufs; cl; cl = cl->next) {
+      ngx_s3_auth__sha256_update(ctx->body_hash, cl->buf->pos, cl->buf->last - cl->buf->pos);
+      ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_BYTES_HASHED, cl->buf->last - cl->buf->pos);
+    }
+    return NGX_OK;
+  }
+
+  t = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_s3_auth_hash_task_t));
+  if(t == NULL) {
+    return NGX_ERROR;
+  }
+
+  task = t->ctx;
+  task->r = r;
+  task->ctx = ctx;
+  task->bufs = r->request_body->bufs;
+
+  t->handler = ngx_http_s3_auth_hash_thread_handler;
+  t->event.handler = ngx_http_s3_auth_hash_event_handler;
+  t->event.data = task;
+
+  if(ngx_thread_task_post(conf->hash_thread_pool, t) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  r->main->blocked++;
+  r->aio = 1;
+
+  return NGX_AGAIN;
+}
+
+#endif
+
+/* the whole body is read (and hashed by ngx_http_s3_auth_body_filter on the
+   way in, unless that is left to the thread pool), sign and resume the
+   phases where we left them */
+static void
+ngx_http_s3_auth_body_handler(ngx_http_request_t *r)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+
+  r->write_event_handler = ngx_http_core_run_phases;
+
+#if (NGX_THREADS)
+  if(ctx->hash_in_thread) {
+    switch(ngx_http_s3_auth_hash_body(r, ctx)) {
+    case NGX_AGAIN:
+      /* resumed by ngx_http_s3_auth_hash_event_handler */
+      return;
+    case NGX_OK:
+      break;
+    default:
+      ctx->body_hash = NULL;
+      ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      ngx_http_core_run_phases(r);
+      return;
+    }
+  }
+#endif
+
+  ngx_http_s3_auth_body_hashed(r, ctx);
+  ngx_http_core_run_phases(r);
+}
+
+static ngx_int_t
+ngx_http_s3_auth_init_replay_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_s3_auth_replay_ctx_t *octx = data;
+  ngx_http_s3_auth_replay_ctx_t *ctx = shm_zone->data;
+  size_t len;
+
+  if(octx != NULL) {
+    /* reload, keep remembering what the old cycle has seen */
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if(shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_s3_auth_replay_sh_t));
+  if(ctx->sh == NULL) {
+    return NGX_ERROR;
+  }
+  ctx->shpool->data = ctx->sh;
+
+  ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel, ngx_rbtree_insert_value);
+  ngx_queue_init(&ctx->sh->queue);
+
+  len = sizeof(" in s3 replay zone \"\"") + shm_zone->shm.name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if(ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(ctx->shpool->log_ctx, " in s3 replay zone \"%V\"%Z", &shm_zone->shm.name);
+
+  /* a full zone is handled by dropping the oldest entries */
+  ctx->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+/* drops expired entries, or the oldest one if force is set; shpool is locked */
+static void
+ngx_http_s3_auth_replay_expire(ngx_http_s3_auth_replay_ctx_t *ctx, time_t now, ngx_uint_t force)
+{
+  ngx_http_s3_auth_replay_node_t *rn;
+  ngx_queue_t *q;
+
+  while(!ngx_queue_empty(&ctx->sh->queue)) {
+    q = ngx_queue_last(&ctx->sh->queue);
+    rn = ngx_queue_data(q, ngx_http_s3_auth_replay_node_t, queue);
+
+    if(!force && rn->expires > now) {
+      return;
+    }
+    force = 0;
+
+    ngx_queue_remove(q);
+    ngx_rbtree_delete(&ctx->sh->rbtree, &rn->node);
+    ngx_slab_free_locked(ctx->shpool, rn);
+  }
+}
+
+/* NGX_OK the first time a signature is seen, NGX_DECLINED for a replay */
+static ngx_int_t
+ngx_http_s3_auth_replay_check(ngx_http_request_t *r, ngx_shm_zone_t *zone,
+                              const ngx_str_t *signature, time_t expires)
+{
+  ngx_http_s3_auth_replay_ctx_t *ctx = zone->data;
+  ngx_http_s3_auth_replay_node_t *rn;
+  ngx_rbtree_node_t *node, *sentinel;
+  uint32_t hash;
+
+  hash = ngx_crc32_short(signature->data, signature->len);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  ngx_http_s3_auth_replay_expire(ctx, ngx_time(), 0);
+
+  node = ctx->sh->rbtree.root;
+  sentinel = ctx->sh->rbtree.sentinel;
+
+  while(node != sentinel) {
+    if(hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+
+    rn = (ngx_http_s3_auth_replay_node_t *) node;
+    if(ngx_memcmp(rn->signature, signature->data, NGX_S3_AUTH_SIGNATURE_LEN) == 0) {
+      ngx_shmtx_unlock(&ctx->shpool->mutex);
+      return NGX_DECLINED;
+    }
+
+    /* ngx_rbtree_insert_value puts equal keys to the right */
+    node = node->right;
+  }
+
+  rn = ngx_slab_alloc_locked(ctx->shpool, sizeof(ngx_http_s3_auth_replay_node_t));
+  if(rn == NULL) {
+    ngx_http_s3_auth_replay_expire(ctx, 0, 1);
+    rn = ngx_slab_alloc_locked(ctx->shpool, sizeof(ngx_http_s3_auth_replay_node_t));
+    if(rn == NULL) {
+      ngx_shmtx_unlock(&ctx->shpool->mutex);
+      ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                    "s3 auth: could not allocate node%s", ctx->shpool->log_ctx);
+      return NGX_ERROR;
+    }
+  }
+
+  rn->node.key = hash;
+  rn->expires = expires;
+  ngx_memcpy(rn->signature, signature->data, NGX_S3_AUTH_SIGNATURE_LEN);
+
+  ngx_rbtree_insert(&ctx->sh->rbtree, &rn->node);
+  ngx_queue_insert_head(&ctx->sh->queue, &rn->queue);
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  return NGX_OK;
+}
+
+/* reads a whole file into the pool */
+static ngx_int_t
+ngx_http_s3_auth_read_file(ngx_pool_t *pool, ngx_str_t *name, ngx_log_t *log, ngx_str_t *text)
+{
+  ngx_file_info_t fi;
+  ngx_file_t file;
+  ngx_int_t rc;
+  ssize_t n;
+
+  ngx_memzero(&file, sizeof(ngx_file_t));
+  file.name = *name;
+  file.log = log;
+
+  file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if(file.fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%V\" failed", name);
+    return NGX_ERROR;
+  }
+
+  rc = NGX_ERROR;
+
+  if(ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_fd_info_n " \"%V\" failed", name);
+    goto done;
+  }
+
+  text->len = ngx_file_size(&fi);
+  text->data = ngx_pnalloc(pool, text->len);
+  if(text->data == NULL) {
+    goto done;
+  }
+
+  n = ngx_read_file(&file, text->data, text->len, 0);
+  if(n == NGX_ERROR) {
+    goto done;
+  }
+
+  if((size_t) n != text->len) {
+    ngx_log_error(NGX_LOG_ERR, log, 0, ngx_read_file_n " \"%V\" returned only %z bytes instead of %uz",
+                  name, n, text->len);
+    goto done;
+  }
+
+  rc = NGX_OK;
+
+done:
+
+  ngx_close_file(file.fd);
+
+  return rc;
+}
+
+/* reads the file of s3_credentials_map into a new table and replaces the
+   current one; a broken file leaves the table as it is. Unless force is set
+   an unchanged file is not read at all. */
+static ngx_int_t
+ngx_http_s3_auth_load_credentials(ngx_http_s3_auth_creds_ctx_t *ctx, ngx_log_t *log, ngx_uint_t force)
+{
+  struct S3CredentialsTable *table, *old;
+  const ngx_str_t *duplicate;
+  ngx_array_t credentials;
+  ngx_file_info_t fi;
+  ngx_pool_t *pool;
+  ngx_uint_t line;
+  ngx_str_t text;
+  size_t size;
+
+  if(ngx_file_info(ctx->file.data, &fi) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_file_info_n " \"%V\" failed", &ctx->file);
+    return NGX_ERROR;
+  }
+
+  if(!force && ctx->sh->mtime == ngx_file_mtime(&fi) && ctx->sh->size == ngx_file_size(&fi)) {
+    return NGX_OK;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+  if(pool == NULL) {
+    return NGX_ERROR;
+  }
+
+  if(ngx_http_s3_auth_read_file(pool, &ctx->file, log, &text) != NGX_OK) {
+    goto failed;
+  }
+
+  if(ngx_array_init(&credentials, pool, 64, sizeof(struct S3Credential)) != NGX_OK) {
+    goto failed;
+  }
+
+  if(ngx_s3_auth__parse_credentials(&text, &credentials, &line) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: invalid credentials in \"%V\" on line %ui", &ctx->file, line);
+    goto failed;
+  }
+
+  size = ngx_s3_auth__credentials_table_size(&credentials);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  /* the old table is still in use, the zone has to fit both for a moment */
+  table = ngx_slab_alloc_locked(ctx->shpool, size);
+  if(table == NULL) {
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: %uz bytes of credentials do not fit%s",
+                  size, ctx->shpool->log_ctx);
+    goto failed;
+  }
+
+  if(ngx_s3_auth__credentials_table_build((u_char *) table, &credentials, &duplicate) == NULL) {
+    ngx_slab_free_locked(ctx->shpool, table);
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: duplicate bucket \"%V\" in \"%V\"", duplicate, &ctx->file);
+    goto failed;
+  }
+
+  old = ctx->sh->table;
+  ctx->sh->table = table;
+  ctx->sh->mtime = ngx_file_mtime(&fi);
+  ctx->sh->size = ngx_file_size(&fi);
+
+  if(old != NULL) {
+    ngx_slab_free_locked(ctx->shpool, old);
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  ngx_log_error(NGX_LOG_NOTICE, log, 0, "s3 auth: loaded %ui credentials from \"%V\"",
+                credentials.nelts, &ctx->file);
+
+  ngx_destroy_pool(pool);
+
+  return NGX_OK;
+
+failed:
+
+  ngx_destroy_pool(pool);
+
+  return NGX_ERROR;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_init_credentials_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_s3_auth_creds_ctx_t *octx = data;
+  ngx_http_s3_auth_creds_ctx_t *ctx = shm_zone->data;
+  size_t len;
+
+  if(octx != NULL) {
+    /* nginx reload, the file is read again and has to be valid */
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return ngx_http_s3_auth_load_credentials(ctx, shm_zone->shm.log, 1);
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if(shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  ctx->sh = ngx_slab_calloc(ctx->shpool, sizeof(ngx_http_s3_auth_creds_sh_t));
+  if(ctx->sh == NULL) {
+    return NGX_ERROR;
+  }
+  ctx->shpool->data = ctx->sh;
+
+  len = sizeof(" in s3 credentials map \"\"") + shm_zone->shm.name.len;
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if(ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(ctx->shpool->log_ctx, " in s3 credentials map \"%V\"%Z", &shm_zone->shm.name);
+
+  return ngx_http_s3_auth_load_credentials(ctx, shm_zone->shm.log, 1);
+}
+
+/* every worker watches the file, whoever notices a change first loads it */
+static void
+ngx_http_s3_auth_reload_credentials(ngx_event_t *ev)
+{
+  ngx_http_s3_auth_creds_ctx_t *ctx = ev->data;
+
+  (void) ngx_http_s3_auth_load_credentials(ctx, ev->log, 0);
+
+  ngx_add_timer(ev, ctx->interval);
+}
+
+/* replaces the current temporary credentials with the ones in json,
+   the previous ones stay in use if json can't be parsed */
+static ngx_int_t
+ngx_http_s3_auth_install_credentials(ngx_http_s3_auth_provider_t *provider, ngx_str_t *json, ngx_log_t *log)
+{
+  struct S3TemporaryCredentials parsed;
+  ngx_http_s3_auth_temp_creds_t *creds;
+  ngx_pool_t *pool;
+  ngx_str_t copy;
+
+  if(provider->region.len == 0) {
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: temporary credentials from \"%V\" require \"s3_region\"",
+                  &provider->source);
+    return NGX_ERROR;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+  if(pool == NULL) {
+    return NGX_ERROR;
+  }
+
+  creds = ngx_pcalloc(pool, sizeof(ngx_http_s3_auth_temp_creds_t));
+  copy.len = json->len;
+  copy.data = ngx_pnalloc(pool, copy.len);
+  if(creds == NULL || copy.data == NULL) {
+    goto failed;
+  }
+  ngx_memcpy(copy.data, json->data, copy.len);
+
+  /* parsed in place, the values point into the copy */
+  if(ngx_s3_auth__parse_temporary_credentials(&copy, &parsed) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: invalid temporary credentials from \"%V\"", &provider->source);
+    goto failed;
+  }
+
+  creds->pool = pool;
+  creds->access_key = parsed.access_key;
+  creds->session_token = parsed.session_token;
+  creds->expiration = parsed.expiration;
+  creds->key_cache = ngx_s3_auth__signing_key_cache_create(pool, &parsed.secret_key,
+                                                           &provider->region, &provider->service);
+
+  ngx_memzero(parsed.secret_key.data, parsed.secret_key.len);
+
+  if(creds->key_cache == NULL) {
+    goto failed;
+  }
+
+  ngx_s3_auth__signing_key_rotate(creds->key_cache, ngx_time());
+
+  if(provider->current != NULL) {
+    /* queued requests refer to the keys about to be freed */
+    ngx_http_s3_auth_flush_batch(ngx_http_cycle_get_module_main_conf(ngx_cycle, ngx_http_s3_auth_module));
+
+    ngx_destroy_pool(provider->current->pool);
+  }
+  provider->current = creds;
+
+  ngx_log_error(NGX_LOG_INFO, log, 0, "s3 auth: refreshed temporary credentials from \"%V\"", &provider->source);
+
+  return NGX_OK;
+
+failed:
+
+  ngx_destroy_pool(pool);
+
+  return NGX_ERROR;
+}
+
+/* the next refresh is due refresh seconds before the credentials expire,
+   credentials without an expiration are fetched again every refresh seconds */
+static void
+ngx_http_s3_auth_schedule_refresh(ngx_http_s3_auth_provider_t *provider, ngx_int_t rc)
+{
+  time_t next = NGX_HTTP_S3_AUTH_REFRESH_RETRY;
+
+  if(rc == NGX_OK) {
+    if(provider->current->expiration == 0) {
+      next = provider->refresh;
+    } else {
+      next = ngx_max(provider->current->expiration - provider->refresh - ngx_time(),
+                     NGX_HTTP_S3_AUTH_REFRESH_RETRY);
+    }
+  } else if(provider->current != NULL && provider->current->expiration != 0
+            && provider->current->expiration <= ngx_time())
+    {
+      ngx_log_error(NGX_LOG_WARN, provider->timer.log, 0, "s3 auth: temporary credentials from \"%V\" "
+                    "have expired", &provider->source);
+    }
+
+  ngx_add_timer(&provider->timer, (ngx_msec_t) next * 1000);
+}
+
+/* the IMDSv2 session token, renewed once most of its ttl has passed */
+static ngx_int_t
+ngx_http_s3_auth_set_token(ngx_http_s3_auth_provider_t *provider, ngx_str_t *body)
+{
+  while(body->len > 0 && (body->data[body->len - 1] == CR || body->data[body->len - 1] == LF
+                          || body->data[body->len - 1] == ' '))
+    {
+      body->len--;
+    }
+
+  if(body->len == 0 || body->len > NGX_HTTP_S3_AUTH_TOKEN_MAX) {
+    ngx_log_error(NGX_LOG_ERR, provider->timer.log, 0, "s3 auth: invalid session token from \"%V\"",
+                  &provider->source);
+    return NGX_ERROR;
+  }
+
+  provider->token.len = ngx_cpymem(provider->token.data, body->data, body->len) - provider->token.data;
+  provider->token_expires = ngx_time() + provider->token_ttl - provider->token_ttl / 10;
+  provider->token_fresh = 1;
+
+  return NGX_OK;
+}
+
+static void
+ngx_http_s3_auth_fetch_done(ngx_http_s3_auth_provider_t *provider, ngx_int_t rc)
+{
+  ngx_buf_t *b = provider->response;
+  ngx_uint_t token = provider->fetching_token;
+  ngx_int_t status = NGX_ERROR;
+  ngx_str_t body;
+  u_char *p;
+
+  ngx_close_connection(provider->peer.connection);
+  provider->peer.connection = NULL;
+
+  if(rc == NGX_OK) {
+    /* HTTP/1.x <status> ...\r\n\r\n<body> */
+    p = ngx_strnstr(b->pos, "\r\n\r\n", b->last - b->pos);
+    if(b->last - b->pos >= 12 && ngx_strncmp(b->pos, "HTTP/1.", 7) == 0 && b->pos[8] == ' ' && p != NULL) {
+      status = ngx_atoi(b->pos + 9, 3);
+      body.data = p + 4;
+      body.len = b->last - body.data;
+    }
+
+    if(status == NGX_HTTP_OK && token) {
+      rc = ngx_http_s3_auth_set_token(provider, &body);
+    } else if(status == NGX_HTTP_OK) {
+      rc = ngx_http_s3_auth_install_credentials(provider, &body, provider->timer.log);
+    } else if(status == NGX_HTTP_UNAUTHORIZED && !token && provider->token_ttl > 0 && !provider->token_fresh) {
+      /* the token was revoked or the instance restarted, a new one is fetched right away */
+      provider->token.len = 0;
+      rc = NGX_AGAIN;
+    } else {
+      ngx_log_error(NGX_LOG_ERR, provider->timer.log, 0, "s3 auth: unexpected response from \"%V\": \"%*s\"",
+                    &provider->source, ngx_min(b->last - b->pos, 64), b->pos);
+      rc = NGX_ERROR;
+    }
+  }
+
+  ngx_memzero(b->start, b->last - b->start);
+  ngx_memzero(provider->request->start, provider->request->last - provider->request->start);
+  ngx_destroy_pool(provider->fetch_pool);
+  provider->fetch_pool = NULL;
+
+  if((rc == NGX_OK && token) || rc == NGX_AGAIN) {
+    /* on to the credentials */
+    rc = ngx_http_s3_auth_fetch_credentials(provider, provider->timer.log);
+    if(rc == NGX_OK) {
+      return;
+    }
+  }
+
+  provider->token_fresh = 0;
+  ngx_http_s3_auth_schedule_refresh(provider, rc);
+}
+
+static void
+ngx_http_s3_auth_fetch_send(ngx_event_t *wev)
+{
+  ngx_connection_t *c = wev->data;
+  ngx_http_s3_auth_provider_t *provider = c->data;
+  ngx_buf_t *b = provider->request;
+  ssize_t n;
+
+  if(wev->timedout) {
+    ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT, "s3 auth: \"%V\" timed out", &provider->source);
+    ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+    return;
+  }
+
+  while(b->pos < b->last) {
+    n = c->send(c, b->pos, b->last - b->pos);
+    if(n == NGX_AGAIN) {
+      break;
+    }
+    if(n == NGX_ERROR) {
+      ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+      return;
+    }
+    b->pos += n;
+  }
+
+  if(ngx_handle_write_event(wev, 0) != NGX_OK) {
+    ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+  }
+}
+
+static void
+ngx_http_s3_auth_fetch_recv(ngx_event_t *rev)
+{
+  ngx_connection_t *c = rev->data;
+  ngx_http_s3_auth_provider_t *provider = c->data;
+  ngx_buf_t *b = provider->response;
+  ssize_t n;
+
+  if(rev->timedout) {
+    ngx_log_error(NGX_LOG_ERR, rev->log, NGX_ETIMEDOUT, "s3 auth: \"%V\" timed out", &provider->source);
+    ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+    return;
+  }
+
+  /* HTTP/1.0, the response ends with the connection */
+  for(;;) {
+    if(b->last == b->end) {
+      ngx_log_error(NGX_LOG_ERR, rev->log, 0, "s3 auth: response from \"%V\" is too large", &provider->source);
+      ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+      return;
+    }
+
+    n = c->recv(c, b->last, b->end - b->last);
+    if(n == NGX_AGAIN) {
+      break;
+    }
+    if(n == NGX_ERROR) {
+      ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+      return;
+    }
+    if(n == 0) {
+      ngx_http_s3_auth_fetch_done(provider, NGX_OK);
+      return;
+    }
+    b->last += n;
+  }
+
+  if(ngx_handle_read_event(rev, 0) != NGX_OK) {
+    ngx_http_s3_auth_fetch_done(provider, NGX_ERROR);
+  }
+}
+
+/* GET of the credentials endpoint (instance metadata, container credentials),
+   preceded by the PUT of an IMDSv2 session token when there is no valid one;
+   the response is handled by ngx_http_s3_auth_fetch_done */
+static ngx_int_t
+ngx_http_s3_auth_fetch_credentials(ngx_http_s3_auth_provider_t *provider, ngx_log_t *log)
+{
+  ngx_url_t *u = provider->url;
+  ngx_connection_t *c;
+  ngx_pool_t *pool;
+  ngx_buf_t *b;
+  ngx_int_t rc;
+  size_t len;
+
+  provider->fetching_token = provider->token_ttl > 0
+                             && (provider->token.len == 0 || ngx_time() >= provider->token_expires);
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+  if(pool == NULL) {
+    return NGX_ERROR;
+  }
+
+  len = sizeof("PUT  HTTP/1.0" CRLF "Host: :65535" CRLF "X-aws-ec2-metadata-token-ttl-seconds: " CRLF
+               "Content-Length: 0" CRLF "X-aws-ec2-metadata-token: " CRLF "Accept: application/json" CRLF CRLF) - 1
+        + ngx_max(u->uri.len, sizeof(NGX_HTTP_S3_AUTH_TOKEN_URI) - 1) + u->host.len + NGX_TIME_T_LEN
+        + provider->token.len;
+
+  b = ngx_create_temp_buf(pool, len);
+  provider->response = ngx_create_temp_buf(pool, NGX_HTTP_S3_AUTH_CREDENTIALS_MAX);
+  if(b == NULL || provider->response == NULL) {
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+  }
+
+  if(provider->fetching_token) {
+    b->last = ngx_sprintf(b->last, "PUT " NGX_HTTP_S3_AUTH_TOKEN_URI " HTTP/1.0" CRLF "Host: %V", &u->host);
+  } else {
+    b->last = ngx_sprintf(b->last, "GET %V HTTP/1.0" CRLF "Host: %V", &u->uri, &u->host);
+  }
+  if(u->port != 80) {
+    b->last = ngx_sprintf(b->last, ":%d", (int) u->port);
+  }
+
+  if(provider->fetching_token) {
+    b->last = ngx_sprintf(b->last, CRLF "X-aws-ec2-metadata-token-ttl-seconds: %T" CRLF "Content-Length: 0",
+                          provider->token_ttl);
+  } else if(provider->token.len > 0) {
+    b->last = ngx_sprintf(b->last, CRLF "X-aws-ec2-metadata-token: %V", &provider->token);
+  }
+
+  b->last = ngx_cpymem(b->last, CRLF "Accept: application/json" CRLF CRLF,
+                       sizeof(CRLF "Accept: application/json" CRLF CRLF) - 1);
+  provider->request = b;
+
+  ngx_memzero(&provider->peer, sizeof(ngx_peer_connection_t));
+  provider->peer.sockaddr = u->addrs[0].sockaddr;
+  provider->peer.socklen = u->addrs[0].socklen;
+  provider->peer.name = &u->addrs[0].name;
+  provider->peer.get = ngx_event_get_peer;
+  provider->peer.log = log;
+  provider->peer.log_error = NGX_ERROR_ERR;
+
+  rc = ngx_event_connect_peer(&provider->peer);
+  if(rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+    ngx_log_error(NGX_LOG_ERR, log, 0, "s3 auth: could not connect to \"%V\"", &provider->source);
+    if(provider->peer.connection != NULL) {
+      ngx_close_connection(provider->peer.connection);
+      provider->peer.connection = NULL;
+    }
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+  }
+
+  provider->fetch_pool = pool;
+
+  c = provider->peer.connection;
+  c->data = provider;
+  c->pool = pool;
+  c->write->handler = ngx_http_s3_auth_fetch_send;
+  c->read->handler = ngx_http_s3_auth_fetch_recv;
+
+  /* one timeout for the whole exchange */
+  ngx_add_timer(c->read, provider->timeout);
+
+  if(rc == NGX_OK) {
+    ngx_http_s3_auth_fetch_send(c->write);
+  }
+
+  return NGX_OK;
+}
+
+/* every worker refreshes its own copy of the temporary credentials */
+static void
+ngx_http_s3_auth_refresh_credentials(ngx_event_t *ev)
+{
+  ngx_http_s3_auth_provider_t *provider = ev->data;
+  ngx_pool_t *pool;
+  ngx_str_t text;
+  ngx_int_t rc;
+
+  if(provider->url != NULL) {
+    if(ngx_http_s3_auth_fetch_credentials(provider, ev->log) != NGX_OK) {
+      ngx_http_s3_auth_schedule_refresh(provider, NGX_ERROR);
+    }
+    return;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log);
+  if(pool == NULL) {
+    ngx_http_s3_auth_schedule_refresh(provider, NGX_ERROR);
+    return;
+  }
+
+  rc = ngx_http_s3_auth_read_file(pool, &provider->file, ev->log, &text);
+  if(rc == NGX_OK) {
+    rc = ngx_http_s3_auth_install_credentials(provider, &text, ev->log);
+    ngx_memzero(text.data, text.len);
+  }
+
+  ngx_destroy_pool(pool);
+
+  ngx_http_s3_auth_schedule_refresh(provider, rc);
+}
+
+static const ngx_str_t *
+ngx_http_s3_auth_signed_value(const ngx_array_t *header_list, const ngx_str_t *name)
+{
+  const header_pair_t *pair = header_list->elts;
+  ngx_uint_t i;
+
+  for(i = 0; i < header_list->nelts; i++) {
+    if(pair[i].key.len == name->len && ngx_strncmp(pair[i].key.data, name->data, name->len) == 0) {
+      return &pair[i].value;
+    }
+  }
+
+  return NULL;
+}
+
+/* checks the SigV4 signature the client sent against s3_verify_credential,
+   NGX_OK lets the request through, anything else is the status to finalize with;
+   *declared_hash is left for the body to match, NULL if there is none to check */
+static ngx_int_t
+ngx_http_s3_auth_verify(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf, const ngx_str_t **declared_hash)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_get_module_main_conf(r, ngx_http_s3_auth_module);
+  const ngx_http_s3_auth_credential_t *cred = conf->verify_credentials->elts;
+  const ngx_str_t *secret_key, *date, *payload_hash;
+  struct S3AuthorizationDetails auth;
+  const ngx_array_t *header_list;
+  ngx_uint_t i;
+  ngx_int_t rc;
+  time_t t;
+
+  if(r->headers_in.authorization == NULL
+     || ngx_s3_auth__parse_authorization(&r->headers_in.authorization->value, &auth) != NGX_OK)
+    {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: missing or malformed authorization");
+      return NGX_HTTP_FORBIDDEN;
+    }
+
+  secret_key = NULL;
+  for(i = 0; i < conf->verify_credentials->nelts; i++) {
+    if(cred[i].access_key.len == auth.access_key.len
+       && ngx_strncmp(cred[i].access_key.data, auth.access_key.data, auth.access_key.len) == 0)
+      {
+        secret_key = &cred[i].secret_key;
+        break;
+      }
+  }
+
+  if(secret_key == NULL) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: unknown access key \"%V\"", &auth.access_key);
+    return NGX_HTTP_FORBIDDEN;
+  }
+
+  header_list = ngx_s3_auth__collect_signed_headers(r->pool, &r->headers_in.headers, &auth.signed_header_names);
+  if(header_list == NULL) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: invalid signed headers \"%V\"",
+                  &auth.signed_header_names);
+    return NGX_HTTP_FORBIDDEN;
+  }
+
+  /* both have to be signed, otherwise they could be swapped in transit */
+  date = ngx_http_s3_auth_signed_value(header_list, &DATE_HEADER);
+  payload_hash = ngx_http_s3_auth_signed_value(header_list, &HASH_HEADER);
+  if(date == NULL || payload_hash == NULL) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: %V and %V must be signed",
+                  &DATE_HEADER, &HASH_HEADER);
+    return NGX_HTTP_FORBIDDEN;
+  }
+
+  t = ngx_s3_auth__parse_request_time(date);
+  if(t == -1
+     || ngx_abs(t - ngx_time()) > NGX_S3_AUTH_MAX_SKEW
+     || ngx_strncmp(date->data, auth.date.data, auth.date.len) != 0)
+    {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: request time \"%V\" is out of range", date);
+      return NGX_HTTP_FORBIDDEN;
+    }
+
+  rc = ngx_s3_auth__verify_signature(r->pool, r, &auth, header_list, secret_key, date, payload_hash);
+  if(rc == NGX_ERROR) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(rc != NGX_OK) {
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: signature mismatch for \"%V\"",
+                  &auth.access_key);
+    return NGX_HTTP_FORBIDDEN;
+  }
+
+  if(mcf->replay_zone != NULL) {
+    /* past the skew window the request time check rejects it anyway */
+    rc = ngx_http_s3_auth_replay_check(r, mcf->replay_zone, &auth.signature, t + NGX_S3_AUTH_MAX_SKEW);
+    if(rc == NGX_ERROR) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(rc != NGX_OK) {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: replayed signature from \"%V\"",
+                    &auth.access_key);
+      return NGX_HTTP_FORBIDDEN;
+    }
+  }
+
+  /* the payload hash is taken as declared only when the client left it unsigned */
+  *declared_hash = NULL;
+
+  if(payload_hash->len == UNSIGNED_PAYLOAD.len
+     && ngx_strncmp(payload_hash->data, UNSIGNED_PAYLOAD.data, UNSIGNED_PAYLOAD.len) == 0)
+    {
+      return NGX_OK;
+    }
+
+  if(r->headers_in.content_length_n <= 0 && !r->headers_in.chunked) {
+    return ngx_http_s3_auth_payload_matches(r, payload_hash, &EMPTY_STRING_SHA256) ? NGX_OK : NGX_HTTP_BAD_REQUEST;
+  }
+
+  /* checked by ngx_http_s3_auth_body_hashed or, for streamed uploads, before the last chunk is sent */
+  *declared_hash = payload_hash;
+
+  return NGX_OK;
+}
+
+/* reads the request body, hashing it on the way; ngx_http_s3_auth_body_hashed
+   takes over once it is complete */
+static ngx_int_t
+ngx_http_s3_auth_read_body(ngx_http_request_t *r, ngx_http_s3_auth_conf_t *conf, const ngx_str_t *declared_hash)
+{
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_int_t rc;
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_s3_auth_ctx_t));
+  if (ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ctx->status = NGX_DONE;
+  ctx->declared_hash = declared_hash;
+  ctx->body_hash = ngx_s3_auth__sha256_init(r->pool);
+  if (ctx->body_hash == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+#if (NGX_THREADS)
+  ctx->hash_in_thread = conf->hash_thread_pool != NULL;
+#endif
+
+  ngx_http_set_ctx(r, ctx, ngx_http_s3_auth_module);
+
+  rc = ngx_http_read_client_request_body(r, ngx_http_s3_auth_body_handler);
+  if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  ngx_http_finalize_request(r, NGX_DONE);
+  return NGX_DONE;
+}
+
+static ngx_int_t
+ngx_http_s3_proxy_sign(ngx_http_request_t *r)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  const ngx_str_t *declared_hash = NULL;
+  ngx_http_s3_auth_ctx_t *ctx;
+  ngx_int_t rc;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+
+  if(conf->verify && ctx == NULL && !r->internal) {
+    rc = ngx_http_s3_auth_verify(r, conf, &declared_hash);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  if(!conf->enabled) {
+    if(ctx != NULL) {
+      /* resumed by ngx_http_s3_auth_body_handler */
+      return ctx->status;
+    }
+
+    /* verified only, a body is checked before it is passed on */
+    return declared_hash != NULL ? ngx_http_s3_auth_read_body(r, conf, declared_hash) : NGX_DECLINED;
+  }
+
+  if ((r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) && declared_hash != NULL) {
+    /* signed with the hash of an empty body, which is not what would be passed on */
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0, "s3 auth: %V request with a body", &r->method_name);
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  if (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)) {
+    if (!conf->set_headers) {
+      return ngx_http_s3_auth_defer_signing(r, &EMPTY_STRING_SHA256);
+    }
+
+    if (conf->sign_batch > 0 && conf->signature_cache == NULL && r == r->connection->data) {
+      return ngx_http_s3_auth_sign_batched(r, conf);
+    }
+
+    return ngx_http_s3_auth_sign_request(r, conf, &EMPTY_STRING_SHA256);
+  }
+
+  if (!(r->method & (NGX_HTTP_PUT|NGX_HTTP_POST))) {
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_REJECTED, 1);
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  if (conf->streaming && r->method == NGX_HTTP_PUT) {
+    rc = ngx_http_s3_auth_start_streaming(r, conf);
+    if (rc != NGX_OK || declared_hash == NULL) {
+      return rc;
+    }
+
+    /* the chunks go upstream as they come, a mismatch keeps the last one back */
+    ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+    ctx->declared_hash = declared_hash;
+    ctx->body_hash = ngx_s3_auth__sha256_init(r->pool);
+    return ctx->body_hash != NULL ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if (ctx != NULL) {
+    /* phases were resumed by ngx_http_s3_auth_body_handler */
+    return ctx->status;
+  }
+
+  return ngx_http_s3_auth_read_body(r, conf, declared_hash);
+}
+
+static ngx_chain_t *
+ngx_http_s3_auth_get_chunk(ngx_http_request_t *r, ngx_http_s3_auth_ctx_t *ctx)
+{
+  ngx_chain_t *cl;
+  ngx_buf_t *b;
+  size_t size;
+
+  cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
+  if (cl == NULL) {
+    return NULL;
+  }
+
+  b = cl->buf;
+
+  if (b->start == NULL) {
+    /* room for the largest chunk header in front of the data, CRLF after it */
+    size = NGX_S3_AUTH_CHUNK_HEADER_MAX + ctx->chunk_size + 2;
+
+    b->start = ngx_palloc(r->pool, size);
+    if (b->start == NULL) {
+      return NULL;
+    }
+
+    b->end = b->start + size;
+    b->temporary = 1;
+    b->tag = (ngx_buf_tag_t) &ngx_http_s3_auth_module;
+  }
+
+  b->pos = b->start + NGX_S3_AUTH_CHUNK_HEADER_MAX;
+  b->last = b->pos;
+  b->last_buf = 0;
+
+  return cl;
+}
+
+/* signs the chunk and writes its header right in front of the data */
+static ngx_int_t
+ngx_http_s3_auth_finish_chunk(ngx_http_s3_auth_ctx_t *ctx, ngx_buf_t *b)
+{
+  u_char *data = b->start + NGX_S3_AUTH_CHUNK_HEADER_MAX;
+  size_t size = b->last - data;
+
+  if (ngx_s3_auth__chunk_signer_finish(ctx->chunk_signer) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  b->pos = data - ngx_s3_auth__chunk_header_len(size);
+  ngx_s3_auth__write_chunk_header(b->pos, size, ctx->chunk_signer->signature);
+
+  *b->last++ = CR;
+  *b->last++ = LF;
+
+  return NGX_OK;
+}
+
+/* re-frames the body into aws-chunked encoding, a chunk is passed on as soon
+   as it is full and its buffer is reused once the upstream has sent it */
+static ngx_int_t
+ngx_http_s3_auth_chunked_body_filter(ngx_http_request_t *r, ngx_http_s3_auth_ctx_t *ctx, ngx_chain_t *in)
+{
+  const ngx_str_t *payload_hash;
+  ngx_chain_t *cl, *out, **ll;
+  ngx_buf_t *b, *chunk;
+  size_t n;
+  ngx_int_t rc;
+
+  if (!r->request_body_no_buffering) {
+    /* a buffered body would keep every chunk in memory */
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "s3 auth: \"s3_streaming_upload\" requires \"proxy_request_buffering off\"");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  out = NULL;
+  ll = &out;
+
+  for (cl = in; cl; cl = cl->next) {
+    b = cl->buf;
+
+    for ( /* void */ ; b->pos < b->last; b->pos += n) {
+      if (ctx->chunk == NULL) {
+        ctx->chunk = ngx_http_s3_auth_get_chunk(r, ctx);
+        if (ctx->chunk == NULL) {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+      }
+
+      chunk = ctx->chunk->buf;
+      n = ngx_min((size_t) (b->last - b->pos), ctx->chunk_size - (size_t) (chunk->last - chunk->pos));
+
+      ngx_s3_auth__chunk_signer_update(ctx->chunk_signer, b->pos, n);
+      if (ctx->body_hash != NULL) {
+        ngx_s3_auth__sha256_update(ctx->body_hash, b->pos, n);
+      }
+      ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_BYTES_HASHED, n);
+      chunk->last = ngx_cpymem(chunk->last, b->pos, n);
+
+      if ((size_t) (chunk->last - chunk->pos) == ctx->chunk_size) {
+        if (ngx_http_s3_auth_finish_chunk(ctx, chunk) != NGX_OK) {
+          return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        *ll = ctx->chunk;
+        ll = &ctx->chunk->next;
+        ctx->chunk = NULL;
+      }
+    }
+
+    if (!b->last_buf) {
+      continue;
+    }
+
+    if (ctx->body_hash != NULL) {
+      /* without its final chunk the upload is never completed upstream */
+      payload_hash = ngx_s3_auth__sha256_final_hex(r->pool, ctx->body_hash);
+      ctx->body_hash = NULL;
+      if (payload_hash == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      if (!ngx_http_s3_auth_payload_matches(r, ctx->declared_hash, payload_hash)) {
+        return NGX_HTTP_BAD_REQUEST;
+      }
+    }
+
+    if (ctx->chunk != NULL) {
+      if (ngx_http_s3_auth_finish_chunk(ctx, ctx->chunk->buf) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+
+      *ll = ctx->chunk;
+      ll = &ctx->chunk->next;
+    }
+
+    /* the body ends with an empty, signed chunk */
+    ctx->chunk = ngx_http_s3_auth_get_chunk(r, ctx);
+    if (ctx->chunk == NULL || ngx_http_s3_auth_finish_chunk(ctx, ctx->chunk->buf) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->chunk->buf->last_buf = 1;
+    *ll = ctx->chunk;
+    ll = &ctx->chunk->next;
+    ctx->chunk = NULL;
+  }
+
+  *ll = NULL;
+
+  rc = ngx_http_next_request_body_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &out,
+                          (ngx_buf_tag_t) &ngx_http_s3_auth_module);
+
+  return rc;
+}
+
+/* hashes the request body as buffers arrive from the client, before they are
+   written to client_body_temp_path, so signing never needs a second pass */
+static ngx_int_t
+ngx_http_s3_auth_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  ngx_chain_t *cl;
+  off_t hashed;
+
+  if (ctx != NULL && ctx->chunk_signer != NULL) {
+    return ngx_http_s3_auth_chunked_body_filter(r, ctx, in);
+  }
+
+  if (ctx != NULL && ctx->body_hash != NULL && !ctx->hash_in_thread) {
+    hashed = 0;
+    for (cl = in; cl; cl = cl->next) {
+      if (ngx_buf_in_memory(cl->buf)) {
+        ngx_s3_auth__sha256_update(ctx->body_hash, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        hashed += cl->buf->last - cl->buf->pos;
+      }
+    }
+    ngx_http_s3_auth_count(r, NGX_HTTP_S3_AUTH_BYTES_HASHED, hashed);
+  }
+
+  return ngx_http_next_request_body_filter(r, in);
+}
+
+/* Content-Length of what actually goes upstream: the aws-chunked length for
+   streamed uploads, whatever the proxy module computed otherwise */
+static ngx_int_t
+ngx_http_s3_auth_content_length_variable(ngx_http_request_t *r,
+                                         ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  ngx_http_variable_value_t *vv;
+
+  if (ctx == NULL || ctx->chunk_signer == NULL) {
+    vv = ngx_http_get_variable(r, &ngx_http_s3_auth_proxy_length,
+                               ngx_hash_key(ngx_http_s3_auth_proxy_length.data,
+                                            ngx_http_s3_auth_proxy_length.len));
+    if (vv == NULL) {
+      return NGX_ERROR;
+    }
+
+    *v = *vv;
+    return NGX_OK;
+  }
+
+  v->len = ctx->content_length.len;
+  v->data = ctx->content_length.data;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* <scheme>://<endpoint><path>?<query>, signed for the current request path
+   with s3_presign_expires, so a location can redirect straight to the backend */
+static ngx_int_t
+ngx_http_s3_auth_presigned_url_variable(ngx_http_request_t *r,
+                                        ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_key_t key;
+  const ngx_str_t *target;
+  u_char *p;
+
+  if(ngx_http_s3_auth_signing_key(r, conf, &key, r->start_sec) != NGX_OK) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  target = ngx_s3_auth__presign(r->pool, r, key.access_key, key.signing_key, key.key_scope,
+                                &conf->endpoint, key.session_token, conf->presign_expires);
+  if(target == NULL) {
+    return NGX_ERROR;
+  }
+
+  v->len = conf->presign_scheme.len + sizeof("://") - 1 + conf->endpoint.len + target->len;
+  v->data = ngx_pnalloc(r->pool, v->len);
+  if(v->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_sprintf(v->data, "%V://%V%V", &conf->presign_scheme, &conf->endpoint, target);
+  v->len = p - v->data;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* HIT or MISS once the request is signed with s3_signature_cache */
+static ngx_int_t
+ngx_http_s3_auth_signature_cache_variable(ngx_http_request_t *r,
+                                          ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+
+  if (ctx == NULL || ctx->signature_cache_status == 0) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  if (ctx->signature_cache_status == NGX_HTTP_S3_AUTH_SIG_CACHE_HIT) {
+    v->len = sizeof("HIT") - 1;
+    v->data = (u_char *) "HIT";
+  } else {
+    v->len = sizeof("MISS") - 1;
+    v->data = (u_char *) "MISS";
+  }
+
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* $s3_canonical_request, $s3_string_to_sign, $s3_signed_headers and
+   $s3_signature of the request signed last */
+static ngx_int_t
+ngx_http_s3_auth_trace_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  const ngx_str_t *value;
+
+  value = ctx != NULL ? *(const ngx_str_t **) ((u_char *) ctx + data) : NULL;
+  if (value == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  v->len = value->len;
+  v->data = value->data;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+/* $s3_authorization, $s3_date, $s3_content_sha256 and $s3_security_token;
+   with "s3_set_headers off" the first of them evaluated signs the request,
+   which happens as the upstream request is made: cache hits never get here */
+static ngx_int_t
+ngx_http_s3_auth_header_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_ctx_t *ctx = ngx_http_get_module_ctx(r, ngx_http_s3_auth_module);
+  const ngx_str_t *payload_hash;
+  ngx_str_t method;
+  ngx_int_t rc;
+
+  if (ctx != NULL && ctx->payload_hash != NULL) {
+    payload_hash = ctx->payload_hash;
+    ctx->payload_hash = NULL;
+
+    method = r->method_name;
+    r->method_name = ngx_http_s3_auth_upstream_method(r);
+
+    rc = ngx_http_s3_auth_sign_request(r, ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module), payload_hash);
+    r->method_name = method;
+
+    if (rc != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "s3 auth: could not sign the upstream request");
+      return NGX_ERROR;
+    }
+  }
+
+  return ngx_http_s3_auth_trace_variable(r, v, data);
+}
+
+/* totals of the zone s3_signature_cache uses in the current location */
+static ngx_int_t
+ngx_http_s3_auth_signature_cache_counter_variable(ngx_http_request_t *r,
+                                                  ngx_http_variable_value_t *v, uintptr_t data)
+{
+  ngx_http_s3_auth_conf_t *conf = ngx_http_get_module_loc_conf(r, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_sig_cache_ctx_t *ctx;
+  ngx_atomic_t *counter;
+
+  if (conf->signature_cache == NULL) {
+    v->not_found = 1;
+    return NGX_OK;
+  }
+
+  ctx = conf->signature_cache->data;
+  counter = (ngx_atomic_t *) ((u_char *) ctx->sh + data);
+
+  v->data = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+  if (v->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  v->len = ngx_sprintf(v->data, "%uA", *counter) - v->data;
+  v->valid = 1;
+  v->no_cacheable = 0;
+  v->not_found = 0;
+
+  return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_s3_auth_add_variables(ngx_conf_t *cf)
+{
+  ngx_http_variable_t *var, *v;
+
+  for (v = ngx_http_s3_auth_vars; v->name.len; v++) {
+    var = ngx_http_add_variable(cf, &v->name, v->flags);
+    if (var == NULL) {
+      return NGX_ERROR;
+    }
+
+    var->get_handler = v->get_handler;
+    var->data = v->data;
+  }
+
+  return NGX_OK;
+}
+
+static char *
+ngx_http_s3_endpoint(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  char *p = conf;
+  ngx_str_t *field, *value;
+
+  field = (ngx_str_t *)(p + cmd->offset);
   value = cf->args->elts;
 
-  *field = value[1];
+  *field = value[1];
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  /*
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_s3_proxy_sign;
+  */
+  ngx_http_s3_auth_conf_t *mconf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_s3_auth_module);
+  mconf->enabled = 1;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_verify_credential(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_http_s3_auth_credential_t *cred;
+  ngx_str_t *value = cf->args->elts;
+
+  if(value[1].len == 0 || value[2].len == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "empty access key or secret key");
+    return NGX_CONF_ERROR;
+  }
+
+  if(mconf->verify_credentials == NGX_CONF_UNSET_PTR) {
+    mconf->verify_credentials = ngx_array_create(cf->pool, 4, sizeof(ngx_http_s3_auth_credential_t));
+    if(mconf->verify_credentials == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+
+  cred = ngx_array_push(mconf->verify_credentials);
+  if(cred == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  cred->access_key = value[1];
+  cred->secret_key.len = sizeof("AWS4") - 1 + value[2].len;
+  cred->secret_key.data = ngx_pnalloc(cf->pool, cred->secret_key.len);
+  if(cred->secret_key.data == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  ngx_memcpy(ngx_cpymem(cred->secret_key.data, "AWS4", sizeof("AWS4") - 1), value[2].data, value[2].len);
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_verify_replay_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = conf;
+  ngx_http_s3_auth_replay_ctx_t *ctx;
+  ngx_str_t *value = cf->args->elts, name, s;
+  ssize_t size;
+  u_char *p;
+
+  if(mcf->replay_zone != NULL) {
+    return "is duplicate";
+  }
+
+  p = ngx_strlchr(value[1].data, value[1].data + value[1].len, ':');
+  if(p == NULL || p == value[1].data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\", expected name:size", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  name.data = value[1].data;
+  name.len = p - value[1].data;
+
+  s.data = p + 1;
+  s.len = value[1].data + value[1].len - s.data;
+  size = ngx_parse_size(&s);
+  if(size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid size of zone \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_replay_ctx_t));
+  if(ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  mcf->replay_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_s3_auth_module);
+  if(mcf->replay_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  if(mcf->replay_zone->data != NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already used", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  mcf->replay_zone->init = ngx_http_s3_auth_init_replay_zone;
+  mcf->replay_zone->data = ctx;
 
   return NGX_CONF_OK;
 }
 
 static char *
-ngx_http_s3_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_s3_signature_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-  /*
-    ngx_http_core_loc_conf_t  *clcf;
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_http_s3_auth_main_conf_t *mcf;
+  ngx_http_s3_auth_sig_cache_ctx_t *ctx;
+  ngx_str_t *value = cf->args->elts, name, s;
+  ngx_shm_zone_t *zone, **zone_ptr;
+  ssize_t size;
+  ngx_uint_t i;
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_s3_proxy_sign;
-  */
-  ngx_http_s3_auth_conf_t *mconf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_s3_auth_module);
-  mconf->enabled = 1;
+  if(mconf->signature_cache != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  if(cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+    mconf->signature_cache = NULL;
+    return NGX_CONF_OK;
+  }
+
+  ngx_str_null(&name);
+  size = 0;
+
+  for(i = 1; i < cf->args->nelts; i++) {
+    if(ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+      name.data = value[i].data + 5;
+      name.len = value[i].len - 5;
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "size=", 5) == 0) {
+      s.data = value[i].data + 5;
+      s.len = value[i].len - 5;
+      size = ngx_parse_size(&s);
+      if(size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  if(name.len == 0 || size == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" requires \"zone=\" and \"size=\"", &cmd->name);
+    return NGX_CONF_ERROR;
+  }
+
+  zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_s3_auth_module);
+  if(zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  if(zone->data == NULL) {
+    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_sig_cache_ctx_t));
+    if(ctx == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    zone->init = ngx_http_s3_auth_init_sig_cache_zone;
+    zone->data = ctx;
+
+    mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+    zone_ptr = ngx_array_push(&mcf->signature_caches);
+    if(zone_ptr == NULL) {
+      return NGX_CONF_ERROR;
+    }
+    *zone_ptr = zone;
+  } else if(zone->init != ngx_http_s3_auth_init_sig_cache_zone) {
+    /* locations may share a signature cache, not the replay zone */
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already used", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  mconf->signature_cache = zone;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_credentials_map(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+  ngx_http_compile_complex_value_t ccv;
+  ngx_http_s3_auth_creds_ctx_t *ctx, **ctxp;
+  ngx_str_t *value = cf->args->elts, name, file, s;
+  ngx_msec_t interval;
+  ngx_shm_zone_t *zone;
+  ngx_uint_t i;
+  ssize_t size;
+  u_char *p;
+
+  if(mconf->credentials_map != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  ngx_str_null(&name);
+  ngx_str_null(&file);
+  size = 0;
+  interval = 5000;
+
+  for(i = 2; i < cf->args->nelts; i++) {
+    if(ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+      name.data = value[i].data + 5;
+      p = ngx_strlchr(name.data, value[i].data + value[i].len, ':');
+      if(p == NULL || p == name.data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone \"%V\", expected zone=name:size", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      name.len = p - name.data;
+
+      s.data = p + 1;
+      s.len = value[i].data + value[i].len - s.data;
+      size = ngx_parse_size(&s);
+      if(size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid zone size \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "file=", 5) == 0) {
+      file.data = value[i].data + 5;
+      file.len = value[i].len - 5;
+      if(file.len == 0 || ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid file \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+      s.data = value[i].data + 9;
+      s.len = value[i].len - 9;
+      interval = ngx_parse_time(&s, 0);
+      if(interval == (ngx_msec_t) NGX_ERROR || interval == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid interval \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  if(name.len == 0 || file.len == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" requires \"zone=\" and \"file=\"", &cmd->name);
+    return NGX_CONF_ERROR;
+  }
+
+  mconf->credentials_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+  if(mconf->credentials_key == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+  ccv.cf = cf;
+  ccv.value = &value[1];
+  ccv.complex_value = mconf->credentials_key;
+
+  if(ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_s3_auth_module);
+  if(zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  if(zone->data != NULL) {
+    /* locations may share a map of the same file */
+    ctx = zone->data;
+    if(zone->init != ngx_http_s3_auth_init_credentials_zone
+       || ctx->file.len != file.len || ngx_strncmp(ctx->file.data, file.data, file.len) != 0)
+      {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already used", &name);
+        return NGX_CONF_ERROR;
+      }
+
+    mconf->credentials_map = zone;
+    return NGX_CONF_OK;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_creds_ctx_t));
+  ctxp = ngx_array_push(&mcf->credentials_maps);
+  if(ctx == NULL || ctxp == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  ctx->file = file;
+  ctx->interval = interval;
+  *ctxp = ctx;
+
+  zone->init = ngx_http_s3_auth_init_credentials_zone;
+  zone->data = ctx;
+
+  mconf->credentials_map = zone;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_temporary_credentials(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+  ngx_http_s3_auth_provider_t *provider, **providers;
+  ngx_str_t *value = cf->args->elts, source, s;
+  ngx_msec_t timeout;
+  ngx_url_t *url;
+  ngx_uint_t i;
+  time_t refresh, token_ttl;
+
+  if(mconf->temporary_credentials != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  if(cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+    mconf->temporary_credentials = NULL;
+    return NGX_CONF_OK;
+  }
+
+  ngx_str_null(&source);
+  url = NULL;
+  refresh = 300;
+  timeout = 5000;
+  token_ttl = NGX_CONF_UNSET;
+
+  for(i = 1; i < cf->args->nelts; i++) {
+    if(ngx_strncmp(value[i].data, "file=", 5) == 0 && source.len == 0) {
+      source.data = value[i].data + 5;
+      source.len = value[i].len - 5;
+      if(source.len == 0 || ngx_conf_full_name(cf->cycle, &source, 1) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid file \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "url=", 4) == 0 && source.len == 0) {
+      source.data = value[i].data + 4;
+      source.len = value[i].len - 4;
+
+      /* metadata endpoints are plain http on a link-local address */
+      if(source.len <= 7 || ngx_strncasecmp(source.data, (u_char *) "http://", 7) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid url \"%V\", only http:// is supported", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+
+      url = ngx_pcalloc(cf->pool, sizeof(ngx_url_t));
+      if(url == NULL) {
+        return NGX_CONF_ERROR;
+      }
+
+      url->url.data = source.data + 7;
+      url->url.len = source.len - 7;
+      url->default_port = 80;
+      url->uri_part = 1;
+
+      if(ngx_parse_url(cf->pool, url) != NGX_OK) {
+        if(url->err) {
+          ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in \"%V\"", url->err, &value[i]);
+        }
+        return NGX_CONF_ERROR;
+      }
+
+      if(url->uri.len == 0) {
+        ngx_str_set(&url->uri, "/");
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "refresh=", 8) == 0) {
+      s.data = value[i].data + 8;
+      s.len = value[i].len - 8;
+      refresh = ngx_parse_time(&s, 1);
+      if(refresh == (time_t) NGX_ERROR || refresh < NGX_HTTP_S3_AUTH_REFRESH_RETRY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid refresh \"%V\", at least %ds", &value[i],
+                           NGX_HTTP_S3_AUTH_REFRESH_RETRY);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+      s.data = value[i].data + 8;
+      s.len = value[i].len - 8;
+      timeout = ngx_parse_time(&s, 0);
+      if(timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid timeout \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    if(ngx_strncmp(value[i].data, "imds_token=", 11) == 0) {
+      s.data = value[i].data + 11;
+      s.len = value[i].len - 11;
+      if(s.len == 3 && ngx_strncmp(s.data, "off", 3) == 0) {
+        token_ttl = 0;
+        continue;
+      }
+      token_ttl = ngx_parse_time(&s, 1);
+      if(token_ttl == (time_t) NGX_ERROR || token_ttl == 0 || token_ttl > NGX_HTTP_S3_AUTH_TOKEN_TTL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid imds_token \"%V\", \"off\" or up to %ds",
+                           &value[i], NGX_HTTP_S3_AUTH_TOKEN_TTL);
+        return NGX_CONF_ERROR;
+      }
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  if(source.len == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" requires \"file=\" or \"url=\"", &cmd->name);
+    return NGX_CONF_ERROR;
+  }
+
+  if(token_ttl == NGX_CONF_UNSET) {
+    /* instance metadata may require IMDSv2, other endpoints know nothing of it */
+    token_ttl = 0;
+    if(url != NULL
+       && ((url->host.len == sizeof("169.254.169.254") - 1
+            && ngx_strncmp(url->host.data, "169.254.169.254", url->host.len) == 0)
+           || (url->host.len == sizeof("[fd00:ec2::254]") - 1
+               && ngx_strncasecmp(url->host.data, (u_char *) "[fd00:ec2::254]", url->host.len) == 0)))
+      {
+        token_ttl = NGX_HTTP_S3_AUTH_TOKEN_TTL;
+      }
+
+  } else if(token_ttl > 0 && url == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"imds_token\" requires \"url=\"");
+    return NGX_CONF_ERROR;
+  }
+
+  /* locations using the same source share the credentials */
+  providers = mcf->providers.elts;
+  for(i = 0; i < mcf->providers.nelts; i++) {
+    provider = providers[i];
+    if(provider->source.len != source.len || ngx_strncmp(provider->source.data, source.data, source.len) != 0) {
+      continue;
+    }
+
+    if(provider->refresh != refresh || provider->timeout != timeout || provider->token_ttl != token_ttl) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" is already used with different parameters", &source);
+      return NGX_CONF_ERROR;
+    }
+
+    mconf->temporary_credentials = provider;
+    return NGX_CONF_OK;
+  }
+
+  provider = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_provider_t));
+  providers = ngx_array_push(&mcf->providers);
+  if(provider == NULL || providers == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  provider->source = source;
+  if(url == NULL) {
+    provider->file = source;
+  }
+  provider->url = url;
+  provider->refresh = refresh;
+  provider->timeout = timeout;
+  provider->token_ttl = token_ttl;
+  if(token_ttl > 0) {
+    provider->token.data = ngx_pnalloc(cf->pool, NGX_HTTP_S3_AUTH_TOKEN_MAX);
+    if(provider->token.data == NULL) {
+      return NGX_CONF_ERROR;
+    }
+  }
+  *providers = provider;
+
+  mconf->temporary_credentials = provider;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_sign_batch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_int_t n;
+
+  if(mconf->sign_batch != NGX_CONF_UNSET_UINT) {
+    return "is duplicate";
+  }
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    mconf->sign_batch = 0;
+    return NGX_CONF_OK;
+  }
+
+  n = ngx_atoi(value[1].data, value[1].len);
+  if(n < 2 || n > NGX_S3_AUTH_BATCH_MAX) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid batch size \"%V\", expected \"off\" or 2..%d",
+                       &value[1], NGX_S3_AUTH_BATCH_MAX);
+    return NGX_CONF_ERROR;
+  }
+
+  /* a loop over the messages would only add a queue and a posted event to every request */
+  if(!ngx_s3_auth__sha256_multi_buffer()) {
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0, "\"%V\" is ignored, the crypto backend cannot hash "
+                       "several messages at once on this CPU", &cmd->name);
+    mconf->sign_batch = 0;
+    return NGX_CONF_OK;
+  }
+
+  mconf->sign_batch = n;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_signed_headers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  static ngx_str_t ours[] = {
+    ngx_string("authorization"),
+    ngx_string("host"),
+    ngx_string("x-amz-content-sha256"),
+    ngx_string("x-amz-date"),
+    ngx_string("x-amz-decoded-content-length"),
+    ngx_string("x-amz-security-token"),
+  };
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_str_t *value = cf->args->elts;
+  ngx_http_s3_auth_signed_headers_t *sh;
+  header_pair_t *name, *names;
+  ngx_hash_key_t *keys;
+  ngx_hash_init_t hash;
+  ngx_uint_t i, j;
+
+  if(mconf->signed_headers != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  if(cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+    mconf->signed_headers = NULL;
+    return NGX_CONF_OK;
+  }
+
+  sh = ngx_pcalloc(cf->pool, sizeof(ngx_http_s3_auth_signed_headers_t));
+  if(sh == NULL || ngx_array_init(&sh->names, cf->pool, cf->args->nelts - 1, sizeof(header_pair_t)) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  for(i = 1; i < cf->args->nelts; i++) {
+    ngx_strlow(value[i].data, value[i].data, value[i].len);
+
+    for(j = 0; j < sizeof(ours) / sizeof(ours[0]); j++) {
+      if(value[i].len == ours[j].len && ngx_strncmp(value[i].data, ours[j].data, ours[j].len) == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"%V\" is signed by the module itself", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+    }
+
+    name = ngx_array_push(&sh->names);
+    if(name == NULL) {
+      return NGX_CONF_ERROR;
+    }
+    name->key = value[i];
+    ngx_str_null(&name->value);
+  }
+
+  /* requests merge their headers in this order with ours, no sorting per request */
+  names = sh->names.elts;
+  ngx_qsort(names, sh->names.nelts, sizeof(header_pair_t), ngx_s3_auth__cmp_hnames);
+
+  keys = ngx_palloc(cf->pool, sh->names.nelts * sizeof(ngx_hash_key_t));
+  if(keys == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  for(i = 0; i < sh->names.nelts; i++) {
+    if(i > 0 && ngx_s3_auth__cmp_hnames(&names[i - 1], &names[i]) == 0) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "duplicate header \"%V\"", &names[i].key);
+      return NGX_CONF_ERROR;
+    }
+
+    keys[i].key = names[i].key;
+    keys[i].key_hash = ngx_hash_key(names[i].key.data, names[i].key.len);
+    keys[i].value = &names[i];
+  }
+
+  /* matched against the hashes nginx computed while parsing the request headers */
+  hash.hash = &sh->hash;
+  hash.key = ngx_hash_key;
+  hash.max_size = 512;
+  hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+  hash.name = "s3_signed_headers_hash";
+  hash.pool = cf->pool;
+  hash.temp_pool = NULL;
+
+  if(ngx_hash_init(&hash, keys, sh->names.nelts) != NGX_OK) {
+    return NGX_CONF_ERROR;
+  }
+
+  mconf->signed_headers = sh;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_sign_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+  ngx_http_upstream_srv_conf_t *uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+  ngx_http_s3_auth_srv_conf_t *scf = conf;
+
+  if(scf->original_init_upstream != NULL) {
+    return "is duplicate";
+  }
+
+  /* wraps the balancer set so far, like keepalive it goes after it */
+  scf->original_init_upstream = uscf->peer.init_upstream != NULL
+    ? uscf->peer.init_upstream
+    : ngx_http_upstream_init_round_robin;
+  uscf->peer.init_upstream = ngx_http_s3_auth_init_upstream;
+
+  mcf->sign_peers = 1;
+
+  return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_s3_hash_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+  ngx_http_s3_auth_conf_t *mconf = conf;
+  ngx_str_t *value = cf->args->elts;
+
+  if(mconf->hash_thread_pool != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  if(ngx_strcmp(value[1].data, "off") == 0) {
+    mconf->hash_thread_pool = NULL;
+    return NGX_CONF_OK;
+  }
+
+  mconf->hash_thread_pool = ngx_thread_pool_add(cf, &value[1]);
+  if(mconf->hash_thread_pool == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  return NGX_CONF_OK;
+#else
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "\"s3_hash_thread_pool\" requires nginx built --with-threads");
+  return NGX_CONF_ERROR;
+#endif
+}
+
+static char *
+ngx_http_s3_auth_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  static ngx_str_t name = ngx_string("s3_auth_status");
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
+  ngx_http_core_loc_conf_t *clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+  if(mcf->status_zone == NULL) {
+    mcf->status_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize, &ngx_http_s3_auth_module);
+    if(mcf->status_zone == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    if(mcf->status_zone->data != NULL) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "zone \"%V\" is already used", &name);
+      return NGX_CONF_ERROR;
+    }
+
+    mcf->status_zone->init = ngx_http_s3_auth_init_status_zone;
+    mcf->status_zone->data = mcf;
+  }
+
+  clcf->handler = ngx_http_s3_auth_status_handler;
 
   return NGX_CONF_OK;
 }
@@ -209,11 +4597,27 @@ ngx_http_s3_sign(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 static ngx_int_t
 ngx_s3_auth_req_init(ngx_conf_t *cf)
 {
+  ngx_http_s3_auth_main_conf_t *mcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_s3_auth_module);
   ngx_http_handler_pt *h;
   ngx_http_core_main_conf_t *cmcf;
+  ngx_http_variable_t *v, *var;
+  ngx_uint_t i;
 
   cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
+  /* the trace costs a second pass over the canonical request, only taken
+     when some log format, header or complex value refers to it */
+  v = cmcf->variables.elts;
+  for(i = 0; i < cmcf->variables.nelts; i++) {
+    for(var = ngx_http_s3_auth_vars; var->name.len; var++) {
+      if(var->get_handler == ngx_http_s3_auth_trace_variable && v[i].name.len == var->name.len
+         && ngx_strncmp(v[i].name.data, var->name.data, var->name.len) == 0)
+        {
+          mcf->trace = 1;
+        }
+    }
+  }
+
   h = ngx_array_push(&cmcf->phases[NGX_HTTP_PREACCESS_PHASE].handlers);
   if (h == NULL) {
     return NGX_ERROR;
@@ -221,5 +4625,8 @@ ngx_s3_auth_req_init(ngx_conf_t *cf)
 
   *h = ngx_http_s3_proxy_sign;
 
+  ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+  ngx_http_top_request_body_filter = ngx_http_s3_auth_body_filter;
+
   return NGX_OK;
 }
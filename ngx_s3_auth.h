@@ -4,7 +4,8 @@
  * request as ngx_http_request_t and modifiying it to introduce the
  * Authorization header in compliance with the S3 V4 spec. The IAM access
  * key and the signing key (not to be confused with the secret key, see ./tools/s3-auth-gen) along
- * with it's scope are taken as inputs.
+ * with it's scope are taken as inputs. Alternatively signing keys can be
+ * derived from the secret key per UTC day, see struct S3SigningKeyCache.
  *
  * The actual nginx module binding code is not present in this file. This file
  * is meant to serve as an "S3 Signing SDK for nginx".
@@ -29,6 +30,10 @@
 #include <ngx_http.h>
 #include "ngx_s3_auth_crypto.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 typedef ngx_keyval_t header_pair_t;
 
 struct S3CanonicalRequestDetails {
@@ -43,6 +48,12 @@ struct S3CanonicalHeaderDetails {
   ngx_array_t *header_list;
 };
 
+struct S3CanonicalSink {
+  ngx_s3_auth__sha256_ctx_t *hash;
+  u_char *pos;
+  size_t len;
+};
+
 struct S3SignedRequestDetails {
   const ngx_str_t *signature;
   const ngx_str_t *signed_header_names;
@@ -55,33 +66,38 @@ static const ngx_str_t HASH_HEADER = ngx_string("x-amz-content-sha256");
 static const ngx_str_t DATE_HEADER = ngx_string("x-amz-date");
 static const ngx_str_t HOST_HEADER = ngx_string("host");
 static const ngx_str_t AUTHZ_HEADER = ngx_string("Authorization");
+static const ngx_str_t SECURITY_TOKEN_HEADER = ngx_string("x-amz-security-token");
 
 static inline char* __CHAR_PTR_U(u_char* ptr) { return (char*) ptr; }
 static inline const char* __CONST_CHAR_PTR_U(const u_char* ptr) { return (const char*) ptr; }
 
-static inline const ngx_str_t* ngx_s3_auth__compute_request_time(ngx_pool_t *pool, const time_t *timep) {
-  int size = 18; // len(date string + \0)
-  const char fmt[] = "%Y%m%dT%H%M%SZ";
+#define NGX_S3_AUTH_DATE_LEN (sizeof("yyyymmddThhmmssZ") - 1)
 
-  ngx_str_t *const t = ngx_palloc(pool, sizeof(ngx_str_t));
-  struct tm *tm_p = ngx_palloc(pool, sizeof(struct tm));
-  gmtime_r(timep, tm_p);
+// writes the x-amz-date form of sec, NGX_S3_AUTH_DATE_LEN bytes
+static inline u_char* ngx_s3_auth__format_request_time(u_char *p, time_t sec) {
+  struct tm tm;
+
+  gmtime_r(&sec, &tm);
+
+  return ngx_sprintf(p, "%04d%02d%02dT%02d%02d%02dZ",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                     tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
 
-  t->data = ngx_palloc(pool, size);
-  t->len = strftime(__CHAR_PTR_U(t->data), size - 1, fmt, tm_p);
+static inline const ngx_str_t* ngx_s3_auth__compute_request_time(ngx_pool_t *pool, const time_t *timep) {
+  ngx_str_t *const t = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (t == NULL) {
+    return NULL;
+  }
 
-  // If the length of the resulting C string, including the terminating null-character,
-  // doesn't exceed maxsize, the function returns the total number of characters copied
-  // to ptr (not including the terminating null-character).
-  // Otherwise, it returns zero, and the contents of the array pointed by ptr are indeterminate.
-  // https://www.cplusplus.com/reference/ctime/strftime/
-  while (t->len == 0) {
-    ngx_pfree(pool, t->data);
-    size *= 2;
-    t->data = ngx_palloc(pool, size);
-    t->len = strftime(__CHAR_PTR_U(t->data), size - 1, fmt, tm_p);
+  t->data = ngx_pnalloc(pool, NGX_S3_AUTH_DATE_LEN + 1);
+  if (t->data == NULL) {
+    return NULL;
   }
 
+  t->len = ngx_s3_auth__format_request_time(t->data, *timep) - t->data;
+  t->data[t->len] = '\0';
+
   return t;
 }
 
@@ -100,271 +116,697 @@ static inline int ngx_s3_auth__cmp_hnames(const void *one, const void *two) {
   }
 }
 
-static inline const ngx_str_t* ngx_s3_auth__canonize_query_string(ngx_pool_t *pool,
-                                                                  const ngx_http_request_t *req) {
-  u_char *p, *ampersand, *equal, *last;
-  size_t i, len;
-  ngx_str_t *qs = ngx_palloc(pool, sizeof(ngx_str_t));
+// RFC 3986 unreserved characters (A-Za-z0-9-._~) plus the slash, S3 wants
+// everything else in the path percent-encoded
+static const uint32_t ngx_s3_auth__uri_unescaped[] = {
+  0x00000000, /* 0000 0000 0000 0000  0000 0000 0000 0000 */
+              /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
+  0x03ffe000, /* 0000 0011 1111 1111  1110 0000 0000 0000 */
+              /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
+  0x87fffffe, /* 1000 0111 1111 1111  1111 1111 1111 1110 */
+              /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
+  0x47fffffe, /* 0100 0111 1111 1111  1111 1111 1111 1110 */
+  0x00000000,
+  0x00000000,
+  0x00000000,
+  0x00000000
+};
+
+static const u_char ngx_s3_auth__hex[] = "0123456789ABCDEF";
+
+// Query arguments are canonicalized the way S3 reads them: percent-decoded
+// ('+' is a space) and encoded again per RFC 3986, the slash included.
+// A client sending "prefix=a%2Fb" must not end up signing "a%252Fb".
+static const uint32_t ngx_s3_auth__arg_unescaped[] = {
+  0x00000000, /* 0000 0000 0000 0000  0000 0000 0000 0000 */
+              /* ?>=< ;:98 7654 3210  /.-, +*)( '&%$ #"!  */
+  0x03ff6000, /* 0000 0011 1111 1111  0110 0000 0000 0000 */
+              /* _^]\ [ZYX WVUT SRQP  ONML KJIH GFED CBA@ */
+  0x87fffffe, /* 1000 0111 1111 1111  1111 1111 1111 1110 */
+              /*  ~}| {zyx wvut srqp  onml kjih gfed cba` */
+  0x47fffffe, /* 0100 0111 1111 1111  1111 1111 1111 1110 */
+  0x00000000,
+  0x00000000,
+  0x00000000,
+  0x00000000
+};
+
+static inline ngx_uint_t ngx_s3_auth__arg_needs_escape(u_char c) {
+  return !(ngx_s3_auth__arg_unescaped[c >> 5] & (1U << (c & 0x1f)));
+}
+
+#if defined(__SSE2__)
+
+// bytes of x in [lo, hi]; SSE2 only compares signed, so the range is
+// shifted to start at -128 first
+static inline __m128i ngx_s3_auth__in_range_epi8(__m128i x, u_char lo, u_char hi) {
+  return _mm_cmplt_epi8(_mm_add_epi8(x, _mm_set1_epi8((char) (0x80 - lo))),
+                        _mm_set1_epi8((char) (0x80 + (hi - lo) + 1)));
+}
+
+#endif
+
+// first byte in [p, last) which is not unreserved, the slash counts as
+// unreserved for paths; 16 bytes at a time where SSE2 is available
+static inline const u_char* ngx_s3_auth__skip_unreserved(const u_char *p, const u_char *last, ngx_uint_t slash) {
+#if defined(__SSE2__)
+  __m128i x, ok;
+  unsigned mask;
+
+  for (; last - p >= 16; p += 16) {
+    x = _mm_loadu_si128((const __m128i *) p);
+
+    ok = ngx_s3_auth__in_range_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+    ok = _mm_or_si128(ok, ngx_s3_auth__in_range_epi8(x, '0', '9'));
+    ok = _mm_or_si128(ok, ngx_s3_auth__in_range_epi8(x, '-', slash ? '/' : '.'));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+    ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, _mm_set1_epi8('~')));
+
+    mask = (unsigned) _mm_movemask_epi8(ok) ^ 0xffff;
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  const uint32_t *table = slash ? ngx_s3_auth__uri_unescaped : ngx_s3_auth__arg_unescaped;
+
+  while (p < last && (table[*p >> 5] & (1U << (*p & 0x1f)))) {
+    p++;
+  }
+
+  return p;
+}
+
+static inline u_char ngx_s3_auth__hex_value(u_char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+
+  return 0xff;
+}
+
+// decodes one character of a query argument and moves *p past it,
+// a '%' which does not start a valid escape is taken literally
+static inline u_char ngx_s3_auth__arg_decode(const u_char **p, const u_char *last) {
+  u_char c = *(*p)++, hi, lo;
+
+  if (c == '+') {
+    return ' ';
+  }
+
+  if (c != '%' || last - *p < 2) {
+    return c;
+  }
+
+  hi = ngx_s3_auth__hex_value((*p)[0]);
+  lo = ngx_s3_auth__hex_value((*p)[1]);
+  if (hi > 0xf || lo > 0xf) {
+    return c;
+  }
+
+  *p += 2;
+  return (u_char) (hi << 4 | lo);
+}
+
+// one key or value of an argument: adds its canonical length to *len and
+// returns where it ends, at '&', at `stop` or at last; *identity is cleared
+// unless the source already is in canonical form
+static inline const u_char* ngx_s3_auth__scan_arg(const u_char *p, const u_char *last, u_char stop,
+                                                  size_t *len, ngx_uint_t *identity) {
+  const u_char *unit;
+  u_char c;
+
+  while (p < last) {
+    // the common case, taken as is
+    unit = ngx_s3_auth__skip_unreserved(p, last, 0);
+    *len += unit - p;
+    p = unit;
+
+    if (p == last || *p == '&' || *p == stop) {
+      break;
+    }
+
+    unit = p;
+    c = ngx_s3_auth__arg_decode(&p, last);
+
+    if (ngx_s3_auth__arg_needs_escape(c)) {
+      *len += 3;
+      if (p - unit != 3 || unit[1] != ngx_s3_auth__hex[c >> 4] || unit[2] != ngx_s3_auth__hex[c & 0xf]) {
+        *identity = 0;
+      }
+    } else {
+      (*len)++;
+      *identity = 0;
+    }
+  }
+
+  return p;
+}
+
+// the same walk as ngx_s3_auth__scan_arg, writing the canonical form to dst
+static inline u_char* ngx_s3_auth__write_escaped_arg(u_char *dst, const u_char **src, const u_char *last,
+                                                     u_char stop) {
+  const u_char *p = *src, *run;
+  u_char c;
+
+  while (p < last) {
+    run = p;
+    p = ngx_s3_auth__skip_unreserved(p, last, 0);
+    dst = ngx_cpymem(dst, run, p - run);
+
+    if (p == last || *p == '&' || *p == stop) {
+      break;
+    }
+
+    c = ngx_s3_auth__arg_decode(&p, last);
+
+    if (ngx_s3_auth__arg_needs_escape(c)) {
+      *dst++ = '%';
+      *dst++ = ngx_s3_auth__hex[c >> 4];
+      *dst++ = ngx_s3_auth__hex[c & 0xf];
+    } else {
+      *dst++ = c;
+    }
+  }
+
+  *src = p;
+  return dst;
+}
+
+// splits the query string into canonical key/value pairs, unsorted,
+// with room for `extra` more pairs the caller wants to add.
+// All pairs are escaped into a single buffer laid out as key=value&key=value,
+// if the arguments are canonical already the pairs reference them instead.
+static inline ngx_array_t* ngx_s3_auth__query_string_args(ngx_pool_t *pool, const ngx_str_t *args, size_t extra) {
+  const u_char *p, *last, *equal;
+  ngx_uint_t nargs, identity;
+  u_char *buf;
+  size_t len;
 
   header_pair_t *qs_arg;
-  ngx_array_t *query_string_args = ngx_array_create(pool, 0, sizeof(header_pair_t));
+  ngx_array_t *query_string_args;
+
+  nargs = 0;
+  len = 0;
+  identity = 1;
+  last = args->data + args->len;
+
+  for (p = args->data; p < last; p++) {
+    if (*p == '&') {
+      // "a=1&&b=2", S3 skips the empty argument
+      identity = 0;
+      continue;
+    }
 
-  if (req->args.len == 0) {
-    return &EMPTY_STRING;
+    nargs++;
+    p = ngx_s3_auth__scan_arg(p, last, '=', &len, &identity);
+    if (p < last && *p == '=') {
+      p = ngx_s3_auth__scan_arg(p + 1, last, '&', &len, &identity);
+    } else {
+      // "acl" is signed as "acl="
+      identity = 0;
+    }
+    len += 2;
+  }
+
+  query_string_args = ngx_array_create(pool, ngx_max(nargs + extra, 1), sizeof(header_pair_t));
+  if (query_string_args == NULL || nargs == 0) {
+    return query_string_args;
+  }
+
+  buf = NULL;
+  if (!identity) {
+    buf = ngx_pnalloc(pool, len);
+    if (buf == NULL) {
+      return NULL;
+    }
   }
 
-  p = req->args.data;
-  last = p + req->args.len;
+  for (p = args->data; p < last; p++) {
+    if (*p == '&') {
+      continue;
+    }
 
-  for (; p < last; p++) {
     qs_arg = ngx_array_push(query_string_args);
 
-    ampersand = ngx_strlchr(p, last, '&');
-    if (ampersand == NULL) {
-      ampersand = last;
+    if (identity) {
+      equal = ngx_strlchr((u_char *) p, (u_char *) last, '=');
+      qs_arg->key.data = (u_char *) p;
+      qs_arg->key.len = equal - p;
+
+      p = ngx_strlchr((u_char *) equal, (u_char *) last, '&');
+      if (p == NULL) {
+        p = last;
+      }
+      qs_arg->value.data = (u_char *) equal + 1;
+      qs_arg->value.len = p - equal - 1;
+      continue;
     }
 
-    equal = ngx_strlchr(p, last, '=');
-    if ((equal == NULL) || (equal > ampersand)) {
-      equal = ampersand;
+    qs_arg->key.data = buf;
+    buf = ngx_s3_auth__write_escaped_arg(buf, &p, last, '=');
+    qs_arg->key.len = buf - qs_arg->key.data;
+    *buf++ = '=';
+
+    qs_arg->value.data = buf;
+    if (p < last && *p == '=') {
+      p++;
+      buf = ngx_s3_auth__write_escaped_arg(buf, &p, last, '&');
     }
+    qs_arg->value.len = buf - qs_arg->value.data;
+    *buf++ = '&';
+  }
 
-    len = equal - p;
-    qs_arg->key.data = ngx_palloc(pool, len*3);
-    qs_arg->key.len = (u_char *)ngx_escape_uri(qs_arg->key.data, p, len, NGX_ESCAPE_ARGS) - qs_arg->key.data;
+  return query_string_args;
+}
 
+static inline int ngx_s3_auth__cmp_str(const ngx_str_t *one, const ngx_str_t *two) {
+  int ret = ngx_memcmp(one->data, two->data, ngx_min(one->len, two->len));
 
-    len = ampersand - equal;
-    if(len > 0 ) {
-      qs_arg->value.data = ngx_palloc(pool, len*3);
-      qs_arg->value.len = (u_char *)ngx_escape_uri(qs_arg->value.data, equal+1, len-1, NGX_ESCAPE_ARGS) - qs_arg->value.data;
-    } else {
-      qs_arg->value = EMPTY_STRING;
+  if (ret != 0) {
+    return ret;
+  }
+
+  return (one->len > two->len) - (one->len < two->len);
+}
+
+// by name, then by value for repeated names
+static inline int ngx_s3_auth__cmp_qs_args(const void *one, const void *two) {
+  const header_pair_t *first = one, *second = two;
+  int ret = ngx_s3_auth__cmp_str(&first->key, &second->key);
+
+  return ret != 0 ? ret : ngx_s3_auth__cmp_str(&first->value, &second->value);
+}
+
+#define NGX_S3_AUTH_QS_INSERTION_SORT 32
+
+static inline void ngx_s3_auth__sort_query_string_args(header_pair_t *qs_args, size_t n) {
+  header_pair_t tmp;
+  size_t i, j;
+
+  // most clients send them sorted already
+  for (i = 1; i < n; i++) {
+    if (ngx_s3_auth__cmp_qs_args(&qs_args[i - 1], &qs_args[i]) > 0) {
+      break;
+    }
+  }
+
+  if (i >= n) {
+    return;
+  }
+
+  if (n > NGX_S3_AUTH_QS_INSERTION_SORT) {
+    ngx_qsort(qs_args, n, sizeof(header_pair_t), ngx_s3_auth__cmp_qs_args);
+    return;
+  }
+
+  // everything before i is in order
+  for (; i < n; i++) {
+    tmp = qs_args[i];
+    for (j = i; j > 0 && ngx_s3_auth__cmp_qs_args(&qs_args[j - 1], &tmp) > 0; j--) {
+      qs_args[j] = qs_args[j - 1];
     }
+    qs_args[j] = tmp;
+  }
+}
+
+// sorts the pairs and joins them into key=value&key=value, pairs which
+// still follow each other in that form in memory are not copied again
+static inline const ngx_str_t* ngx_s3_auth__join_query_string(ngx_pool_t *pool, ngx_array_t *query_string_args) {
+  header_pair_t *qs_arg;
+  size_t i, len;
+  ngx_str_t *qs;
+  u_char *p;
 
-    p = ampersand;
+  if (query_string_args->nelts == 0) {
+    return &EMPTY_STRING;
   }
 
-  ngx_qsort(query_string_args->elts, (size_t) query_string_args->nelts,
-            sizeof(header_pair_t), ngx_s3_auth__cmp_hnames);
+  qs_arg = query_string_args->elts;
+  ngx_s3_auth__sort_query_string_args(qs_arg, query_string_args->nelts);
 
-  qs->data = ngx_palloc(pool, req->args.len*3 + query_string_args->nelts*2);
-  qs->len = 0;
+  qs = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (qs == NULL) {
+    return NULL;
+  }
 
+  p = qs_arg[0].key.data;
+  len = 0;
   for(i = 0; i < query_string_args->nelts; i++) {
-    qs_arg = &((header_pair_t*)query_string_args->elts)[i];
+    if (p != NULL
+        && (qs_arg[i].key.data != p
+            || qs_arg[i].value.data != p + qs_arg[i].key.len + 1
+            || p[qs_arg[i].key.len] != '='
+            || (i > 0 && p[-1] != '&')))
+      {
+        p = NULL;
+      }
+
+    if (p != NULL) {
+      p = qs_arg[i].value.data + qs_arg[i].value.len + 1;
+    }
 
-    ngx_memcpy(qs->data + qs->len, qs_arg->key.data, qs_arg->key.len);
-    qs->len += qs_arg->key.len;
+    len += qs_arg[i].key.len + 1 + qs_arg[i].value.len + 1;
+  }
 
-    *(qs->data + qs->len) = '=';
-    qs->len++;
+  if (p != NULL) {
+    qs->data = qs_arg[0].key.data;
+    qs->len = len - 1;
+    return qs;
+  }
 
-    ngx_memcpy(qs->data + qs->len, qs_arg->value.data, qs_arg->value.len);
-    qs->len += qs_arg->value.len;
+  qs->data = ngx_pnalloc(pool, len);
+  if (qs->data == NULL) {
+    return NULL;
+  }
 
-    *(qs->data + qs->len) = '&';
-    qs->len++;
+  p = qs->data;
+  for(i = 0; i < query_string_args->nelts; i++) {
+    p = ngx_cpymem(p, qs_arg[i].key.data, qs_arg[i].key.len);
+    *p++ = '=';
+    p = ngx_cpymem(p, qs_arg[i].value.data, qs_arg[i].value.len);
+    *p++ = '&';
   }
-  qs->len--;
+  qs->len = len - 1;
 
   return qs;
 }
 
-static inline struct S3CanonicalHeaderDetails ngx_s3_auth__canonize_headers(ngx_pool_t *pool,
-                                                                            const ngx_http_request_t *req,
-                                                                            const ngx_str_t *date,
-                                                                            const ngx_str_t *content_hash,
-                                                                            const ngx_str_t *s3_endpoint) {
-  size_t header_names_size = 1, header_nameval_size = 1;
-  size_t i, used;
-  u_char *buf_progress;
-  struct S3CanonicalHeaderDetails header_details;
+// NULL if the pool is exhausted
+static inline const ngx_str_t* ngx_s3_auth__canonize_args(ngx_pool_t *pool, const ngx_str_t *args) {
+  ngx_array_t *query_string_args;
+
+  if (args->len == 0) {
+    return &EMPTY_STRING;
+  }
+
+  query_string_args = ngx_s3_auth__query_string_args(pool, args, 0);
+  if (query_string_args == NULL) {
+    return NULL;
+  }
+
+  return ngx_s3_auth__join_query_string(pool, query_string_args);
+}
+
+static inline const ngx_str_t* ngx_s3_auth__canonize_query_string(ngx_pool_t *pool,
+                                                                  const ngx_http_request_t *req) {
+  return ngx_s3_auth__canonize_args(pool, &req->args);
+}
+
+// Canonical request parts are written through a sink, so the same code can
+// either hash them on the fly (signing hot path), copy them into a buffer
+// (tests, debugging) or just count their length (sizing that buffer)
+static inline void ngx_s3_auth__sink_write(struct S3CanonicalSink *sink, const u_char *data, size_t len) {
+  if (sink->hash != NULL) {
+    ngx_s3_auth__sha256_update(sink->hash, data, len);
+  } else if (sink->pos != NULL) {
+    sink->pos = ngx_cpymem(sink->pos, data, len);
+  }
+  sink->len += len;
+}
+
+static inline void ngx_s3_auth__sink_write_str(struct S3CanonicalSink *sink, const ngx_str_t *str) {
+  ngx_s3_auth__sink_write(sink, str->data, str->len);
+}
+
+static inline void ngx_s3_auth__sink_write_char(struct S3CanonicalSink *sink, u_char c) {
+  ngx_s3_auth__sink_write(sink, &c, 1);
+}
 
-  ngx_array_t *settable_header_array = ngx_array_create(pool, 3, sizeof(header_pair_t));
+// writes the path escaped the way S3 wants it, unescaped runs are written
+// straight from the source without an intermediate copy
+static inline void ngx_s3_auth__write_escaped_uri(struct S3CanonicalSink *sink, const u_char *src, size_t len) {
+  const u_char *run, *last = src + len;
+  u_char escaped[3];
+
+  escaped[0] = '%';
+
+  for ( ;; ) {
+    run = src;
+    src = ngx_s3_auth__skip_unreserved(src, last, 1);
+    ngx_s3_auth__sink_write(sink, run, src - run);
+
+    if (src == last) {
+      return;
+    }
+
+    escaped[1] = ngx_s3_auth__hex[*src >> 4];
+    escaped[2] = ngx_s3_auth__hex[*src & 0xf];
+    ngx_s3_auth__sink_write(sink, escaped, sizeof(escaped));
+    src++;
+  }
+}
+
+// appends two lists sorted by name to dst, keeping the order
+static inline ngx_int_t ngx_s3_auth__merge_headers(ngx_array_t *dst,
+                                                   const header_pair_t *one, size_t n_one,
+                                                   const header_pair_t *two, size_t n_two) {
   header_pair_t *header_ptr;
 
-  header_ptr = ngx_array_push(settable_header_array);
-  header_ptr->key = HASH_HEADER;
-  header_ptr->value = *content_hash;
+  while (n_one > 0 || n_two > 0) {
+    header_ptr = ngx_array_push(dst);
+    if (header_ptr == NULL) {
+      return NGX_ERROR;
+    }
+
+    if (n_two == 0 || (n_one > 0 && ngx_s3_auth__cmp_hnames(one, two) < 0)) {
+      *header_ptr = *one++;
+      n_one--;
+    } else {
+      *header_ptr = *two++;
+      n_two--;
+    }
+  }
 
-  header_ptr = ngx_array_push(settable_header_array);
-  header_ptr->key = DATE_HEADER;
-  header_ptr->value = *date;
+  return NGX_OK;
+}
 
-  header_ptr = ngx_array_push(settable_header_array);
-  header_ptr->key = HOST_HEADER;
-  header_ptr->value.len = s3_endpoint->len;
-  header_ptr->value.data = ngx_palloc(pool, header_ptr->value.len);
-  header_ptr->value.len = ngx_snprintf(
-    header_ptr->value.data,
-    header_ptr->value.len,
-    "%V",
-    s3_endpoint) - header_ptr->value.data;
+// sorted list of the headers we sign, values are referenced, not copied
+// extra_headers (lowercase names sorted like ngx_s3_auth__cmp_hnames does,
+// may be NULL) are merged in with ours
+static inline ngx_array_t* ngx_s3_auth__signed_header_list(ngx_pool_t *pool,
+                                                           const ngx_str_t *date,
+                                                           const ngx_str_t *content_hash,
+                                                           const ngx_str_t *s3_endpoint,
+                                                           const ngx_array_t *extra_headers) {
+  header_pair_t ours[3];
+  size_t n_extra = extra_headers != NULL ? extra_headers->nelts : 0;
+  // room for the Authorization header pushed by ngx_s3_auth__add_auth_header
+  ngx_array_t *settable_header_array = ngx_array_create(pool, 4 + n_extra, sizeof(header_pair_t));
+
+  if (settable_header_array == NULL) {
+    return NULL;
+  }
 
-  ngx_qsort(
-    settable_header_array->elts,
-    (size_t) settable_header_array->nelts,
-    sizeof(header_pair_t),
-    ngx_s3_auth__cmp_hnames);
-  header_details.header_list = settable_header_array;
+  ours[0].key = HOST_HEADER;
+  ours[0].value = *s3_endpoint;
+  ours[1].key = HASH_HEADER;
+  ours[1].value = *content_hash;
+  ours[2].key = DATE_HEADER;
+  ours[2].value = *date;
 
-  for(i = 0; i < settable_header_array->nelts; i++) {
-    header_names_size += ((header_pair_t*) settable_header_array->elts)[i].key.len + 1;     // :
-    header_nameval_size += ((header_pair_t*) settable_header_array->elts)[i].key.len + 1;   // :
-    header_nameval_size += ((header_pair_t*) settable_header_array->elts)[i].value.len + 2; // \r\n
+  if (ngx_s3_auth__merge_headers(settable_header_array, ours, 3,
+                                 n_extra > 0 ? extra_headers->elts : NULL, n_extra) != NGX_OK) {
+    return NULL;
   }
 
-  //
+  return settable_header_array;
+}
 
-  header_details.canonical_header_str = ngx_palloc(pool, sizeof(ngx_str_t));
-  header_details.canonical_header_str->data = ngx_palloc(pool, header_nameval_size);
+// extra headers which sign the session token of temporary credentials
+static inline ngx_array_t* ngx_s3_auth__security_token_headers(ngx_pool_t *pool, const ngx_str_t *session_token) {
+  ngx_array_t *headers = ngx_array_create(pool, 1, sizeof(header_pair_t));
+  header_pair_t *header_ptr;
 
-  for(i = 0, used = 0, buf_progress = header_details.canonical_header_str->data;
-      i < settable_header_array->nelts;
-      i++, used = buf_progress - header_details.canonical_header_str->data) {
-    buf_progress = ngx_snprintf(buf_progress, header_nameval_size - used, "%V:%V\n",
-                                & ((header_pair_t*) settable_header_array->elts)[i].key,
-                                & ((header_pair_t*) settable_header_array->elts)[i].value);
+  if (headers == NULL) {
+    return NULL;
   }
-  header_details.canonical_header_str->len = used;
 
-  //
+  header_ptr = ngx_array_push(headers);
+  header_ptr->key = SECURITY_TOKEN_HEADER;
+  header_ptr->value = *session_token;
+
+  return headers;
+}
 
-  header_details.signed_header_names = ngx_palloc(pool, sizeof(ngx_str_t));
-  header_details.signed_header_names->data = ngx_palloc(pool, header_names_size);
+static inline void ngx_s3_auth__write_canonical_headers(struct S3CanonicalSink *sink, const ngx_array_t *header_list) {
+  const header_pair_t *header = header_list->elts;
+  size_t i;
 
-  for(i = 0, used = 0, buf_progress = header_details.signed_header_names->data;
-      i < settable_header_array->nelts;
-      i++, used = buf_progress - header_details.signed_header_names->data) {
-    buf_progress = ngx_snprintf(buf_progress, header_names_size - used, "%V;",
-                                & ((header_pair_t*) settable_header_array->elts)[i].key);
+  for (i = 0; i < header_list->nelts; i++) {
+    ngx_s3_auth__sink_write_str(sink, &header[i].key);
+    ngx_s3_auth__sink_write_char(sink, ':');
+    ngx_s3_auth__sink_write_str(sink, &header[i].value);
+    ngx_s3_auth__sink_write_char(sink, '\n');
   }
+}
 
-  used--;
-  header_details.signed_header_names->len = used;
-  header_details.signed_header_names->data[used] = 0;
+static inline void ngx_s3_auth__write_signed_header_names(struct S3CanonicalSink *sink, const ngx_array_t *header_list) {
+  const header_pair_t *header = header_list->elts;
+  size_t i;
 
-  return header_details;
+  for (i = 0; i < header_list->nelts; i++) {
+    if (i > 0) {
+      ngx_s3_auth__sink_write_char(sink, ';');
+    }
+    ngx_s3_auth__sink_write_str(sink, &header[i].key);
+  }
+}
+
+// runs the writer twice: once to learn the length and once to fill a
+// NUL-terminated pool string of exactly that length
+#define ngx_s3_auth__materialize(pool, str, sink, write)  \
+  do {                                                    \
+    (sink).hash = NULL;                                   \
+    (sink).pos = NULL;                                    \
+    (sink).len = 0;                                       \
+    write;                                                \
+    (str)->data = ngx_palloc((pool), (sink).len + 1);     \
+    (sink).pos = (str)->data;                             \
+    (sink).len = 0;                                       \
+    write;                                                \
+    (str)->len = (sink).len;                              \
+    (str)->data[(str)->len] = '\0';                       \
+  } while (0)
+
+static inline const ngx_str_t* ngx_s3_auth__signed_header_names(ngx_pool_t *pool, const ngx_array_t *header_list) {
+  struct S3CanonicalSink sink;
+  ngx_str_t *names = ngx_palloc(pool, sizeof(ngx_str_t));
+
+  ngx_s3_auth__materialize(pool, names, sink,
+                           ngx_s3_auth__write_signed_header_names(&sink, header_list));
+  return names;
 }
 
-static inline const ngx_str_t* ngx_s3_auth__request_body_hash(ngx_pool_t *pool,
-                                                              const ngx_http_request_t *req) {
-  /* TODO: support cases involving non-empty body */
-  return &EMPTY_STRING_SHA256;
+static inline struct S3CanonicalHeaderDetails ngx_s3_auth__canonize_headers(ngx_pool_t *pool,
+                                                                            const ngx_http_request_t *req,
+                                                                            const ngx_str_t *date,
+                                                                            const ngx_str_t *content_hash,
+                                                                            const ngx_str_t *s3_endpoint,
+                                                                            const ngx_array_t *extra_headers) {
+  struct S3CanonicalHeaderDetails header_details;
+  struct S3CanonicalSink sink;
+
+  header_details.header_list = ngx_s3_auth__signed_header_list(pool, date, content_hash, s3_endpoint,
+                                                               extra_headers);
+
+  header_details.canonical_header_str = ngx_palloc(pool, sizeof(ngx_str_t));
+  ngx_s3_auth__materialize(pool, header_details.canonical_header_str, sink,
+                           ngx_s3_auth__write_canonical_headers(&sink, header_details.header_list));
+
+  header_details.signed_header_names = (ngx_str_t *) ngx_s3_auth__signed_header_names(
+    pool, header_details.header_list);
+
+  return header_details;
 }
 
 // S3 wants a peculiar kind of URI-encoding: they want RFC 3986, except that
 // slashes shouldn't be encoded...
-// this function is a light wrapper around ngx_escape_uri that does exactly that
-// modifies the source in place if it needs to be escaped
+// points src to an escaped copy if it needs to be escaped, the source itself
+// is never modified
 // see http://docs.aws.amazon.com/general/latest/gr/sigv4-create-canonical-request.html
 static inline void ngx_s3_auth__escape_uri(ngx_pool_t *pool, ngx_str_t* src) {
-  u_char *escaped_data;
-  u_int escaped_data_len, escaped_data_with_slashes_len, i, j;
-  uintptr_t escaped_count, slashes_count = 0;
-
-  // first, we need to know how many characters need to be escaped
-  escaped_count = ngx_escape_uri(NULL, src->data, src->len, NGX_ESCAPE_URI_COMPONENT);
-  // except slashes should not be escaped...
-  if (escaped_count > 0) {
-    for (i = 0; i < src->len; i++) {
-      if (src->data[i] == '/') {
-        slashes_count++;
-      }
-    }
-  }
+  struct S3CanonicalSink sink;
+  ngx_str_t escaped;
 
-  if (escaped_count == slashes_count) {
-    // nothing to do! nothing but slashes escaped (if even that)
+  if (ngx_s3_auth__skip_unreserved(src->data, src->data + src->len, 1) == src->data + src->len) {
+    // nothing to do! nothing but slashes and unreserved characters
     return;
   }
 
-  // each escaped character is replaced by 3 characters
-  escaped_data_len = src->len + escaped_count * 2;
-  escaped_data = ngx_palloc(pool, escaped_data_len);
-  ngx_escape_uri(escaped_data, src->data, src->len, NGX_ESCAPE_URI_COMPONENT);
-
-  // now we need to go back and re-replace each occurrence of %2F with a slash
-  escaped_data_with_slashes_len = src->len + (escaped_count - slashes_count) * 2;
-  if (slashes_count > 0) {
-    for (i = 0, j = 0; i < escaped_data_with_slashes_len; i++) {
-      if (j < escaped_data_len - 2 && strncmp((char*) (escaped_data + j), "%2F", 3) == 0) {
-        escaped_data[i] = '/';
-        j += 3;
-      } else {
-        escaped_data[i] = escaped_data[j];
-        j++;
-      }
-    }
+  ngx_s3_auth__materialize(pool, &escaped, sink,
+                           ngx_s3_auth__write_escaped_uri(&sink, src->data, src->len));
+  *src = escaped;
+}
 
-    src->len = escaped_data_with_slashes_len;
+// the unescaped path part of the request which goes into the canonical request
+static inline ngx_str_t ngx_s3_auth__request_path(const ngx_http_request_t *req) {
+  ngx_str_t path;
+
+  if(req->args.len == 0) {
+    path = req->uri;
   } else {
-    // no slashes
-    src->len = escaped_data_len;
+    path.data = req->uri_start;
+    path.len = req->args_start - req->uri_start - 1;
   }
 
-  src->data = escaped_data;
+  return path;
 }
 
 static inline const ngx_str_t* ngx_s3_auth__canonical_url(ngx_pool_t *pool, const ngx_http_request_t *req) {
   ngx_str_t *url;
-  const u_char *req_uri_data;
-  u_int req_uri_len;
-
-  if(req->args.len == 0) {
-    req_uri_data = req->uri.data;
-    req_uri_len = req->uri.len;
-  } else {
-    req_uri_data = req->uri_start;
-    req_uri_len = req->args_start - req->uri_start - 1;
-  }
+  const ngx_str_t path = ngx_s3_auth__request_path(req);
 
-  // we need to copy that data to not modify the request for other modules
   url = ngx_palloc(pool, sizeof(ngx_str_t));
-  url->data = ngx_palloc(pool, req_uri_len);
-  ngx_memcpy(url->data, req_uri_data, req_uri_len);
-  url->len = req_uri_len;
+  if (url == NULL) {
+    return NULL;
+  }
 
-  // then URI-encode it per RFC 3986
+  // URI-encode it per RFC 3986, a path which needs no escaping is not copied
+  *url = path;
   ngx_s3_auth__escape_uri(pool, url);
 
   return url;
 }
 
+// <method>\n<url>\n<query string>\n<headers>\n<signed header names>\n<payload hash>
+// path is unescaped, it is escaped on the way into the sink
+static inline void ngx_s3_auth__write_canonical_parts(struct S3CanonicalSink *sink,
+                                                      const ngx_str_t *method,
+                                                      const ngx_str_t *path,
+                                                      const ngx_str_t *canonical_qs,
+                                                      const ngx_array_t *header_list,
+                                                      const ngx_str_t *payload_hash) {
+  ngx_s3_auth__sink_write_str(sink, method);
+  ngx_s3_auth__sink_write_char(sink, '\n');
+  ngx_s3_auth__write_escaped_uri(sink, path->data, path->len);
+  ngx_s3_auth__sink_write_char(sink, '\n');
+  ngx_s3_auth__sink_write_str(sink, canonical_qs);
+  ngx_s3_auth__sink_write_char(sink, '\n');
+  ngx_s3_auth__write_canonical_headers(sink, header_list);
+  ngx_s3_auth__sink_write_char(sink, '\n');
+  ngx_s3_auth__write_signed_header_names(sink, header_list);
+  ngx_s3_auth__sink_write_char(sink, '\n');
+  ngx_s3_auth__sink_write_str(sink, payload_hash);
+}
+
+static inline void ngx_s3_auth__write_canonical_request(struct S3CanonicalSink *sink,
+                                                        const ngx_http_request_t *req,
+                                                        const ngx_str_t *canonical_qs,
+                                                        const ngx_array_t *header_list,
+                                                        const ngx_str_t *payload_hash) {
+  const ngx_str_t path = ngx_s3_auth__request_path(req);
+
+  ngx_s3_auth__write_canonical_parts(sink, &req->method_name, &path, canonical_qs, header_list, payload_hash);
+}
+
+// materializes the whole canonical request, signing itself only ever
+// streams it into the hash, see ngx_s3_auth__compute_signature
 static inline struct S3CanonicalRequestDetails ngx_s3_auth__make_canonical_request(ngx_pool_t *pool,
                                                                                    const ngx_http_request_t *req,
                                                                                    const ngx_str_t *date,
-                                                                                   const ngx_str_t *s3_endpoint) {
+                                                                                   const ngx_str_t *s3_endpoint,
+                                                                                   const ngx_str_t *request_body_hash,
+                                                                                   const ngx_array_t *extra_headers) {
   struct S3CanonicalRequestDetails req_details;
+  struct S3CanonicalSink sink;
   const ngx_str_t *canonical_qs = ngx_s3_auth__canonize_query_string(pool, req);
-  const ngx_str_t *request_body_hash = ngx_s3_auth__request_body_hash(pool, req);
-  const struct S3CanonicalHeaderDetails canonical_headers = ngx_s3_auth__canonize_headers(
-    pool,
-    req,
-    date,
-    request_body_hash,
-    s3_endpoint);
-  req_details.signed_header_names = canonical_headers.signed_header_names;
-
-  const ngx_str_t *http_method = &(req->method_name);
-  const ngx_str_t *url = ngx_s3_auth__canonical_url(pool, req);
+
+  req_details.header_list = ngx_s3_auth__signed_header_list(pool, date, request_body_hash, s3_endpoint,
+                                                            extra_headers);
+  req_details.signed_header_names = (ngx_str_t *) ngx_s3_auth__signed_header_names(pool, req_details.header_list);
 
   req_details.canonical_request = ngx_palloc(pool, sizeof(ngx_str_t));
-  // length depends on format string you could find below
-  req_details.canonical_request->len = http_method->len + 1
-                                           + url->len + 1
-                                           + canonical_qs->len + 1
-                                           + canonical_headers.canonical_header_str->len + 1
-                                           + canonical_headers.signed_header_names->len + 1
-                                           + request_body_hash->len;
-  req_details.canonical_request->data = ngx_palloc(pool, req_details.canonical_request->len);
-  req_details.canonical_request->len = ngx_snprintf(
-    req_details.canonical_request->data, req_details.canonical_request->len,
-    "%V\n%V\n%V\n%V\n%V\n%V",
-    http_method, url, canonical_qs, canonical_headers.canonical_header_str,
-    canonical_headers.signed_header_names, request_body_hash) - req_details.canonical_request->data;
-  req_details.header_list = canonical_headers.header_list;
+  ngx_s3_auth__materialize(pool, req_details.canonical_request, sink,
+                           ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs,
+                                                                req_details.header_list,
+                                                                request_body_hash));
 
   return req_details;
 }
@@ -388,6 +830,97 @@ static inline const ngx_str_t* ngx_s3_auth__string_to_sign(ngx_pool_t *pool,
   return subject;
 }
 
+// The x-amz-date value and the string to sign up to the canonical request
+// hash only change once a second. A worker keeps them here, keyed on the
+// second and the key scope, much like nginx caches its own time strings.
+// The cache belongs to a single thread.
+struct S3RequestTimeCache {
+  ngx_pool_t *pool;            // the prefix buffer grows from here, lives as long as the cache
+  time_t sec;
+  ngx_str_t key_scope;         // the scope the prefix was built for, within prefix
+  ngx_str_t date;
+  ngx_str_t prefix;            // AWS4-HMAC-SHA256\n<date>\n<scope>\n
+  size_t prefix_size;
+  u_char date_buf[NGX_S3_AUTH_DATE_LEN];
+};
+
+static inline struct S3RequestTimeCache* ngx_s3_auth__time_cache_create(ngx_pool_t *pool) {
+  struct S3RequestTimeCache *cache = ngx_pcalloc(pool, sizeof(struct S3RequestTimeCache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->pool = pool;
+  cache->sec = -1;
+  cache->date.data = cache->date_buf;
+
+  return cache;
+}
+
+// makes the cache current for sec and key_scope, NGX_ERROR if the pool is exhausted
+static inline ngx_int_t ngx_s3_auth__time_cache_update(struct S3RequestTimeCache *cache, time_t sec,
+                                                       const ngx_str_t *key_scope) {
+  static const ngx_str_t algorithm = ngx_string("AWS4-HMAC-SHA256\n");
+  size_t size;
+  u_char *p;
+
+  // compared by content: a scope may be built per request (s3_credentials_map)
+  // in memory the previous request's scope was in
+  if (cache->sec == sec && cache->key_scope.len == key_scope->len
+      && ngx_memcmp(cache->key_scope.data, key_scope->data, key_scope->len) == 0) {
+    return NGX_OK;
+  }
+
+  if (cache->sec != sec) {
+    cache->date.len = ngx_s3_auth__format_request_time(cache->date_buf, sec) - cache->date_buf;
+  }
+
+  size = algorithm.len + NGX_S3_AUTH_DATE_LEN + 1 + key_scope->len + 1;
+  if (size > cache->prefix_size) {
+    cache->prefix.data = ngx_pnalloc(cache->pool, size);
+    if (cache->prefix.data == NULL) {
+      cache->prefix_size = 0;
+      cache->sec = -1;
+      return NGX_ERROR;
+    }
+    cache->prefix_size = size;
+  }
+
+  p = ngx_cpymem(cache->prefix.data, algorithm.data, algorithm.len);
+  p = ngx_cpymem(p, cache->date.data, cache->date.len);
+  *p++ = '\n';
+  cache->key_scope.data = p;
+  cache->key_scope.len = key_scope->len;
+  p = ngx_cpymem(p, key_scope->data, key_scope->len);
+  *p++ = '\n';
+  cache->prefix.len = p - cache->prefix.data;
+
+  cache->sec = sec;
+
+  return NGX_OK;
+}
+
+// <prefix><canonical request hash>, prefix as kept by struct S3RequestTimeCache
+static inline const ngx_str_t* ngx_s3_auth__string_to_sign_prefixed(ngx_pool_t *pool,
+                                                                    const ngx_str_t *prefix,
+                                                                    const ngx_str_t *canonical_request_hash) {
+  ngx_str_t *subject = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (subject == NULL) {
+    return NULL;
+  }
+
+  subject->data = ngx_pnalloc(pool, prefix->len + canonical_request_hash->len);
+  if (subject->data == NULL) {
+    return NULL;
+  }
+
+  subject->len = ngx_cpymem(ngx_cpymem(subject->data, prefix->data, prefix->len),
+                            canonical_request_hash->data, canonical_request_hash->len)
+                 - subject->data;
+
+  return subject;
+}
+
 static inline const ngx_str_t* ngx_s3_auth__make_auth_token(ngx_pool_t *pool,
                                                             const ngx_str_t *signature,
                                                             const ngx_str_t *signed_header_names,
@@ -410,45 +943,1896 @@ static inline const ngx_str_t* ngx_s3_auth__make_auth_token(ngx_pool_t *pool,
   return authz;
 }
 
-static inline struct S3SignedRequestDetails ngx_s3_auth__compute_signature(ngx_pool_t *pool,
-                                                                           ngx_http_request_t *req,
-                                                                           const ngx_str_t *signing_key,
-                                                                           const ngx_str_t *key_scope,
-                                                                           const ngx_str_t *s3_endpoint) {
-  struct S3SignedRequestDetails req_details;
+// Signing keys are only valid for the UTC day they were derived for, so a
+// cache keeps two slots: the current day and the next one. Lookups pick the
+// slot by the request day and ngx_s3_auth__signing_key_rotate prepares the
+// next day ahead of time, requests never see a half-derived key.
+// The cache is meant to be owned by a single worker (event loop) and must
+// not be shared between threads.
+#define NGX_S3_AUTH_KEY_SLOTS 2
+#define NGX_S3_AUTH_DAY_SECONDS 86400
 
-  const ngx_str_t *date = ngx_s3_auth__compute_request_time(pool, &req->start_sec);
-  const struct S3CanonicalRequestDetails canonical_request = ngx_s3_auth__make_canonical_request(pool, req, date, s3_endpoint);
-  const ngx_str_t *canonical_request_hash = ngx_s3_auth__hash_sha256(pool, canonical_request.canonical_request);
-  const ngx_str_t *string_to_sign = ngx_s3_auth__string_to_sign(pool, key_scope, date, canonical_request_hash);
-  const ngx_str_t *signature = ngx_s3_auth__sign_sha256_hex(pool, string_to_sign, signing_key);
+static const ngx_str_t KEY_SCOPE_TERMINATOR = ngx_string("aws4_request");
 
-  req_details.signature = signature;
-  req_details.signed_header_names = canonical_request.signed_header_names;
-  req_details.header_list = canonical_request.header_list;
+#define NGX_S3_AUTH_FINGERPRINT_LEN 16
 
-  return req_details;
+static const ngx_str_t FINGERPRINT_LABEL = ngx_string("ngx_s3_auth key fingerprint");
+
+// Stands in for a signing key where one has to be told apart from another
+// without being copied, in signature cache keys: a truncated HMAC of a fixed
+// label. It is worked out once, when the key is set or derived.
+static inline void ngx_s3_auth__key_fingerprint(const ngx_str_t *raw_key, u_char *fingerprint) {
+  u_char md[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__sign_sha256(&FINGERPRINT_LABEL, raw_key, md);
+  ngx_memcpy(fingerprint, md, NGX_S3_AUTH_FINGERPRINT_LEN);
 }
 
-// list of header_pair_t
-static inline const ngx_array_t* ngx_s3_auth__sign(ngx_pool_t *pool, ngx_http_request_t *req,
-                                                   const ngx_str_t *access_key_id,
-                                                   const ngx_str_t *signing_key,
-                                                   const ngx_str_t *key_scope,
-                                                   const ngx_str_t *s3_endpoint) {
-  const struct S3SignedRequestDetails signature_details =
-      ngx_s3_auth__compute_signature(pool, req, signing_key, key_scope, s3_endpoint);
+struct S3SigningKeySlot {
+  time_t day; // days since epoch, -1 while the slot is empty
+  ngx_str_t key_scope;
+  ngx_str_t signing_key;
+  ngx_str_t fingerprint; // of signing_key
+  ngx_s3_auth__hmac_key_t *hmac_key;
+  u_char signing_key_data[NGX_S3_AUTH_SHA256_LEN];
+  u_char fingerprint_data[NGX_S3_AUTH_FINGERPRINT_LEN];
+};
 
-  const ngx_str_t *auth_header_value = ngx_s3_auth__make_auth_token(
-    pool, signature_details.signature,
-    signature_details.signed_header_names, access_key_id, key_scope);
+struct S3SigningKeyCache {
+  ngx_str_t secret_key; // "AWS4" + secret access key
+  ngx_str_t region;
+  ngx_str_t service;
+  struct S3SigningKeySlot slots[NGX_S3_AUTH_KEY_SLOTS];
+  ngx_uint_t misses; // lookups which found their day missing and derived it
+};
 
-  header_pair_t *header_ptr;
-  header_ptr = ngx_array_push(signature_details.header_list);
-  header_ptr->key = AUTHZ_HEADER;
-  header_ptr->value = *auth_header_value;
+static inline struct S3SigningKeyCache* ngx_s3_auth__signing_key_cache_create(ngx_pool_t *pool,
+                                                                              const ngx_str_t *secret_key,
+                                                                              const ngx_str_t *region,
+                                                                              const ngx_str_t *service) {
+  struct S3SigningKeyCache *cache = ngx_pcalloc(pool, sizeof(struct S3SigningKeyCache));
+  size_t i, scope_len;
+
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->secret_key.len = sizeof("AWS4") - 1 + secret_key->len;
+  cache->secret_key.data = ngx_palloc(pool, cache->secret_key.len);
+  if (cache->secret_key.data == NULL) {
+    return NULL;
+  }
+  ngx_sprintf(cache->secret_key.data, "AWS4%V", secret_key);
+
+  cache->region = *region;
+  cache->service = *service;
+
+  // <yyyymmdd>/<region>/<service>/aws4_request
+  scope_len = 8 + 1 + region->len + 1 + service->len + 1 + KEY_SCOPE_TERMINATOR.len;
+
+  for (i = 0; i < NGX_S3_AUTH_KEY_SLOTS; i++) {
+    cache->slots[i].day = -1;
+    cache->slots[i].key_scope.data = ngx_palloc(pool, scope_len);
+    if (cache->slots[i].key_scope.data == NULL) {
+      return NULL;
+    }
+    cache->slots[i].signing_key.data = cache->slots[i].signing_key_data;
+    cache->slots[i].signing_key.len = NGX_S3_AUTH_SHA256_LEN;
+    cache->slots[i].fingerprint.data = cache->slots[i].fingerprint_data;
+    cache->slots[i].fingerprint.len = NGX_S3_AUTH_FINGERPRINT_LEN;
+    cache->slots[i].hmac_key = ngx_s3_auth__hmac_key_create(pool);
+    if (cache->slots[i].hmac_key == NULL) {
+      return NULL;
+    }
+  }
+
+  return cache;
+}
+
+// kDate -> kRegion -> kService -> kSigning, see ./tools/s3-auth-gen
+// secret_key is already prefixed with "AWS4"
+static inline void ngx_s3_auth__derive_key(const ngx_str_t *secret_key,
+                                           const ngx_str_t *date,
+                                           const ngx_str_t *region,
+                                           const ngx_str_t *service,
+                                           u_char *signing_key) {
+  u_char k[NGX_S3_AUTH_SHA256_LEN];
+  ngx_str_t key = { NGX_S3_AUTH_SHA256_LEN, k };
+
+  ngx_s3_auth__sign_sha256(date, secret_key, k);
+  ngx_s3_auth__sign_sha256(region, &key, k);
+  ngx_s3_auth__sign_sha256(service, &key, k);
+  ngx_s3_auth__sign_sha256(&KEY_SCOPE_TERMINATOR, &key, signing_key);
+
+  ngx_memzero(k, sizeof(k));
+}
+
+static inline void ngx_s3_auth__derive_signing_key(const struct S3SigningKeyCache *cache,
+                                                   const ngx_str_t *date,
+                                                   u_char *signing_key) {
+  ngx_s3_auth__derive_key(&cache->secret_key, date, &cache->region, &cache->service, signing_key);
+}
+
+static inline ngx_int_t ngx_s3_auth__signing_key_slot_fill(const struct S3SigningKeyCache *cache,
+                                                           struct S3SigningKeySlot *slot,
+                                                           time_t day) {
+  struct tm tm;
+  time_t t = day * NGX_S3_AUTH_DAY_SECONDS;
+  ngx_str_t date;
+
+  gmtime_r(&t, &tm);
+
+  date.data = slot->key_scope.data;
+  date.len = ngx_sprintf(date.data, "%4d%02d%02d",
+                         tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) - date.data;
+
+  ngx_s3_auth__derive_signing_key(cache, &date, slot->signing_key_data);
+  if (ngx_s3_auth__hmac_key_set(slot->hmac_key, &slot->signing_key) != NGX_OK) {
+    slot->day = -1;
+    return NGX_ERROR;
+  }
+  ngx_s3_auth__key_fingerprint(&slot->signing_key, slot->fingerprint_data);
+
+  slot->key_scope.len = ngx_sprintf(slot->key_scope.data + date.len, "/%V/%V/%V",
+                                    &cache->region, &cache->service,
+                                    &KEY_SCOPE_TERMINATOR) - slot->key_scope.data;
+  slot->day = day;
+  return NGX_OK;
+}
+
+// makes sure both the day of `now` and the following day are derived
+static inline void ngx_s3_auth__signing_key_rotate(struct S3SigningKeyCache *cache, time_t now) {
+  time_t day, today = now / NGX_S3_AUTH_DAY_SECONDS;
+  size_t i, j;
+
+  for (day = today; day < today + NGX_S3_AUTH_KEY_SLOTS; day++) {
+    for (i = 0; i < NGX_S3_AUTH_KEY_SLOTS; i++) {
+      if (cache->slots[i].day == day) {
+        break;
+      }
+    }
+
+    if (i < NGX_S3_AUTH_KEY_SLOTS) {
+      continue;
+    }
+
+    // reuse a slot outside of [today, today + NGX_S3_AUTH_KEY_SLOTS)
+    for (j = 0; j < NGX_S3_AUTH_KEY_SLOTS; j++) {
+      if (cache->slots[j].day < today || cache->slots[j].day >= today + NGX_S3_AUTH_KEY_SLOTS) {
+        (void) ngx_s3_auth__signing_key_slot_fill(cache, &cache->slots[j], day);
+        break;
+      }
+    }
+  }
+}
+
+// the slot of the day of t, NULL if there is none; nothing is derived
+static inline const struct S3SigningKeySlot* ngx_s3_auth__signing_key_find(const struct S3SigningKeyCache *cache,
+                                                                           time_t t) {
+  time_t day = t / NGX_S3_AUTH_DAY_SECONDS;
+  size_t i;
+
+  for (i = 0; i < NGX_S3_AUTH_KEY_SLOTS; i++) {
+    if (cache->slots[i].day == day) {
+      return &cache->slots[i];
+    }
+  }
+
+  return NULL;
+}
+
+// on a miss slots are rederived in place, like ngx_s3_auth__signing_key_rotate
+// does; whoever still holds one has to be done with it first
+static inline const struct S3SigningKeySlot* ngx_s3_auth__signing_key_lookup(struct S3SigningKeyCache *cache,
+                                                                             time_t t) {
+  const struct S3SigningKeySlot *slot = ngx_s3_auth__signing_key_find(cache, t);
+
+  if (slot != NULL) {
+    return slot;
+  }
+
+  // the rotation did not run in time (clock jump, stalled worker),
+  // so this request pays for the derivation
+  cache->misses++;
+  ngx_s3_auth__signing_key_rotate(cache, t);
+
+  return ngx_s3_auth__signing_key_find(cache, t);
+}
+
+// Credentials of many buckets, loaded from a text file with one credential
+// per line:
+//   <bucket> <access key> <secret key> <region> [<service>]
+// The service defaults to s3. Fields are separated by spaces or tabs, empty lines and lines starting
+// with # are skipped. The parsed fields point into the text.
+struct S3Credential {
+  ngx_str_t bucket;
+  ngx_str_t access_key;
+  ngx_str_t secret_key;
+  ngx_str_t region;
+  ngx_str_t service;
+};
+
+#define NGX_S3_AUTH_CREDENTIAL_FIELDS 5
+
+static const ngx_str_t DEFAULT_SERVICE = ngx_string("s3");
+
+// NGX_ERROR with *line set to the line which is malformed
+static inline ngx_int_t ngx_s3_auth__parse_credentials(const ngx_str_t *text, ngx_array_t *credentials,
+                                                       ngx_uint_t *line) {
+  u_char *p = text->data, *last = text->data + text->len, *eol, *start;
+  ngx_str_t fields[NGX_S3_AUTH_CREDENTIAL_FIELDS];
+  struct S3Credential *c;
+  ngx_uint_t n;
+
+  for (*line = 1; p < last; p = eol + 1, (*line)++) {
+    eol = ngx_strlchr(p, last, '\n');
+    if (eol == NULL) {
+      eol = last;
+    }
+
+    for (n = 0; /* void */; n++) {
+      while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+      }
+
+      if (p == eol || (n == 0 && *p == '#')) {
+        break;
+      }
+
+      if (n == NGX_S3_AUTH_CREDENTIAL_FIELDS) {
+        return NGX_ERROR;
+      }
+
+      for (start = p; p < eol && *p != ' ' && *p != '\t' && *p != '\r'; p++) { /* void */ }
+      fields[n].data = start;
+      fields[n].len = p - start;
+    }
+
+    if (n == 0) {
+      continue;
+    }
+
+    if (n < NGX_S3_AUTH_CREDENTIAL_FIELDS - 1) {
+      return NGX_ERROR;
+    }
+
+    c = ngx_array_push(credentials);
+    if (c == NULL) {
+      return NGX_ERROR;
+    }
+
+    c->bucket = fields[0];
+    c->access_key = fields[1];
+    c->secret_key = fields[2];
+    c->region = fields[3];
+    c->service = n == NGX_S3_AUTH_CREDENTIAL_FIELDS ? fields[4] : DEFAULT_SERVICE;
+  }
+
+  return NGX_OK;
+}
+
+// A chained hash table of credentials by bucket, built into a single block
+// of ngx_s3_auth__credentials_table_size bytes so it can be placed in shared
+// memory and replaced as a whole. Signing keys are derived on first use each
+// day and kept in the entry; whoever shares the table serializes access.
+struct S3CredentialEntry {
+  struct S3CredentialEntry *next;
+  ngx_str_t bucket;
+  ngx_str_t access_key;
+  ngx_str_t secret_key; // "AWS4" + secret access key
+  ngx_str_t region;
+  ngx_str_t service;
+  time_t day; // of signing_key, -1 until a request needs it
+  u_char signing_key[NGX_S3_AUTH_SHA256_LEN];
+  u_char fingerprint[NGX_S3_AUTH_FINGERPRINT_LEN]; // of signing_key
+};
+
+struct S3CredentialsTable {
+  ngx_uint_t mask;
+  ngx_uint_t nelts;
+  struct S3CredentialEntry **buckets;
+};
+
+static inline ngx_uint_t ngx_s3_auth__credentials_buckets(ngx_uint_t nelts) {
+  ngx_uint_t n = 1;
+
+  while (n < nelts) {
+    n <<= 1;
+  }
+
+  return n;
+}
+
+static inline size_t ngx_s3_auth__credentials_table_size(const ngx_array_t *credentials) {
+  const struct S3Credential *c = credentials->elts;
+  size_t size;
+  ngx_uint_t i;
+
+  size = sizeof(struct S3CredentialsTable)
+         + ngx_s3_auth__credentials_buckets(credentials->nelts) * sizeof(struct S3CredentialEntry *)
+         + credentials->nelts * sizeof(struct S3CredentialEntry);
+
+  for (i = 0; i < credentials->nelts; i++) {
+    size += c[i].bucket.len + c[i].access_key.len + sizeof("AWS4") - 1 + c[i].secret_key.len + c[i].region.len
+            + c[i].service.len;
+  }
+
+  return size;
+}
+
+static inline struct S3CredentialEntry* ngx_s3_auth__credentials_lookup(const struct S3CredentialsTable *table,
+                                                                        const ngx_str_t *bucket) {
+  struct S3CredentialEntry *e;
+
+  for (e = table->buckets[ngx_hash_key(bucket->data, bucket->len) & table->mask]; e != NULL; e = e->next) {
+    if (e->bucket.len == bucket->len && ngx_memcmp(e->bucket.data, bucket->data, bucket->len) == 0) {
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+// NULL if a bucket is listed twice, *duplicate is set to it then
+static inline struct S3CredentialsTable* ngx_s3_auth__credentials_table_build(u_char *mem,
+                                                                              const ngx_array_t *credentials,
+                                                                              const ngx_str_t **duplicate) {
+  const struct S3Credential *c = credentials->elts;
+  struct S3CredentialsTable *table = (struct S3CredentialsTable *) mem;
+  struct S3CredentialEntry *entries, **bucket;
+  ngx_uint_t i, n = ngx_s3_auth__credentials_buckets(credentials->nelts);
+  u_char *p;
+
+  table->mask = n - 1;
+  table->nelts = credentials->nelts;
+  table->buckets = (struct S3CredentialEntry **) (mem + sizeof(struct S3CredentialsTable));
+  ngx_memzero(table->buckets, n * sizeof(struct S3CredentialEntry *));
+
+  entries = (struct S3CredentialEntry *) (table->buckets + n);
+  p = (u_char *) (entries + credentials->nelts);
+
+  for (i = 0; i < credentials->nelts; i++) {
+    if (ngx_s3_auth__credentials_lookup(table, &c[i].bucket) != NULL) {
+      *duplicate = &c[i].bucket;
+      return NULL;
+    }
+
+    entries[i].bucket.data = p;
+    entries[i].bucket.len = c[i].bucket.len;
+    p = ngx_cpymem(p, c[i].bucket.data, c[i].bucket.len);
+
+    entries[i].access_key.data = p;
+    entries[i].access_key.len = c[i].access_key.len;
+    p = ngx_cpymem(p, c[i].access_key.data, c[i].access_key.len);
+
+    entries[i].secret_key.data = p;
+    entries[i].secret_key.len = sizeof("AWS4") - 1 + c[i].secret_key.len;
+    p = ngx_cpymem(p, "AWS4", sizeof("AWS4") - 1);
+    p = ngx_cpymem(p, c[i].secret_key.data, c[i].secret_key.len);
+
+    entries[i].region.data = p;
+    entries[i].region.len = c[i].region.len;
+    p = ngx_cpymem(p, c[i].region.data, c[i].region.len);
+
+    entries[i].service.data = p;
+    entries[i].service.len = c[i].service.len;
+    p = ngx_cpymem(p, c[i].service.data, c[i].service.len);
+
+    entries[i].day = -1;
+
+    bucket = &table->buckets[ngx_hash_key(c[i].bucket.data, c[i].bucket.len) & table->mask];
+    entries[i].next = *bucket;
+    *bucket = &entries[i];
+  }
+
+  return table;
+}
+
+// the key scope, signing key and its fingerprint of the entry for the day of
+// t, copied into the pool; the entry keeps the key it derived for the rest of
+// the day
+static inline ngx_int_t ngx_s3_auth__credential_signing_key(ngx_pool_t *pool, struct S3CredentialEntry *entry,
+                                                            time_t t, ngx_str_t *key_scope, ngx_str_t *raw_key,
+                                                            ngx_str_t *fingerprint) {
+  time_t day = t / NGX_S3_AUTH_DAY_SECONDS;
+  ngx_str_t date, derived = { NGX_S3_AUTH_SHA256_LEN, entry->signing_key };
+  struct tm tm;
+
+  key_scope->len = 8 + 1 + entry->region.len + 1 + entry->service.len + 1 + KEY_SCOPE_TERMINATOR.len;
+  key_scope->data = ngx_pnalloc(pool, key_scope->len);
+  raw_key->data = ngx_pnalloc(pool, NGX_S3_AUTH_SHA256_LEN + NGX_S3_AUTH_FINGERPRINT_LEN);
+  if (key_scope->data == NULL || raw_key->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  gmtime_r(&t, &tm);
+  date.data = key_scope->data;
+  date.len = ngx_sprintf(date.data, "%4d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday) - date.data;
+
+  if (entry->day != day) {
+    ngx_s3_auth__derive_key(&entry->secret_key, &date, &entry->region, &entry->service, entry->signing_key);
+    ngx_s3_auth__key_fingerprint(&derived, entry->fingerprint);
+    entry->day = day;
+  }
+
+  ngx_sprintf(key_scope->data + date.len, "/%V/%V/%V", &entry->region, &entry->service, &KEY_SCOPE_TERMINATOR);
+  fingerprint->data = ngx_cpymem(raw_key->data, entry->signing_key, NGX_S3_AUTH_SHA256_LEN);
+  raw_key->len = NGX_S3_AUTH_SHA256_LEN;
+  ngx_memcpy(fingerprint->data, entry->fingerprint, NGX_S3_AUTH_FINGERPRINT_LEN);
+  fingerprint->len = NGX_S3_AUTH_FINGERPRINT_LEN;
+
+  return NGX_OK;
+}
+
+// x-amz-date for sec in the request pool, formatted once per second when a
+// time cache is given; the header outlives the second, the cache does not
+static inline const ngx_str_t* ngx_s3_auth__request_date(ngx_pool_t *pool, struct S3RequestTimeCache *time_cache,
+                                                         time_t sec, const ngx_str_t *key_scope) {
+  ngx_str_t *date;
+
+  if (time_cache == NULL) {
+    return ngx_s3_auth__compute_request_time(pool, &sec);
+  }
+
+  if (ngx_s3_auth__time_cache_update(time_cache, sec, key_scope) != NGX_OK) {
+    return NULL;
+  }
+
+  date = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (date == NULL) {
+    return NULL;
+  }
+
+  date->len = time_cache->date.len;
+  date->data = ngx_pnalloc(pool, date->len);
+  if (date->data == NULL) {
+    return NULL;
+  }
+  ngx_memcpy(date->data, time_cache->date.data, date->len);
+
+  return date;
+}
+
+// Everything in the signed headers and in the Authorization header which only
+// depends on the configuration: the sorted header list with the host filled
+// in, the SignedHeaders names and the Authorization value up to the
+// signature. A request then only fills in its date, payload hash and
+// signature. The key scope is rewritten in place when it changes, once a day
+// with derived keys, see ngx_s3_auth__auth_template_scope.
+#define NGX_S3_AUTH_TEMPLATE_HEADERS 3
+
+struct S3AuthTemplate {
+  header_pair_t headers[NGX_S3_AUTH_TEMPLATE_HEADERS];
+  ngx_uint_t date_index;
+  ngx_uint_t hash_index;
+  ngx_str_t signed_header_names;
+  ngx_str_t key_scope; // points into prefix
+  ngx_str_t prefix;    // AWS4-HMAC-SHA256 Credential=<access key>/<scope>,SignedHeaders=<names>,Signature=
+};
+
+static inline struct S3AuthTemplate* ngx_s3_auth__auth_template_create(ngx_pool_t *pool,
+                                                                       const ngx_str_t *s3_endpoint,
+                                                                       const ngx_str_t *access_key_id,
+                                                                       const ngx_str_t *key_scope) {
+  const char credential[] = "AWS4-HMAC-SHA256 Credential=";
+  const char signed_headers[] = ",SignedHeaders=";
+  const char signature[] = ",Signature=";
+  struct S3AuthTemplate *tpl = ngx_pcalloc(pool, sizeof(struct S3AuthTemplate));
+  const ngx_str_t *names;
+  ngx_array_t *header_list;
+  header_pair_t *header;
+  ngx_uint_t i;
+  u_char *p;
+
+  if (tpl == NULL) {
+    return NULL;
+  }
+
+  header_list = ngx_s3_auth__signed_header_list(pool, &EMPTY_STRING, &EMPTY_STRING, s3_endpoint, NULL);
+  if (header_list == NULL || header_list->nelts != NGX_S3_AUTH_TEMPLATE_HEADERS) {
+    return NULL;
+  }
+
+  header = header_list->elts;
+  for (i = 0; i < NGX_S3_AUTH_TEMPLATE_HEADERS; i++) {
+    tpl->headers[i] = header[i];
+    if (header[i].key.data == DATE_HEADER.data) {
+      tpl->date_index = i;
+    } else if (header[i].key.data == HASH_HEADER.data) {
+      tpl->hash_index = i;
+    }
+  }
+
+  names = ngx_s3_auth__signed_header_names(pool, header_list);
+  if (names == NULL) {
+    return NULL;
+  }
+  tpl->signed_header_names = *names;
+
+  tpl->prefix.len = sizeof(credential) - 1 + access_key_id->len + 1 + key_scope->len
+                    + sizeof(signed_headers) - 1 + names->len + sizeof(signature) - 1;
+  tpl->prefix.data = ngx_pnalloc(pool, tpl->prefix.len);
+  if (tpl->prefix.data == NULL) {
+    return NULL;
+  }
+
+  p = ngx_sprintf(tpl->prefix.data, "%s%V/", credential, access_key_id);
+  tpl->key_scope.data = p;
+  tpl->key_scope.len = key_scope->len;
+  ngx_sprintf(p, "%V%s%V%s", key_scope, signed_headers, names, signature);
+
+  return tpl;
+}
+
+// NGX_DECLINED if key_scope is not as long as the one the template was made for
+static inline ngx_int_t ngx_s3_auth__auth_template_scope(struct S3AuthTemplate *tpl, const ngx_str_t *key_scope) {
+  if (key_scope->len != tpl->key_scope.len) {
+    return NGX_DECLINED;
+  }
+
+  if (ngx_memcmp(tpl->key_scope.data, key_scope->data, key_scope->len) != 0) {
+    ngx_memcpy(tpl->key_scope.data, key_scope->data, key_scope->len);
+  }
+
+  return NGX_OK;
+}
+
+// the list ngx_s3_auth__signed_header_list would make, with the same room
+// for the Authorization header
+static inline ngx_array_t* ngx_s3_auth__template_header_list(ngx_pool_t *pool,
+                                                             const struct S3AuthTemplate *tpl,
+                                                             const ngx_str_t *date,
+                                                             const ngx_str_t *content_hash) {
+  ngx_array_t *header_list = ngx_array_create(pool, NGX_S3_AUTH_TEMPLATE_HEADERS + 1, sizeof(header_pair_t));
+  header_pair_t *header;
+
+  if (header_list == NULL) {
+    return NULL;
+  }
+
+  header = header_list->elts;
+  ngx_memcpy(header, tpl->headers, sizeof(tpl->headers));
+  header[tpl->date_index].value = *date;
+  header[tpl->hash_index].value = *content_hash;
+  header_list->nelts = NGX_S3_AUTH_TEMPLATE_HEADERS;
+
+  return header_list;
+}
+
+// Time spent in each stage of ngx_s3_auth__compute_signature_timed, in
+// nanoseconds of the monotonic clock
+#define NGX_S3_AUTH_STAGE_CANONICAL_REQUEST 0 // date, canonical request and its hash
+#define NGX_S3_AUTH_STAGE_STRING_TO_SIGN    1
+#define NGX_S3_AUTH_STAGE_HMAC              2
+#define NGX_S3_AUTH_STAGES                  3
+
+struct S3SignTimings {
+  uint64_t nsec[NGX_S3_AUTH_STAGES];
+};
+
+static inline uint64_t ngx_s3_auth__clock_nsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// closes the stage started at *start and starts the next one
+static inline void ngx_s3_auth__stage_done(struct S3SignTimings *timings, ngx_uint_t stage, uint64_t *start) {
+  uint64_t now;
+
+  if (timings == NULL) {
+    return;
+  }
+
+  now = ngx_s3_auth__clock_nsec();
+  timings->nsec[stage] = now - *start;
+  *start = now;
+}
+
+// Log2 latency buckets: bucket i counts durations up to
+// ngx_s3_auth__latency_bucket_bound(i) nanoseconds, 256 ns for the first one,
+// bucket NGX_S3_AUTH_LATENCY_BUCKETS everything longer than the last bound
+#define NGX_S3_AUTH_LATENCY_BUCKETS 16
+
+static inline uint64_t ngx_s3_auth__latency_bucket_bound(ngx_uint_t bucket) {
+  return (uint64_t) 256 << bucket;
+}
+
+static inline ngx_uint_t ngx_s3_auth__latency_bucket(uint64_t nsec) {
+  ngx_uint_t bucket = 0;
+
+  while (bucket < NGX_S3_AUTH_LATENCY_BUCKETS && nsec > ngx_s3_auth__latency_bucket_bound(bucket)) {
+    bucket++;
+  }
+
+  return bucket;
+}
+
+// timings may be NULL, the clock is not read then
+// with a template (may be NULL) s3_endpoint and extra_headers are taken from
+// it, key_scope has to be set on it already
+// sec is the x-amz-date, req->start_sec unless the request waited for its body;
+// key_scope has to be of the same day
+static inline struct S3SignedRequestDetails ngx_s3_auth__compute_signature_timed(ngx_pool_t *pool,
+                                                                                 ngx_http_request_t *req,
+                                                                                 time_t sec,
+                                                                                 const ngx_s3_auth__hmac_key_t *signing_key,
+                                                                                 const ngx_str_t *key_scope,
+                                                                                 const ngx_str_t *s3_endpoint,
+                                                                                 const ngx_str_t *request_body_hash,
+                                                                                 const ngx_array_t *extra_headers,
+                                                                                 const struct S3AuthTemplate *tpl,
+                                                                                 struct S3RequestTimeCache *time_cache,
+                                                                                 struct S3SignTimings *timings) {
+  uint64_t start = timings != NULL ? ngx_s3_auth__clock_nsec() : 0;
+  struct S3SignedRequestDetails req_details;
+  struct S3CanonicalSink sink;
+
+  req_details.signature = NULL;
+  req_details.signed_header_names = NULL;
+  req_details.header_list = NULL;
+
+  const ngx_str_t *date = ngx_s3_auth__request_date(pool, time_cache, sec, key_scope);
+  if (date == NULL) {
+    return req_details;
+  }
+
+  const ngx_str_t *canonical_qs = ngx_s3_auth__canonize_query_string(pool, req);
+  ngx_array_t *header_list = tpl != NULL
+    ? ngx_s3_auth__template_header_list(pool, tpl, date, request_body_hash)
+    : ngx_s3_auth__signed_header_list(pool, date, request_body_hash, s3_endpoint, extra_headers);
+
+  req_details.header_list = header_list;
+
+  // the canonical request is never built in memory, its parts go straight into the hash
+  sink.hash = ngx_s3_auth__sha256_init(pool);
+  sink.pos = NULL;
+  sink.len = 0;
+  if (sink.hash == NULL || canonical_qs == NULL || header_list == NULL) {
+    return req_details;
+  }
+  ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs, header_list, request_body_hash);
+
+  const ngx_str_t *canonical_request_hash = ngx_s3_auth__sha256_final_hex(pool, sink.hash);
+  if (canonical_request_hash == NULL) {
+    return req_details;
+  }
+  ngx_s3_auth__stage_done(timings, NGX_S3_AUTH_STAGE_CANONICAL_REQUEST, &start);
+
+  const ngx_str_t *string_to_sign = time_cache != NULL
+    ? ngx_s3_auth__string_to_sign_prefixed(pool, &time_cache->prefix, canonical_request_hash)
+    : ngx_s3_auth__string_to_sign(pool, key_scope, date, canonical_request_hash);
+  if (string_to_sign == NULL) {
+    return req_details;
+  }
+  ngx_s3_auth__stage_done(timings, NGX_S3_AUTH_STAGE_STRING_TO_SIGN, &start);
+
+  const ngx_str_t *signature = ngx_s3_auth__hmac_sign_hex(pool, signing_key, string_to_sign);
+  ngx_s3_auth__stage_done(timings, NGX_S3_AUTH_STAGE_HMAC, &start);
+
+  req_details.signature = signature;
+  req_details.signed_header_names = tpl != NULL
+    ? &tpl->signed_header_names
+    : ngx_s3_auth__signed_header_names(pool, header_list);
+
+  return req_details;
+}
+
+static inline struct S3SignedRequestDetails ngx_s3_auth__compute_signature(ngx_pool_t *pool,
+                                                                           ngx_http_request_t *req,
+                                                                           const ngx_s3_auth__hmac_key_t *signing_key,
+                                                                           const ngx_str_t *key_scope,
+                                                                           const ngx_str_t *s3_endpoint,
+                                                                           const ngx_str_t *request_body_hash,
+                                                                           const ngx_array_t *extra_headers,
+                                                                           struct S3RequestTimeCache *time_cache) {
+  return ngx_s3_auth__compute_signature_timed(pool, req, req->start_sec, signing_key, key_scope, s3_endpoint,
+                                              request_body_hash, extra_headers, NULL, time_cache, NULL);
+}
+
+// Batched signing: ngx_s3_auth__prepare_signature does everything
+// ngx_s3_auth__compute_signature does up to the first hash, materializing the
+// canonical request instead of streaming it; ngx_s3_auth__complete_signatures
+// then hashes and signs a whole batch of them with the multi-buffer
+// functions of the crypto backend. The string to sign is allocated with room
+// for the canonical request hash, so completing does not allocate.
+#define NGX_S3_AUTH_BATCH_MAX 64
+
+struct S3PendingSignature {
+  const ngx_s3_auth__hmac_key_t *signing_key;
+  ngx_str_t canonical_request;
+  ngx_str_t string_to_sign;
+  ngx_str_t signature;
+  struct S3SignedRequestDetails details; // details.signature is set once complete
+};
+
+static inline ngx_int_t ngx_s3_auth__prepare_signature(ngx_pool_t *pool,
+                                                       ngx_http_request_t *req,
+                                                       const ngx_s3_auth__hmac_key_t *signing_key,
+                                                       const ngx_str_t *key_scope,
+                                                       const ngx_str_t *s3_endpoint,
+                                                       const ngx_str_t *request_body_hash,
+                                                       const ngx_array_t *extra_headers,
+                                                       struct S3RequestTimeCache *time_cache,
+                                                       struct S3PendingSignature *pending) {
+  struct S3CanonicalSink sink;
+  u_char *p;
+
+  const ngx_str_t *date = ngx_s3_auth__request_date(pool, time_cache, req->start_sec, key_scope);
+  const ngx_str_t *canonical_qs = ngx_s3_auth__canonize_query_string(pool, req);
+  if (date == NULL || canonical_qs == NULL) {
+    return NGX_ERROR;
+  }
+
+  pending->signing_key = signing_key;
+  pending->details.signature = NULL;
+  pending->details.header_list = ngx_s3_auth__signed_header_list(pool, date, request_body_hash, s3_endpoint,
+                                                                 extra_headers);
+  if (pending->details.header_list == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_s3_auth__materialize(pool, &pending->canonical_request, sink,
+                           ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs,
+                                                                pending->details.header_list,
+                                                                request_body_hash));
+
+  pending->details.signed_header_names = ngx_s3_auth__signed_header_names(pool, pending->details.header_list);
+
+  // AWS4-HMAC-SHA256\n<date>\n<scope>\n<canonical request hash>
+  pending->string_to_sign.len = sizeof("AWS4-HMAC-SHA256\n") - 1 + date->len + 1 + key_scope->len + 1
+                                + NGX_S3_AUTH_SHA256_LEN * 2;
+  pending->string_to_sign.data = ngx_pnalloc(pool, pending->string_to_sign.len);
+  pending->signature.len = NGX_S3_AUTH_SHA256_LEN * 2;
+  pending->signature.data = ngx_pnalloc(pool, pending->signature.len);
+  if (pending->string_to_sign.data == NULL || pending->signature.data == NULL) {
+    return NGX_ERROR;
+  }
+
+  if (time_cache != NULL) {
+    p = ngx_cpymem(pending->string_to_sign.data, time_cache->prefix.data, time_cache->prefix.len);
+  } else {
+    p = ngx_sprintf(pending->string_to_sign.data, "AWS4-HMAC-SHA256\n%V\n%V\n", date, key_scope);
+  }
+
+  return p == pending->string_to_sign.data + pending->string_to_sign.len - NGX_S3_AUTH_SHA256_LEN * 2
+         ? NGX_OK : NGX_ERROR;
+}
+
+static inline ngx_int_t ngx_s3_auth__complete_signatures(struct S3PendingSignature *const *pending, size_t n) {
+  const ngx_s3_auth__hmac_key_t *keys[NGX_S3_AUTH_BATCH_MAX];
+  u_char md[NGX_S3_AUTH_BATCH_MAX][NGX_S3_AUTH_SHA256_LEN];
+  ngx_str_t blobs[NGX_S3_AUTH_BATCH_MAX];
+  size_t i, m;
+
+  for (/* void */; n > 0; n -= m, pending += m) {
+    m = ngx_min(n, NGX_S3_AUTH_BATCH_MAX);
+
+    for (i = 0; i < m; i++) {
+      blobs[i] = pending[i]->canonical_request;
+    }
+    ngx_s3_auth__sha256_batch(blobs, md, m);
+
+    for (i = 0; i < m; i++) {
+      ngx_hex_dump(pending[i]->string_to_sign.data + pending[i]->string_to_sign.len - NGX_S3_AUTH_SHA256_LEN * 2,
+                   md[i], NGX_S3_AUTH_SHA256_LEN);
+      blobs[i] = pending[i]->string_to_sign;
+      keys[i] = pending[i]->signing_key;
+    }
+
+    if (ngx_s3_auth__hmac_sign_batch(keys, blobs, md, m) != NGX_OK) {
+      return NGX_ERROR;
+    }
+
+    for (i = 0; i < m; i++) {
+      ngx_hex_dump(pending[i]->signature.data, md[i], NGX_S3_AUTH_SHA256_LEN);
+      pending[i]->details.signature = &pending[i]->signature;
+    }
+  }
+
+  return NGX_OK;
+}
+
+// Signatures only depend on the method, the path and arguments, the endpoint,
+// the payload hash, the extra headers (may be NULL), the signing key with its
+// scope and the second. The key is all of that but the second, which a cache
+// keeps next to it; the signing key is in it by its fingerprint only, see
+// ngx_s3_auth__key_fingerprint.
+static inline const ngx_str_t* ngx_s3_auth__signature_cache_key(ngx_pool_t *pool,
+                                                                const ngx_http_request_t *req,
+                                                                const ngx_str_t *s3_endpoint,
+                                                                const ngx_str_t *key_scope,
+                                                                const ngx_str_t *request_body_hash,
+                                                                const ngx_array_t *extra_headers,
+                                                                const ngx_str_t *key_fingerprint) {
+  const ngx_str_t path = ngx_s3_auth__request_path(req);
+  const header_pair_t *extra = extra_headers != NULL ? extra_headers->elts : NULL;
+  ngx_uint_t i, nextra = extra_headers != NULL ? extra_headers->nelts : 0;
+  size_t extra_len = 0;
+  ngx_str_t *key;
+  u_char *p;
+
+  for (i = 0; i < nextra; i++) {
+    extra_len += extra[i].key.len + 1 + extra[i].value.len + 1;
+  }
+
+  key = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (key == NULL) {
+    return NULL;
+  }
+
+  key->len = req->method_name.len + 1 + path.len + 1 + req->args.len + 1 + s3_endpoint->len + 1
+             + key_scope->len + 1 + request_body_hash->len + 1 + extra_len + key_fingerprint->len;
+  key->data = ngx_pnalloc(pool, key->len);
+  if (key->data == NULL) {
+    return NULL;
+  }
+
+  p = ngx_cpymem(key->data, req->method_name.data, req->method_name.len);
+  *p++ = ' ';
+  p = ngx_cpymem(p, path.data, path.len);
+  *p++ = '?';
+  p = ngx_cpymem(p, req->args.data, req->args.len);
+  *p++ = '\n';
+  p = ngx_cpymem(p, s3_endpoint->data, s3_endpoint->len);
+  *p++ = '\n';
+  p = ngx_cpymem(p, key_scope->data, key_scope->len);
+  *p++ = '\n';
+  p = ngx_cpymem(p, request_body_hash->data, request_body_hash->len);
+  *p++ = '\n';
+  for (i = 0; i < nextra; i++) {
+    p = ngx_cpymem(p, extra[i].key.data, extra[i].key.len);
+    *p++ = ':';
+    p = ngx_cpymem(p, extra[i].value.data, extra[i].value.len);
+    *p++ = '\n';
+  }
+  ngx_memcpy(p, key_fingerprint->data, key_fingerprint->len);
+
+  return key;
+}
+
+#define NGX_S3_AUTH_SIGNATURE_LEN (NGX_S3_AUTH_SHA256_LEN * 2)
+
+// the details ngx_s3_auth__compute_signature would return, for a signature
+// which is known already; it is copied, so it may live in shared memory
+static inline struct S3SignedRequestDetails ngx_s3_auth__reuse_signature(ngx_pool_t *pool,
+                                                                         const ngx_http_request_t *req,
+                                                                         time_t sec,
+                                                                         const ngx_str_t *key_scope,
+                                                                         const ngx_str_t *s3_endpoint,
+                                                                         const ngx_str_t *request_body_hash,
+                                                                         const ngx_array_t *extra_headers,
+                                                                         struct S3RequestTimeCache *time_cache,
+                                                                         const u_char *signature) {
+  struct S3SignedRequestDetails req_details;
+  ngx_str_t *copy;
+
+  req_details.signature = NULL;
+  req_details.signed_header_names = NULL;
+  req_details.header_list = NULL;
+
+  const ngx_str_t *date = ngx_s3_auth__request_date(pool, time_cache, sec, key_scope);
+  copy = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (date == NULL || copy == NULL) {
+    return req_details;
+  }
+
+  copy->len = NGX_S3_AUTH_SIGNATURE_LEN;
+  copy->data = ngx_pnalloc(pool, NGX_S3_AUTH_SIGNATURE_LEN);
+  if (copy->data == NULL) {
+    return req_details;
+  }
+  ngx_memcpy(copy->data, signature, NGX_S3_AUTH_SIGNATURE_LEN);
+
+  req_details.header_list = ngx_s3_auth__signed_header_list(pool, date, request_body_hash, s3_endpoint,
+                                                            extra_headers);
+  req_details.signed_header_names = ngx_s3_auth__signed_header_names(pool, req_details.header_list);
+  req_details.signature = copy;
+
+  return req_details;
+}
+
+// What went into a signature, for debugging: signing itself only streams
+// the canonical request into the hash, this rebuilds it and the string to
+// sign from details, which must not have the Authorization header yet.
+struct S3SignatureTrace {
+  const ngx_str_t *canonical_request;
+  const ngx_str_t *string_to_sign;
+};
+
+static inline ngx_int_t ngx_s3_auth__trace_signature(ngx_pool_t *pool,
+                                                     const ngx_http_request_t *req,
+                                                     const struct S3SignedRequestDetails *details,
+                                                     const ngx_str_t *key_scope,
+                                                     const ngx_str_t *request_body_hash,
+                                                     struct S3SignatureTrace *trace) {
+  const header_pair_t *headers = details->header_list->elts;
+  const ngx_str_t *date = NULL, *canonical_qs, *canonical_request_hash;
+  struct S3CanonicalSink sink;
+  ngx_str_t *canonical_request;
+  ngx_uint_t i;
+
+  for (i = 0; i < details->header_list->nelts; i++) {
+    if (headers[i].key.len == DATE_HEADER.len
+        && ngx_strncmp(headers[i].key.data, DATE_HEADER.data, DATE_HEADER.len) == 0) {
+      date = &headers[i].value;
+    }
+  }
+
+  canonical_qs = ngx_s3_auth__canonize_query_string(pool, req);
+  canonical_request = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (date == NULL || canonical_qs == NULL || canonical_request == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_s3_auth__materialize(pool, canonical_request, sink,
+                           ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs, details->header_list,
+                                                                request_body_hash));
+
+  canonical_request_hash = ngx_s3_auth__hash_sha256(pool, canonical_request);
+  if (canonical_request_hash == NULL) {
+    return NGX_ERROR;
+  }
+
+  trace->canonical_request = canonical_request;
+  trace->string_to_sign = ngx_s3_auth__string_to_sign(pool, key_scope, date, canonical_request_hash);
+
+  return NGX_OK;
+}
+
+// appends the Authorization header to the signed header list
+static inline const ngx_array_t* ngx_s3_auth__add_auth_header(ngx_pool_t *pool,
+                                                              const struct S3SignedRequestDetails *signature_details,
+                                                              const ngx_str_t *access_key_id,
+                                                              const ngx_str_t *key_scope) {
+  const ngx_str_t *auth_header_value = ngx_s3_auth__make_auth_token(
+    pool, signature_details->signature,
+    signature_details->signed_header_names, access_key_id, key_scope);
+
+  header_pair_t *header_ptr;
+  header_ptr = ngx_array_push(signature_details->header_list);
+  header_ptr->key = AUTHZ_HEADER;
+  header_ptr->value = *auth_header_value;
+
+  return signature_details->header_list;
+}
+
+// ngx_s3_auth__add_auth_header with the Authorization value taken from a
+// template, only the signature is copied in
+static inline const ngx_array_t* ngx_s3_auth__add_auth_header_template(ngx_pool_t *pool,
+                                                                       const struct S3SignedRequestDetails *signature_details,
+                                                                       const struct S3AuthTemplate *tpl) {
+  header_pair_t *header_ptr;
+  u_char *p;
+
+  p = ngx_pnalloc(pool, tpl->prefix.len + signature_details->signature->len);
+  header_ptr = ngx_array_push(signature_details->header_list);
+  if (p == NULL || header_ptr == NULL) {
+    return NULL;
+  }
+
+  header_ptr->key = AUTHZ_HEADER;
+  header_ptr->value.data = p;
+  p = ngx_cpymem(p, tpl->prefix.data, tpl->prefix.len);
+  p = ngx_cpymem(p, signature_details->signature->data, signature_details->signature->len);
+  header_ptr->value.len = p - header_ptr->value.data;
+
+  return signature_details->header_list;
+}
+
+// Signing the same request for several hosts, one per upstream peer: the
+// canonical request is kept around the host value, everything else in it
+// is the same for every peer. Signing for a host then costs a SHA-256 of
+// the kept parts, the string to sign and its HMAC.
+struct S3PeerSigner {
+  ngx_str_t canonical_prefix; // up to and including "host:"
+  ngx_str_t canonical_suffix; // from the newline after the host value
+  const ngx_str_t *date;
+  const ngx_str_t *key_scope;
+  const ngx_s3_auth__hmac_key_t *signing_key; // has to outlive the signer
+  ngx_str_t auth_prefix; // the Authorization value up to the signature
+};
+
+static inline struct S3PeerSigner* ngx_s3_auth__peer_signer_create(ngx_pool_t *pool,
+                                                                   const ngx_http_request_t *req,
+                                                                   time_t sec,
+                                                                   const ngx_str_t *access_key_id,
+                                                                   const ngx_s3_auth__hmac_key_t *signing_key,
+                                                                   const ngx_str_t *key_scope,
+                                                                   const ngx_str_t *request_body_hash,
+                                                                   const ngx_array_t *extra_headers) {
+  const char host_line[] = "\nhost:\n";
+  const char fmt[] = "AWS4-HMAC-SHA256 Credential=%V/%V,SignedHeaders=%V,Signature=";
+  struct S3PeerSigner *signer = ngx_pcalloc(pool, sizeof(struct S3PeerSigner));
+  const ngx_str_t *canonical_qs, *names;
+  struct S3CanonicalSink sink;
+  ngx_array_t *header_list;
+  ngx_str_t canonical_request;
+  u_char *host;
+
+  if (signer == NULL) {
+    return NULL;
+  }
+
+  signer->date = ngx_s3_auth__compute_request_time(pool, &sec);
+  canonical_qs = ngx_s3_auth__canonize_query_string(pool, req);
+  if (signer->date == NULL || canonical_qs == NULL) {
+    return NULL;
+  }
+
+  // an empty host leaves "host:" on a line of its own, the only such line:
+  // nothing else in the canonical request has a raw newline in it
+  header_list = ngx_s3_auth__signed_header_list(pool, signer->date, request_body_hash, &EMPTY_STRING,
+                                                extra_headers);
+  if (header_list == NULL) {
+    return NULL;
+  }
+
+  ngx_s3_auth__materialize(pool, &canonical_request, sink,
+                           ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs, header_list,
+                                                                request_body_hash));
+
+  host = ngx_strnstr(canonical_request.data, (char *) host_line, canonical_request.len);
+  if (host == NULL) {
+    return NULL;
+  }
+  host += sizeof(host_line) - 2; // at the newline
+
+  signer->canonical_prefix.data = canonical_request.data;
+  signer->canonical_prefix.len = host - canonical_request.data;
+  signer->canonical_suffix.data = host;
+  signer->canonical_suffix.len = canonical_request.data + canonical_request.len - host;
+
+  names = ngx_s3_auth__signed_header_names(pool, header_list);
+  signer->auth_prefix.len = sizeof(fmt) + access_key_id->len + key_scope->len + names->len;
+  signer->auth_prefix.data = ngx_pnalloc(pool, signer->auth_prefix.len);
+  if (signer->auth_prefix.data == NULL) {
+    return NULL;
+  }
+  signer->auth_prefix.len = ngx_sprintf(signer->auth_prefix.data, fmt, access_key_id, key_scope, names)
+                            - signer->auth_prefix.data;
+
+  signer->key_scope = key_scope;
+  signer->signing_key = signing_key;
+
+  return signer;
+}
+
+// the Authorization value for the request sent with host as its Host header,
+// NULL if the crypto backend failed
+static inline const ngx_str_t* ngx_s3_auth__peer_sign(ngx_pool_t *pool, const struct S3PeerSigner *signer,
+                                                      const ngx_str_t *host) {
+  ngx_s3_auth__sha256_ctx_t *hash = ngx_s3_auth__sha256_init(pool);
+  const ngx_str_t *canonical_request_hash, *string_to_sign, *signature;
+  ngx_str_t *authorization;
+
+  if (hash == NULL) {
+    return NULL;
+  }
+
+  ngx_s3_auth__sha256_update(hash, signer->canonical_prefix.data, signer->canonical_prefix.len);
+  ngx_s3_auth__sha256_update(hash, host->data, host->len);
+  ngx_s3_auth__sha256_update(hash, signer->canonical_suffix.data, signer->canonical_suffix.len);
+
+  canonical_request_hash = ngx_s3_auth__sha256_final_hex(pool, hash);
+  if (canonical_request_hash == NULL) {
+    return NULL;
+  }
+
+  string_to_sign = ngx_s3_auth__string_to_sign(pool, signer->key_scope, signer->date, canonical_request_hash);
+  signature = ngx_s3_auth__hmac_sign_hex(pool, signer->signing_key, string_to_sign);
+  authorization = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (signature == NULL || authorization == NULL) {
+    return NULL;
+  }
+
+  authorization->len = signer->auth_prefix.len + signature->len;
+  authorization->data = ngx_pnalloc(pool, authorization->len);
+  if (authorization->data == NULL) {
+    return NULL;
+  }
+  ngx_memcpy(ngx_cpymem(authorization->data, signer->auth_prefix.data, signer->auth_prefix.len),
+             signature->data, signature->len);
+
+  return authorization;
+}
+
+// list of header_pair_t, NULL if the crypto backend failed
+// request_body_hash is the hex SHA-256 of the payload, EMPTY_STRING_SHA256 for bodiless requests
+// time_cache may be NULL, the date is formatted for this request alone then
+static inline const ngx_array_t* ngx_s3_auth__sign(ngx_pool_t *pool, ngx_http_request_t *req,
+                                                   const ngx_str_t *access_key_id,
+                                                   const ngx_s3_auth__hmac_key_t *signing_key,
+                                                   const ngx_str_t *key_scope,
+                                                   const ngx_str_t *s3_endpoint,
+                                                   const ngx_str_t *request_body_hash,
+                                                   struct S3RequestTimeCache *time_cache) {
+  const struct S3SignedRequestDetails signature_details =
+      ngx_s3_auth__compute_signature(pool, req, signing_key, key_scope, s3_endpoint, request_body_hash, NULL,
+                                     time_cache);
+
+  if (signature_details.signature == NULL) {
+    return NULL;
+  }
+
+  return ngx_s3_auth__add_auth_header(pool, &signature_details, access_key_id, key_scope);
+}
+
+// Presigned URLs carry the credentials and the signature in the query string
+// instead of headers. Only the host is signed and the payload never is, so
+// a client can fetch the object straight from the backend until the URL expires.
+// see https://docs.aws.amazon.com/AmazonS3/latest/API/sigv4-query-string-auth.html
+static const ngx_str_t UNSIGNED_PAYLOAD = ngx_string("UNSIGNED-PAYLOAD");
+
+#define NGX_S3_AUTH_PRESIGN_MAX_EXPIRES 604800 // a week, the longest S3 accepts
+
+// <escaped path>?<canonical query string>&X-Amz-Signature=<signature>
+static inline void ngx_s3_auth__write_presigned_target(struct S3CanonicalSink *sink,
+                                                       const ngx_str_t *path,
+                                                       const ngx_str_t *canonical_qs,
+                                                       const ngx_str_t *signature) {
+  static const ngx_str_t signature_arg = ngx_string("&X-Amz-Signature=");
+
+  ngx_s3_auth__write_escaped_uri(sink, path->data, path->len);
+  ngx_s3_auth__sink_write_char(sink, '?');
+  ngx_s3_auth__sink_write_str(sink, canonical_qs);
+  ngx_s3_auth__sink_write_str(sink, &signature_arg);
+  ngx_s3_auth__sink_write_str(sink, signature);
+}
+
+// request target (path and query) of the presigned URL, NULL if the crypto backend failed
+static inline const ngx_str_t* ngx_s3_auth__presign(ngx_pool_t *pool, const ngx_http_request_t *req,
+                                                    const ngx_str_t *access_key_id,
+                                                    const ngx_s3_auth__hmac_key_t *signing_key,
+                                                    const ngx_str_t *key_scope,
+                                                    const ngx_str_t *s3_endpoint,
+                                                    const ngx_str_t *session_token,
+                                                    time_t expires) {
+  struct S3CanonicalSink sink;
+  ngx_array_t *qs_args, *header_list;
+  header_pair_t *pair;
+  ngx_str_t *target, credential, expires_str, token;
+  ngx_uint_t nargs = session_token != NULL ? 6 : 5;
+  u_char *p;
+
+  const ngx_str_t path = ngx_s3_auth__request_path(req);
+  const ngx_str_t *date = ngx_s3_auth__compute_request_time(pool, &req->start_sec);
+
+  // <access key>/<scope> with the slashes escaped
+  credential.data = ngx_pnalloc(pool, 3 * (access_key_id->len + 1 + key_scope->len));
+  expires_str.data = ngx_pnalloc(pool, NGX_TIME_T_LEN);
+  qs_args = ngx_s3_auth__query_string_args(pool, &req->args, nargs);
+  header_list = ngx_array_create(pool, 1, sizeof(header_pair_t));
+  target = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (credential.data == NULL || expires_str.data == NULL || qs_args == NULL
+      || header_list == NULL || target == NULL) {
+    return NULL;
+  }
+
+  p = (u_char *) ngx_escape_uri(credential.data, access_key_id->data, access_key_id->len,
+                                NGX_ESCAPE_URI_COMPONENT);
+  p = ngx_cpymem(p, "%2F", 3);
+  p = (u_char *) ngx_escape_uri(p, key_scope->data, key_scope->len, NGX_ESCAPE_URI_COMPONENT);
+  credential.len = p - credential.data;
+
+  expires_str.len = ngx_sprintf(expires_str.data, "%T", expires) - expires_str.data;
+
+  pair = ngx_array_push_n(qs_args, nargs);
+  if (pair == NULL) {
+    return NULL;
+  }
+  ngx_str_set(&pair[0].key, "X-Amz-Algorithm");
+  ngx_str_set(&pair[0].value, "AWS4-HMAC-SHA256");
+  ngx_str_set(&pair[1].key, "X-Amz-Credential");
+  pair[1].value = credential;
+  ngx_str_set(&pair[2].key, "X-Amz-Date");
+  pair[2].value = *date;
+  ngx_str_set(&pair[3].key, "X-Amz-Expires");
+  pair[3].value = expires_str;
+  ngx_str_set(&pair[4].key, "X-Amz-SignedHeaders");
+  pair[4].value = HOST_HEADER;
+
+  if (session_token != NULL) {
+    token.data = ngx_pnalloc(pool, 3 * session_token->len);
+    if (token.data == NULL) {
+      return NULL;
+    }
+    token.len = (u_char *) ngx_escape_uri(token.data, session_token->data, session_token->len,
+                                          NGX_ESCAPE_URI_COMPONENT) - token.data;
+
+    ngx_str_set(&pair[5].key, "X-Amz-Security-Token");
+    pair[5].value = token;
+  }
+
+  const ngx_str_t *canonical_qs = ngx_s3_auth__join_query_string(pool, qs_args);
+  if (canonical_qs == NULL) {
+    return NULL;
+  }
+
+  pair = ngx_array_push(header_list);
+  pair->key = HOST_HEADER;
+  pair->value = *s3_endpoint;
+
+  sink.hash = ngx_s3_auth__sha256_init(pool);
+  sink.pos = NULL;
+  sink.len = 0;
+  if (sink.hash == NULL) {
+    return NULL;
+  }
+  ngx_s3_auth__write_canonical_request(&sink, req, canonical_qs, header_list, &UNSIGNED_PAYLOAD);
+
+  const ngx_str_t *canonical_request_hash = ngx_s3_auth__sha256_final_hex(pool, sink.hash);
+  if (canonical_request_hash == NULL) {
+    return NULL;
+  }
+
+  const ngx_str_t *string_to_sign = ngx_s3_auth__string_to_sign(pool, key_scope, date, canonical_request_hash);
+  const ngx_str_t *signature = ngx_s3_auth__hmac_sign_hex(pool, signing_key, string_to_sign);
+  if (signature == NULL) {
+    return NULL;
+  }
+
+  ngx_s3_auth__materialize(pool, target, sink,
+                           ngx_s3_auth__write_presigned_target(&sink, &path, canonical_qs, signature));
+  return target;
+}
+
+// aws-chunked uploads (STREAMING-AWS4-HMAC-SHA256-PAYLOAD): the request is
+// signed once with the payload hash replaced by STREAMING_PAYLOAD, this seed
+// signature then starts a chain where every chunk is signed over the
+// signature of the chunk before it. Each chunk goes upstream framed as
+//   <hex size>;chunk-signature=<signature>\r\n<data>\r\n
+// and the body ends with an empty chunk.
+// see https://docs.aws.amazon.com/AmazonS3/latest/API/sigv4-streaming.html
+static const ngx_str_t STREAMING_PAYLOAD = ngx_string("STREAMING-AWS4-HMAC-SHA256-PAYLOAD");
+static const ngx_str_t DECODED_LENGTH_HEADER = ngx_string("x-amz-decoded-content-length");
+static const ngx_str_t CHUNK_SIGNATURE = ngx_string(";chunk-signature=");
+
+#define NGX_S3_AUTH_CHUNK_MIN_SIZE 8192
+// the largest chunk header, a chunk size never needs more than 16 hex digits
+#define NGX_S3_AUTH_CHUNK_HEADER_MAX (16 + sizeof(";chunk-signature=") - 1 + NGX_S3_AUTH_SIGNATURE_LEN + 2)
+
+struct S3ChunkSigner {
+  const ngx_s3_auth__hmac_key_t *signing_key;
+  ngx_s3_auth__sha256_ctx_t *chunk_hash;
+  // AWS4-HMAC-SHA256-PAYLOAD\n<date>\n<scope>\n<previous signature>\n<empty hash>\n<chunk hash>
+  // built once, only the two signature/hash slots change per chunk
+  ngx_str_t string_to_sign;
+  u_char *previous_signature;
+  u_char *chunk_hash_hex;
+  u_char signature[NGX_S3_AUTH_SIGNATURE_LEN]; // of the last chunk, the seed signature initially
+};
+
+static inline struct S3ChunkSigner* ngx_s3_auth__chunk_signer_create(ngx_pool_t *pool,
+                                                                     const ngx_s3_auth__hmac_key_t *signing_key,
+                                                                     const ngx_str_t *date,
+                                                                     const ngx_str_t *key_scope,
+                                                                     const ngx_str_t *seed_signature) {
+  const char prefix[] = "AWS4-HMAC-SHA256-PAYLOAD\n";
+  struct S3ChunkSigner *signer;
+  u_char *p;
+
+  if (seed_signature->len != NGX_S3_AUTH_SIGNATURE_LEN) {
+    return NULL;
+  }
+
+  signer = ngx_palloc(pool, sizeof(struct S3ChunkSigner));
+  if (signer == NULL) {
+    return NULL;
+  }
+
+  signer->signing_key = signing_key;
+  signer->chunk_hash = ngx_s3_auth__sha256_init(pool);
+  if (signer->chunk_hash == NULL) {
+    return NULL;
+  }
+
+  signer->string_to_sign.len = sizeof(prefix) - 1 + date->len + 1 + key_scope->len + 1
+                               + NGX_S3_AUTH_SIGNATURE_LEN + 1 + EMPTY_STRING_SHA256.len + 1
+                               + NGX_S3_AUTH_SIGNATURE_LEN;
+  signer->string_to_sign.data = ngx_pnalloc(pool, signer->string_to_sign.len);
+  if (signer->string_to_sign.data == NULL) {
+    return NULL;
+  }
+
+  p = ngx_sprintf(signer->string_to_sign.data, "%s%V\n%V\n", prefix, date, key_scope);
+  signer->previous_signature = p;
+  p = ngx_sprintf(p + NGX_S3_AUTH_SIGNATURE_LEN, "\n%V\n", &EMPTY_STRING_SHA256);
+  signer->chunk_hash_hex = p;
+
+  ngx_memcpy(signer->signature, seed_signature->data, NGX_S3_AUTH_SIGNATURE_LEN);
+
+  return signer;
+}
+
+static inline void ngx_s3_auth__chunk_signer_update(struct S3ChunkSigner *signer, const u_char *data, size_t len) {
+  ngx_s3_auth__sha256_update(signer->chunk_hash, data, len);
+}
+
+// signs everything passed to ngx_s3_auth__chunk_signer_update since the last
+// call as one chunk, the result replaces signer->signature
+static inline ngx_int_t ngx_s3_auth__chunk_signer_finish(struct S3ChunkSigner *signer) {
+  u_char md[NGX_S3_AUTH_SHA256_LEN];
+
+  if (ngx_s3_auth__sha256_final(signer->chunk_hash, md) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ngx_memcpy(signer->previous_signature, signer->signature, NGX_S3_AUTH_SIGNATURE_LEN);
+  ngx_hex_dump(signer->chunk_hash_hex, md, sizeof(md));
+
+  if (ngx_s3_auth__hmac_sign(signer->signing_key, &signer->string_to_sign, md) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ngx_hex_dump(signer->signature, md, sizeof(md));
+  return NGX_OK;
+}
+
+static inline size_t ngx_s3_auth__chunk_header_len(size_t size) {
+  size_t digits = 1;
+
+  while (size >>= 4) {
+    digits++;
+  }
+
+  return digits + CHUNK_SIGNATURE.len + NGX_S3_AUTH_SIGNATURE_LEN + 2;
+}
+
+// writes ngx_s3_auth__chunk_header_len(size) bytes, returns the end
+static inline u_char* ngx_s3_auth__write_chunk_header(u_char *p, size_t size, const u_char *signature) {
+  p = ngx_sprintf(p, "%xz%V", size, &CHUNK_SIGNATURE);
+  p = ngx_cpymem(p, signature, NGX_S3_AUTH_SIGNATURE_LEN);
+  *p++ = CR;
+  *p++ = LF;
+  return p;
+}
+
+// the Content-Length of the aws-chunked body for a decoded_length bytes payload
+static inline off_t ngx_s3_auth__aws_chunked_length(off_t decoded_length, size_t chunk_size) {
+  off_t full = decoded_length / chunk_size;
+  size_t rest = decoded_length % chunk_size;
+  off_t len;
+
+  len = full * (ngx_s3_auth__chunk_header_len(chunk_size) + chunk_size + 2);
+  if (rest > 0) {
+    len += ngx_s3_auth__chunk_header_len(rest) + rest + 2;
+  }
+
+  return len + ngx_s3_auth__chunk_header_len(0) + 2;
+}
+
+// Inbound verification: a client signed the request with one of our local
+// credentials and we recompute the signature from the request as received.
+// The canonical request is built with the same writers the signing side uses.
+#define NGX_S3_AUTH_MAX_SKEW 900 // S3 rejects requests more than 15 minutes off
+
+static const ngx_str_t AUTHZ_ALGORITHM = ngx_string("AWS4-HMAC-SHA256 ");
+
+struct S3AuthorizationDetails {
+  ngx_str_t access_key;
+  ngx_str_t key_scope;  // <yyyymmdd>/<region>/<service>/aws4_request
+  ngx_str_t date;       // <yyyymmdd>
+  ngx_str_t region;
+  ngx_str_t service;
+  ngx_str_t signed_header_names;
+  ngx_str_t signature;
+};
+
+// splits the next `sep` terminated part off *p, NULL if there is none
+static inline u_char* ngx_s3_auth__next_part(u_char **p, u_char *last, u_char sep, ngx_str_t *part) {
+  u_char *end = ngx_strlchr(*p, last, sep);
+
+  if (end == NULL) {
+    return NULL;
+  }
+
+  part->data = *p;
+  part->len = end - *p;
+  *p = end + 1;
+  return end;
+}
+
+// AWS4-HMAC-SHA256 Credential=<key>/<scope>, SignedHeaders=<a;b>, Signature=<hex>
+// NGX_DECLINED if the header is not a well formed SigV4 authorization
+static inline ngx_int_t ngx_s3_auth__parse_authorization(const ngx_str_t *value,
+                                                         struct S3AuthorizationDetails *auth) {
+  static const ngx_str_t credential = ngx_string("Credential=");
+  static const ngx_str_t signed_headers = ngx_string("SignedHeaders=");
+  static const ngx_str_t signature = ngx_string("Signature=");
+
+  u_char *p, *last, *end;
+  ngx_str_t param, terminator;
+  size_t i;
+
+  ngx_memzero(auth, sizeof(struct S3AuthorizationDetails));
+
+  if (value->len < AUTHZ_ALGORITHM.len
+      || ngx_strncmp(value->data, AUTHZ_ALGORITHM.data, AUTHZ_ALGORITHM.len) != 0) {
+    return NGX_DECLINED;
+  }
+
+  p = value->data + AUTHZ_ALGORITHM.len;
+  last = value->data + value->len;
+
+  while (p < last) {
+    while (p < last && (*p == ' ' || *p == ',')) {
+      p++;
+    }
+
+    end = ngx_strlchr(p, last, ',');
+    if (end == NULL) {
+      end = last;
+    }
+
+    param.data = p;
+    param.len = end - p;
+    p = end;
+
+    if (param.len > credential.len && ngx_strncmp(param.data, credential.data, credential.len) == 0) {
+      param.data += credential.len;
+      param.len -= credential.len;
+
+      end = param.data + param.len;
+      p = param.data;
+      if (ngx_s3_auth__next_part(&p, end, '/', &auth->access_key) == NULL) {
+        return NGX_DECLINED;
+      }
+
+      auth->key_scope.data = p;
+      auth->key_scope.len = end - p;
+
+      if (ngx_s3_auth__next_part(&p, end, '/', &auth->date) == NULL
+          || ngx_s3_auth__next_part(&p, end, '/', &auth->region) == NULL
+          || ngx_s3_auth__next_part(&p, end, '/', &auth->service) == NULL) {
+        return NGX_DECLINED;
+      }
+
+      terminator.data = p;
+      terminator.len = end - p;
+      if (terminator.len != KEY_SCOPE_TERMINATOR.len
+          || ngx_strncmp(terminator.data, KEY_SCOPE_TERMINATOR.data, terminator.len) != 0) {
+        return NGX_DECLINED;
+      }
+
+      p = end;
+
+    } else if (param.len > signed_headers.len
+               && ngx_strncmp(param.data, signed_headers.data, signed_headers.len) == 0) {
+      auth->signed_header_names.data = param.data + signed_headers.len;
+      auth->signed_header_names.len = param.len - signed_headers.len;
+
+    } else if (param.len > signature.len && ngx_strncmp(param.data, signature.data, signature.len) == 0) {
+      auth->signature.data = param.data + signature.len;
+      auth->signature.len = param.len - signature.len;
+    }
+  }
+
+  if (auth->access_key.len == 0 || auth->date.len != 8 || auth->region.len == 0
+      || auth->service.len == 0 || auth->signed_header_names.len == 0
+      || auth->signature.len != NGX_S3_AUTH_SIGNATURE_LEN) {
+    return NGX_DECLINED;
+  }
+
+  for (i = 0; i < auth->signature.len; i++) {
+    if (!((auth->signature.data[i] >= '0' && auth->signature.data[i] <= '9')
+          || (auth->signature.data[i] >= 'a' && auth->signature.data[i] <= 'f'))) {
+      return NGX_DECLINED;
+    }
+  }
+
+  return NGX_OK;
+}
+
+// parses the x-amz-date format (yyyymmddThhmmssZ), -1 if malformed
+static inline time_t ngx_s3_auth__parse_request_time(const ngx_str_t *date) {
+  static const u_char layout[] = "00000000T000000Z";
+  ngx_int_t year, month, day, hour, min, sec, days;
+  const u_char *p = date->data;
+  size_t i;
+
+  if (date->len != sizeof(layout) - 1) {
+    return -1;
+  }
+
+  for (i = 0; i < date->len; i++) {
+    if (layout[i] == '0' ? (p[i] < '0' || p[i] > '9') : p[i] != layout[i]) {
+      return -1;
+    }
+  }
+
+  year = ngx_atoi((u_char *) p, 4);
+  month = ngx_atoi((u_char *) p + 4, 2);
+  day = ngx_atoi((u_char *) p + 6, 2);
+  hour = ngx_atoi((u_char *) p + 9, 2);
+  min = ngx_atoi((u_char *) p + 11, 2);
+  sec = ngx_atoi((u_char *) p + 13, 2);
+
+  if (year < 1970 || month < 1 || month > 12 || day < 1 || day > 31
+      || hour > 23 || min > 59 || sec > 60) {
+    return -1;
+  }
+
+  // days since the epoch, counting years from March so leap days come last
+  if (month <= 2) {
+    year--;
+    month += 12;
+  }
+  days = 365 * year + year / 4 - year / 100 + year / 400 + (153 * (month - 3) + 2) / 5 + day - 1 - 719468;
+
+  return (time_t) days * NGX_S3_AUTH_DAY_SECONDS + hour * 3600 + min * 60 + sec;
+}
+
+// adds the value of one more header of the same name, repeated headers are
+// joined with commas in the order they were received
+static inline ngx_int_t ngx_s3_auth__join_header_value(ngx_pool_t *pool, header_pair_t *pair, const ngx_str_t *value) {
+  u_char *joined, *p;
+
+  if (pair->value.data == NULL) {
+    pair->value = *value;
+    return NGX_OK;
+  }
+
+  joined = ngx_pnalloc(pool, pair->value.len + 1 + value->len);
+  if (joined == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_cpymem(joined, pair->value.data, pair->value.len);
+  *p++ = ',';
+  ngx_memcpy(p, value->data, value->len);
+
+  pair->value.len += 1 + value->len;
+  pair->value.data = joined;
+
+  return NGX_OK;
+}
+
+// trims the value and collapses inner runs of spaces, copies only if it has to
+static inline ngx_str_t ngx_s3_auth__trim_header_value(ngx_pool_t *pool, ngx_str_t value) {
+  ngx_str_t trimmed;
+  u_char *p, *last;
+
+  while (value.len > 0 && (value.data[0] == ' ' || value.data[0] == '\t')) {
+    value.data++;
+    value.len--;
+  }
+
+  while (value.len > 0 && (value.data[value.len - 1] == ' ' || value.data[value.len - 1] == '\t')) {
+    value.len--;
+  }
+
+  for (p = value.data, last = value.data + value.len; p + 1 < last; p++) {
+    if (*p == ' ' && *(p + 1) == ' ') {
+      break;
+    }
+  }
+
+  if (p + 1 >= last) {
+    return value;
+  }
+
+  trimmed.data = ngx_pnalloc(pool, value.len);
+  if (trimmed.data == NULL) {
+    trimmed.len = 0;
+    return trimmed;
+  }
+
+  for (trimmed.len = 0, p = value.data; p < last; p++) {
+    if (*p == ' ' && trimmed.len > 0 && trimmed.data[trimmed.len - 1] == ' ') {
+      continue;
+    }
+    trimmed.data[trimmed.len++] = *p;
+  }
+
+  return trimmed;
+}
+
+// the headers named in SignedHeaders with their canonical values, in that
+// order; NULL if one is missing or the names are not sorted and lowercase
+static inline ngx_array_t* ngx_s3_auth__collect_signed_headers(ngx_pool_t *pool,
+                                                               const ngx_list_t *headers,
+                                                               const ngx_str_t *signed_header_names) {
+  const ngx_list_part_t *part;
+  const ngx_table_elt_t *h;
+  header_pair_t *pair;
+  ngx_str_t value;
+  ngx_array_t *list;
+  u_char *p, *last, *end;
+  size_t i;
+
+  list = ngx_array_create(pool, 8, sizeof(header_pair_t));
+  if (list == NULL) {
+    return NULL;
+  }
+
+  p = signed_header_names->data;
+  last = p + signed_header_names->len;
+
+  while (p < last) {
+    end = ngx_strlchr(p, last, ';');
+    if (end == NULL) {
+      end = last;
+    }
+
+    pair = ngx_array_push(list);
+    if (pair == NULL || end == p) {
+      return NULL;
+    }
+
+    pair->key.data = p;
+    pair->key.len = end - p;
+    pair->value.data = NULL;
+    pair->value.len = 0;
+    p = end + 1;
+
+    for (i = 0; i < pair->key.len; i++) {
+      if (pair->key.data[i] >= 'A' && pair->key.data[i] <= 'Z') {
+        return NULL;
+      }
+    }
+
+    if (list->nelts > 1 && ngx_s3_auth__cmp_hnames(pair - 1, pair) >= 0) {
+      return NULL;
+    }
+
+    // repeated headers are joined with commas in the order they were received
+    for (part = &headers->part; part != NULL; part = part->next) {
+      h = part->elts;
+
+      for (i = 0; i < part->nelts; i++) {
+        if (h[i].key.len != pair->key.len
+            || ngx_strncasecmp(h[i].key.data, pair->key.data, pair->key.len) != 0) {
+          continue;
+        }
+
+        value = ngx_s3_auth__trim_header_value(pool, h[i].value);
+        if (ngx_s3_auth__join_header_value(pool, pair, &value) != NGX_OK) {
+          return NULL;
+        }
+      }
+    }
+
+    if (pair->value.data == NULL) {
+      return NULL;
+    }
+  }
+
+  return list;
+}
+
+// NGX_OK if the signature in auth is the one secret_key ("AWS4" + secret)
+// gives for the request as the client sent it, NGX_DECLINED if it is not
+static inline ngx_int_t ngx_s3_auth__verify_signature(ngx_pool_t *pool,
+                                                      const ngx_http_request_t *req,
+                                                      const struct S3AuthorizationDetails *auth,
+                                                      const ngx_array_t *header_list,
+                                                      const ngx_str_t *secret_key,
+                                                      const ngx_str_t *request_date,
+                                                      const ngx_str_t *payload_hash) {
+  struct S3CanonicalSink sink;
+  ngx_str_t raw_path, path, args, key;
+  const ngx_str_t *canonical_qs;
+  u_char signing_key[NGX_S3_AUTH_SHA256_LEN], md[NGX_S3_AUTH_SHA256_LEN];
+  u_char expected[NGX_S3_AUTH_SIGNATURE_LEN], *src, *dst, diff;
+  size_t i;
+
+  // the path and arguments as sent, rewrites must not change what is verified
+  raw_path = req->unparsed_uri;
+  args.len = 0;
+  src = ngx_strlchr(raw_path.data, raw_path.data + raw_path.len, '?');
+  if (src != NULL) {
+    args.data = src + 1;
+    args.len = raw_path.data + raw_path.len - args.data;
+    raw_path.len = src - raw_path.data;
+  }
+
+  path.data = ngx_pnalloc(pool, raw_path.len);
+  if (path.data == NULL) {
+    return NGX_ERROR;
+  }
+  src = raw_path.data;
+  dst = path.data;
+  ngx_unescape_uri(&dst, &src, raw_path.len, NGX_UNESCAPE_URI);
+  path.len = dst - path.data;
+
+  canonical_qs = ngx_s3_auth__canonize_args(pool, &args);
+  if (canonical_qs == NULL) {
+    return NGX_ERROR;
+  }
+
+  sink.hash = ngx_s3_auth__sha256_init(pool);
+  sink.pos = NULL;
+  sink.len = 0;
+  if (sink.hash == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_s3_auth__write_canonical_parts(&sink, &req->method_name, &path, canonical_qs, header_list, payload_hash);
+
+  const ngx_str_t *canonical_request_hash = ngx_s3_auth__sha256_final_hex(pool, sink.hash);
+  if (canonical_request_hash == NULL) {
+    return NGX_ERROR;
+  }
+
+  const ngx_str_t *string_to_sign = ngx_s3_auth__string_to_sign(pool, &auth->key_scope, request_date,
+                                                                canonical_request_hash);
+
+  ngx_s3_auth__derive_key(secret_key, &auth->date, &auth->region, &auth->service, signing_key);
+  key.data = signing_key;
+  key.len = sizeof(signing_key);
+  ngx_s3_auth__sign_sha256(string_to_sign, &key, md);
+  ngx_memzero(signing_key, sizeof(signing_key));
+
+  ngx_hex_dump(expected, md, sizeof(md));
+
+  // no early exit, the time taken must not tell how much of it matched
+  for (diff = 0, i = 0; i < sizeof(expected); i++) {
+    diff |= expected[i] ^ auth->signature.data[i];
+  }
+
+  return diff == 0 ? NGX_OK : NGX_DECLINED;
+}
+
+// Temporary credentials as STS, the instance metadata service, the container
+// credentials endpoint or a credential_process return them:
+//   {"AccessKeyId": "...", "SecretAccessKey": "...", "Token": "...",
+//    "Expiration": "2026-10-17T18:00:00Z", ...}
+// "SessionToken" is taken for "Token" as well. The token and the expiration
+// are optional, expiration is 0 without one.
+struct S3TemporaryCredentials {
+  ngx_str_t access_key;
+  ngx_str_t secret_key;
+  ngx_str_t session_token;
+  time_t expiration;
+};
+
+// 2026-10-17T18:00:00Z, fractions of a second are ignored, -1 if malformed
+static inline time_t ngx_s3_auth__parse_iso8601_time(const ngx_str_t *value) {
+  static const u_char layout[] = "0000-00-00T00:00:00";
+  u_char compact[sizeof("00000000T000000Z") - 1], *p = value->data, *last = value->data + value->len;
+  ngx_str_t date = { sizeof(compact), compact };
+  size_t i, n;
+
+  if (value->len < sizeof(layout)) {
+    return -1;
+  }
+
+  for (i = 0, n = 0; i < sizeof(layout) - 1; i++) {
+    if (layout[i] == '0' || layout[i] == 'T') {
+      compact[n++] = p[i];
+    } else if (p[i] != layout[i]) {
+      return -1;
+    }
+  }
+  compact[n] = 'Z';
+
+  for (p += i; p < last && *p == '.'; /* void */) {
+    for (p++; p < last && *p >= '0' && *p <= '9'; p++) { /* void */ }
+  }
+
+  if (!((last - p == 1 && *p == 'Z') || (last - p == 6 && ngx_strncmp(p, "+00:00", 6) == 0))) {
+    return -1;
+  }
+
+  return ngx_s3_auth__parse_request_time(&date);
+}
+
+// unescapes the string starting right after its opening quote in place,
+// returns the position after the closing quote or NULL
+static inline u_char* ngx_s3_auth__json_string(u_char *p, u_char *last, ngx_str_t *value) {
+  u_char *dst = p;
+
+  value->data = p;
+
+  while (p < last && *p != '"') {
+    if (*p != '\\') {
+      *dst++ = *p++;
+      continue;
+    }
+
+    // nothing in credentials needs more than these
+    if (++p == last || (*p != '"' && *p != '\\' && *p != '/')) {
+      return NULL;
+    }
+    *dst++ = *p++;
+  }
+
+  if (p == last) {
+    return NULL;
+  }
+
+  value->len = dst - value->data;
+  return p + 1;
+}
+
+// json is a flat object, it is modified in place and the credentials point into it
+static inline ngx_int_t ngx_s3_auth__parse_temporary_credentials(ngx_str_t *json,
+                                                                 struct S3TemporaryCredentials *credentials) {
+  u_char *p = json->data, *last = json->data + json->len;
+  ngx_str_t key, value, expiration;
+  ngx_uint_t string;
+
+  ngx_memzero(credentials, sizeof(struct S3TemporaryCredentials));
+  ngx_str_null(&expiration);
+
+#define ngx_s3_auth__json_skip_space(p, last) \
+  while ((p) < (last) && (*(p) == ' ' || *(p) == '\t' || *(p) == '\r' || *(p) == '\n')) { (p)++; }
+
+  ngx_s3_auth__json_skip_space(p, last);
+  if (p == last || *p++ != '{') {
+    return NGX_ERROR;
+  }
+
+  for ( ;; ) {
+    ngx_s3_auth__json_skip_space(p, last);
+    if (p < last && *p == '}') {
+      break;
+    }
+
+    if (p == last || *p != '"' || (p = ngx_s3_auth__json_string(p + 1, last, &key)) == NULL) {
+      return NGX_ERROR;
+    }
+
+    ngx_s3_auth__json_skip_space(p, last);
+    if (p == last || *p++ != ':') {
+      return NGX_ERROR;
+    }
+    ngx_s3_auth__json_skip_space(p, last);
+
+    string = p < last && *p == '"';
+    if (string) {
+      p = ngx_s3_auth__json_string(p + 1, last, &value);
+      if (p == NULL) {
+        return NGX_ERROR;
+      }
+    } else {
+      // numbers, true, false and null, nested values are not expected
+      for (value.data = p; p < last && *p != ',' && *p != '}' && *p != ' ' && *p != '\n'; p++) {
+        if (*p == '{' || *p == '[' || *p == '"') {
+          return NGX_ERROR;
+        }
+      }
+      value.len = p - value.data;
+    }
+
+    if (!string) {
+      // a null token is no token
+    } else if (key.len == sizeof("AccessKeyId") - 1 && ngx_strncmp(key.data, "AccessKeyId", key.len) == 0) {
+      credentials->access_key = value;
+    } else if (key.len == sizeof("SecretAccessKey") - 1 && ngx_strncmp(key.data, "SecretAccessKey", key.len) == 0) {
+      credentials->secret_key = value;
+    } else if ((key.len == sizeof("Token") - 1 && ngx_strncmp(key.data, "Token", key.len) == 0)
+               || (key.len == sizeof("SessionToken") - 1 && ngx_strncmp(key.data, "SessionToken", key.len) == 0)) {
+      credentials->session_token = value;
+    } else if (key.len == sizeof("Expiration") - 1 && ngx_strncmp(key.data, "Expiration", key.len) == 0) {
+      expiration = value;
+    }
+
+    ngx_s3_auth__json_skip_space(p, last);
+    if (p < last && *p == ',') {
+      p++;
+      continue;
+    }
+    if (p == last || *p != '}') {
+      return NGX_ERROR;
+    }
+  }
+
+#undef ngx_s3_auth__json_skip_space
+
+  if (credentials->access_key.len == 0 || credentials->secret_key.len == 0) {
+    return NGX_ERROR;
+  }
+
+  if (expiration.len > 0) {
+    credentials->expiration = ngx_s3_auth__parse_iso8601_time(&expiration);
+    if (credentials->expiration == -1) {
+      return NGX_ERROR;
+    }
+  }
 
-  return signature_details.header_list;
+  return NGX_OK;
 }
 
 #endif
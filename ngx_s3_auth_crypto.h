@@ -4,7 +4,39 @@
 #include <ngx_core.h>
 #include <ngx_palloc.h>
 
+#define NGX_S3_AUTH_SHA256_LEN 32
+
+// incremental SHA-256 context, layout is private to the crypto backend
+typedef struct ngx_s3_auth__sha256_ctx_s ngx_s3_auth__sha256_ctx_t;
+
+// HMAC-SHA256 key with the ipad/opad blocks already absorbed, signing with it
+// only copies that state and finalizes; a key is not safe to share between threads
+typedef struct ngx_s3_auth__hmac_key_s ngx_s3_auth__hmac_key_t;
+
 ngx_str_t* ngx_s3_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob);
 ngx_str_t* ngx_s3_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob, const ngx_str_t *signing_key);
+void ngx_s3_auth__sign_sha256(const ngx_str_t *blob, const ngx_str_t *signing_key, u_char *md);
+
+ngx_s3_auth__sha256_ctx_t* ngx_s3_auth__sha256_init(ngx_pool_t *pool);
+void ngx_s3_auth__sha256_update(ngx_s3_auth__sha256_ctx_t *ctx, const u_char *data, size_t len);
+ngx_str_t* ngx_s3_auth__sha256_final_hex(ngx_pool_t *pool, ngx_s3_auth__sha256_ctx_t *ctx);
+// writes NGX_S3_AUTH_SHA256_LEN bytes to md and leaves ctx ready for the next message
+ngx_int_t ngx_s3_auth__sha256_final(ngx_s3_auth__sha256_ctx_t *ctx, u_char *md);
+
+ngx_s3_auth__hmac_key_t* ngx_s3_auth__hmac_key_create(ngx_pool_t *pool);
+ngx_int_t ngx_s3_auth__hmac_key_set(ngx_s3_auth__hmac_key_t *key, const ngx_str_t *signing_key);
+ngx_str_t* ngx_s3_auth__hmac_sign_hex(ngx_pool_t *pool, const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob);
+// writes NGX_S3_AUTH_SHA256_LEN bytes to md, does not allocate
+ngx_int_t ngx_s3_auth__hmac_sign(const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob, u_char *md);
+
+// n independent messages at once, md[i] is the digest of blobs[i]; backends
+// with a multi-buffer kernel hash them side by side in SIMD lanes
+void ngx_s3_auth__sha256_batch(const ngx_str_t *blobs, u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n);
+// md[i] is the HMAC of blobs[i] with keys[i]
+ngx_int_t ngx_s3_auth__hmac_sign_batch(const ngx_s3_auth__hmac_key_t *const *keys, const ngx_str_t *blobs,
+                                       u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n);
+// 1 if the batch functions above hash side by side on this CPU, 0 if they
+// only loop over the messages
+ngx_uint_t ngx_s3_auth__sha256_multi_buffer(void);
 
 #endif
@@ -0,0 +1,601 @@
+#include <stdint.h>
+#include "ngx_s3_auth_crypto.h"
+
+// SHA-256 and HMAC-SHA256 without a crypto library. Signing hashes a few
+// hundred bytes at a time, where the EVP dispatch, context copies and
+// provider lookups of OpenSSL cost about as much as the compression itself.
+// Blocks are compressed with the x86 SHA extensions when the CPU has them,
+// with portable C otherwise; the choice is made once, on the first block.
+// NGX_S3_AUTH_NO_SHA_NI pretends the CPU has no SHA extensions (tests).
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define NGX_S3_AUTH_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define NGX_S3_AUTH_SHA256_BLOCK 64
+
+struct ngx_s3_auth__sha256_ctx_s {
+  uint32_t h[8];
+  uint64_t len; // bytes hashed so far
+  u_char block[NGX_S3_AUTH_SHA256_BLOCK];
+};
+
+struct ngx_s3_auth__hmac_key_s {
+  uint32_t inner[8]; // state after (key ^ ipad)
+  uint32_t outer[8]; // state after (key ^ opad)
+};
+
+static const uint32_t sha256_init_state[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+//
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void ngx_s3_auth__sha256_blocks_generic(uint32_t h[8], const u_char *p, size_t blocks) {
+  uint32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+  size_t i;
+
+  for (/* void */; blocks > 0; blocks--, p += NGX_S3_AUTH_SHA256_BLOCK) {
+    for (i = 0; i < 16; i++) {
+      w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16
+             | (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+
+    for (i = 16; i < 64; i++) {
+      w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+             + w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+    for (i = 0; i < 64; i++) {
+      t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+      t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+  }
+}
+
+#undef ROTR
+
+#if defined(NGX_S3_AUTH_X86)
+
+// four rounds per sha256rnds2 pair, the message schedule of the next
+// groups is computed with sha256msg1/sha256msg2 while the rounds run
+__attribute__((target("sha,sse4.1")))
+static void ngx_s3_auth__sha256_blocks_shani(uint32_t h[8], const u_char *p, size_t blocks) {
+  const __m128i shuffle = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abef, cdgh, msg, tmp, m[4];
+  size_t i;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[0]), 0xb1);    // CDAB
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &h[4]), 0x1b); // EFGH
+  state0 = _mm_alignr_epi8(tmp, state1, 8);                                  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xf0);                               // CDGH
+
+  for (/* void */; blocks > 0; blocks--, p += NGX_S3_AUTH_SHA256_BLOCK) {
+    abef = state0;
+    cdgh = state1;
+
+    for (i = 0; i < 4; i++) {
+      m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + i * 16)), shuffle);
+    }
+
+    // unrolled, m[] then stays in registers
+#pragma GCC unroll 16
+    for (i = 0; i < 16; i++) {
+      msg = _mm_add_epi32(m[i & 3], _mm_load_si128((const __m128i *) &sha256_k[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+
+      if (i < 12) {
+        // w[t..t+3] from w[t-16..t-13], w[t-15..t-12], w[t-7..t-4] and w[t-4..t-1]
+        tmp = _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                            _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4));
+        m[i & 3] = _mm_sha256msg2_epu32(tmp, m[(i + 3) & 3]);
+      }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1b);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);    // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+
+  _mm_storeu_si128((__m128i *) &h[0], state0);
+  _mm_storeu_si128((__m128i *) &h[4], state1);
+}
+
+static ngx_uint_t ngx_s3_auth__cpu_has_sha(void) {
+#if defined(NGX_S3_AUTH_NO_SHA_NI)
+  return 0;
+#else
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3)) {
+    return 0;
+  }
+
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return 0;
+  }
+
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0; // SHA
+#endif
+}
+
+#endif
+
+static void ngx_s3_auth__sha256_blocks_resolve(uint32_t h[8], const u_char *p, size_t blocks);
+
+// every worker resolves it on its own, the result is always the same
+static void (*ngx_s3_auth__sha256_blocks)(uint32_t h[8], const u_char *p, size_t blocks)
+  = ngx_s3_auth__sha256_blocks_resolve;
+
+static void ngx_s3_auth__sha256_blocks_resolve(uint32_t h[8], const u_char *p, size_t blocks) {
+  ngx_s3_auth__sha256_blocks = ngx_s3_auth__sha256_blocks_generic;
+
+#if defined(NGX_S3_AUTH_X86)
+  if (ngx_s3_auth__cpu_has_sha()) {
+    ngx_s3_auth__sha256_blocks = ngx_s3_auth__sha256_blocks_shani;
+  }
+#endif
+
+  ngx_s3_auth__sha256_blocks(h, p, blocks);
+}
+
+//
+
+static void ngx_s3_auth__sha256_reset(ngx_s3_auth__sha256_ctx_t *ctx) {
+  ngx_memcpy(ctx->h, sha256_init_state, sizeof(ctx->h));
+  ctx->len = 0;
+}
+
+static void ngx_s3_auth__sha256_absorb(ngx_s3_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+  size_t used = ctx->len % NGX_S3_AUTH_SHA256_BLOCK, n;
+
+  ctx->len += len;
+
+  if (used > 0) {
+    n = ngx_min(len, NGX_S3_AUTH_SHA256_BLOCK - used);
+    ngx_memcpy(ctx->block + used, data, n);
+    data += n;
+    len -= n;
+
+    if (used + n < NGX_S3_AUTH_SHA256_BLOCK) {
+      return;
+    }
+    ngx_s3_auth__sha256_blocks(ctx->h, ctx->block, 1);
+  }
+
+  if (len >= NGX_S3_AUTH_SHA256_BLOCK) {
+    ngx_s3_auth__sha256_blocks(ctx->h, data, len / NGX_S3_AUTH_SHA256_BLOCK);
+    data += len & ~(size_t) (NGX_S3_AUTH_SHA256_BLOCK - 1);
+    len %= NGX_S3_AUTH_SHA256_BLOCK;
+  }
+
+  if (len > 0) {
+    ngx_memcpy(ctx->block, data, len);
+  }
+}
+
+static void ngx_s3_auth__sha256_finish(ngx_s3_auth__sha256_ctx_t *ctx, u_char *md) {
+  size_t used = ctx->len % NGX_S3_AUTH_SHA256_BLOCK, i;
+  uint64_t bits = ctx->len * 8;
+
+  ctx->block[used++] = 0x80;
+
+  if (used > NGX_S3_AUTH_SHA256_BLOCK - 8) {
+    ngx_memzero(ctx->block + used, NGX_S3_AUTH_SHA256_BLOCK - used);
+    ngx_s3_auth__sha256_blocks(ctx->h, ctx->block, 1);
+    used = 0;
+  }
+
+  ngx_memzero(ctx->block + used, NGX_S3_AUTH_SHA256_BLOCK - 8 - used);
+  for (i = 0; i < 8; i++) {
+    ctx->block[NGX_S3_AUTH_SHA256_BLOCK - 1 - i] = (u_char) (bits >> (i * 8));
+  }
+  ngx_s3_auth__sha256_blocks(ctx->h, ctx->block, 1);
+
+  for (i = 0; i < 8; i++) {
+    md[i * 4] = (u_char) (ctx->h[i] >> 24);
+    md[i * 4 + 1] = (u_char) (ctx->h[i] >> 16);
+    md[i * 4 + 2] = (u_char) (ctx->h[i] >> 8);
+    md[i * 4 + 3] = (u_char) ctx->h[i];
+  }
+}
+
+static ngx_str_t* ngx_s3_auth__hex(ngx_pool_t *pool, const u_char *md, size_t md_len) {
+  ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
+
+  if (retval == NULL) {
+    return NULL;
+  }
+
+  retval->data = ngx_palloc(pool, md_len * 2 + 1);
+  if (retval->data == NULL) {
+    return NULL;
+  }
+
+  retval->len = md_len * 2;
+  *ngx_hex_dump(retval->data, (u_char *) md, md_len) = '\0';
+  return retval;
+}
+
+//
+
+ngx_str_t* ngx_s3_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob) {
+  ngx_s3_auth__sha256_ctx_t ctx;
+  u_char hash[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__sha256_reset(&ctx);
+  ngx_s3_auth__sha256_absorb(&ctx, blob->data, blob->len);
+  ngx_s3_auth__sha256_finish(&ctx, hash);
+
+  return ngx_s3_auth__hex(pool, hash, sizeof(hash));
+}
+
+ngx_s3_auth__sha256_ctx_t* ngx_s3_auth__sha256_init(ngx_pool_t *pool) {
+  ngx_s3_auth__sha256_ctx_t *const ctx = ngx_palloc(pool, sizeof(ngx_s3_auth__sha256_ctx_t));
+
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  ngx_s3_auth__sha256_reset(ctx);
+  return ctx;
+}
+
+void ngx_s3_auth__sha256_update(ngx_s3_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+  ngx_s3_auth__sha256_absorb(ctx, data, len);
+}
+
+ngx_int_t ngx_s3_auth__sha256_final(ngx_s3_auth__sha256_ctx_t *ctx, u_char *md) {
+  ngx_s3_auth__sha256_finish(ctx, md);
+  ngx_s3_auth__sha256_reset(ctx);
+  return NGX_OK;
+}
+
+ngx_str_t* ngx_s3_auth__sha256_final_hex(ngx_pool_t *pool, ngx_s3_auth__sha256_ctx_t *ctx) {
+  u_char hash[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__sha256_final(ctx, hash);
+  return ngx_s3_auth__hex(pool, hash, sizeof(hash));
+}
+
+//
+
+ngx_s3_auth__hmac_key_t* ngx_s3_auth__hmac_key_create(ngx_pool_t *pool) {
+  return ngx_pcalloc(pool, sizeof(ngx_s3_auth__hmac_key_t));
+}
+
+ngx_int_t ngx_s3_auth__hmac_key_set(ngx_s3_auth__hmac_key_t *key, const ngx_str_t *signing_key) {
+  u_char hashed[NGX_S3_AUTH_SHA256_LEN], block[NGX_S3_AUTH_SHA256_BLOCK];
+  ngx_s3_auth__sha256_ctx_t ctx;
+  const u_char *k = signing_key->data;
+  size_t len = signing_key->len, i;
+
+  if (len > NGX_S3_AUTH_SHA256_BLOCK) {
+    ngx_s3_auth__sha256_reset(&ctx);
+    ngx_s3_auth__sha256_absorb(&ctx, k, len);
+    ngx_s3_auth__sha256_finish(&ctx, hashed);
+    k = hashed;
+    len = sizeof(hashed);
+  }
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] = (i < len ? k[i] : 0) ^ 0x36;
+  }
+  ngx_memcpy(key->inner, sha256_init_state, sizeof(key->inner));
+  ngx_s3_auth__sha256_blocks(key->inner, block, 1);
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] = (i < len ? k[i] : 0) ^ 0x5c;
+  }
+  ngx_memcpy(key->outer, sha256_init_state, sizeof(key->outer));
+  ngx_s3_auth__sha256_blocks(key->outer, block, 1);
+
+  ngx_explicit_memzero(block, sizeof(block));
+  ngx_explicit_memzero(hashed, sizeof(hashed));
+  ngx_explicit_memzero(&ctx, sizeof(ctx));
+  return NGX_OK;
+}
+
+// the key is only read, unlike the OpenSSL backend it can be shared between threads
+ngx_int_t ngx_s3_auth__hmac_sign(const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob, u_char *md) {
+  ngx_s3_auth__sha256_ctx_t ctx;
+
+  ngx_memcpy(ctx.h, key->inner, sizeof(ctx.h));
+  ctx.len = NGX_S3_AUTH_SHA256_BLOCK;
+  ngx_s3_auth__sha256_absorb(&ctx, blob->data, blob->len);
+  ngx_s3_auth__sha256_finish(&ctx, md);
+
+  ngx_memcpy(ctx.h, key->outer, sizeof(ctx.h));
+  ctx.len = NGX_S3_AUTH_SHA256_BLOCK;
+  ngx_s3_auth__sha256_absorb(&ctx, md, NGX_S3_AUTH_SHA256_LEN);
+  ngx_s3_auth__sha256_finish(&ctx, md);
+
+  return NGX_OK;
+}
+
+ngx_str_t* ngx_s3_auth__hmac_sign_hex(ngx_pool_t *pool, const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob) {
+  u_char md[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__hmac_sign(key, blob, md);
+  return ngx_s3_auth__hex(pool, md, sizeof(md));
+}
+
+void ngx_s3_auth__sign_sha256(const ngx_str_t *blob, const ngx_str_t *signing_key, u_char *md) {
+  ngx_s3_auth__hmac_key_t key;
+
+  ngx_s3_auth__hmac_key_set(&key, signing_key);
+  ngx_s3_auth__hmac_sign(&key, blob, md);
+  ngx_explicit_memzero(&key, sizeof(key));
+}
+
+ngx_str_t* ngx_s3_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
+                                        const ngx_str_t *signing_key) {
+  u_char md[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__sign_sha256(blob, signing_key, md);
+  return ngx_s3_auth__hex(pool, md, sizeof(md));
+}
+
+// Multi-buffer hashing. Every message is prepared as a lane: its own state,
+// the full blocks straight from the message and a padded tail of one or two
+// blocks. Eight lanes are compressed side by side with AVX2, one 32-bit
+// word of each lane per vector element; a lane which has run out of blocks
+// keeps its state while the longer ones finish.
+
+#define NGX_S3_AUTH_SHA256_LANES 8
+
+struct ngx_s3_auth__sha256_lane {
+  uint32_t h[8];
+  const u_char *data;
+  size_t blocks;      // full blocks in data
+  size_t tail_blocks; // 1 or 2
+  u_char tail[NGX_S3_AUTH_SHA256_BLOCK * 2];
+};
+
+// prefix_len bytes are already absorbed into h (the HMAC pad block)
+static void ngx_s3_auth__sha256_lane_init(struct ngx_s3_auth__sha256_lane *lane, const uint32_t *h,
+                                          uint64_t prefix_len, const u_char *data, size_t len) {
+  size_t rem = len % NGX_S3_AUTH_SHA256_BLOCK, tail_len, i;
+  uint64_t bits = (prefix_len + len) * 8;
+
+  ngx_memcpy(lane->h, h, sizeof(lane->h));
+  lane->data = data;
+  lane->blocks = len / NGX_S3_AUTH_SHA256_BLOCK;
+  lane->tail_blocks = rem + 1 + 8 > NGX_S3_AUTH_SHA256_BLOCK ? 2 : 1;
+  tail_len = lane->tail_blocks * NGX_S3_AUTH_SHA256_BLOCK;
+
+  ngx_memcpy(lane->tail, data + len - rem, rem);
+  lane->tail[rem] = 0x80;
+  ngx_memzero(lane->tail + rem + 1, tail_len - 8 - rem - 1);
+  for (i = 0; i < 8; i++) {
+    lane->tail[tail_len - 1 - i] = (u_char) (bits >> (i * 8));
+  }
+}
+
+static void ngx_s3_auth__sha256_lane_digest(const struct ngx_s3_auth__sha256_lane *lane, u_char *md) {
+  size_t i;
+
+  for (i = 0; i < 8; i++) {
+    md[i * 4] = (u_char) (lane->h[i] >> 24);
+    md[i * 4 + 1] = (u_char) (lane->h[i] >> 16);
+    md[i * 4 + 2] = (u_char) (lane->h[i] >> 8);
+    md[i * 4 + 3] = (u_char) lane->h[i];
+  }
+}
+
+static void ngx_s3_auth__sha256_lanes_serial(struct ngx_s3_auth__sha256_lane *lanes, size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (lanes[i].blocks > 0) {
+      ngx_s3_auth__sha256_blocks(lanes[i].h, lanes[i].data, lanes[i].blocks);
+    }
+    ngx_s3_auth__sha256_blocks(lanes[i].h, lanes[i].tail, lanes[i].tail_blocks);
+  }
+}
+
+#if defined(NGX_S3_AUTH_X86)
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+static inline uint32_t ngx_s3_auth__load_be32(const u_char *p) {
+  return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+// up to eight lanes, unused ones hash a block of zeroes into the void
+__attribute__((target("avx2")))
+static void ngx_s3_auth__sha256_lanes_avx2(struct ngx_s3_auth__sha256_lane *lanes, size_t n) {
+  static const u_char zero_block[NGX_S3_AUTH_SHA256_BLOCK];
+  const u_char *p[NGX_S3_AUTH_SHA256_LANES];
+  uint32_t out[NGX_S3_AUTH_SHA256_LANES] __attribute__((aligned(32)));
+  int32_t active[NGX_S3_AUTH_SHA256_LANES];
+  __m256i s[8], saved[8], w[16], a, b, c, d, e, f, g, h, t1, t2, mask;
+  size_t i, j, l, blocks, total;
+
+  total = 0;
+  for (l = 0; l < n; l++) {
+    total = ngx_max(total, lanes[l].blocks + lanes[l].tail_blocks);
+  }
+
+  for (j = 0; j < 8; j++) {
+    for (l = 0; l < NGX_S3_AUTH_SHA256_LANES; l++) {
+      out[l] = l < n ? lanes[l].h[j] : 0;
+    }
+    s[j] = _mm256_load_si256((const __m256i *) out);
+  }
+
+  for (blocks = 0; blocks < total; blocks++) {
+    for (l = 0; l < NGX_S3_AUTH_SHA256_LANES; l++) {
+      active[l] = 0;
+      p[l] = zero_block;
+
+      if (l < n && blocks < lanes[l].blocks + lanes[l].tail_blocks) {
+        active[l] = -1;
+        p[l] = blocks < lanes[l].blocks
+               ? lanes[l].data + blocks * NGX_S3_AUTH_SHA256_BLOCK
+               : lanes[l].tail + (blocks - lanes[l].blocks) * NGX_S3_AUTH_SHA256_BLOCK;
+      }
+    }
+
+    mask = _mm256_loadu_si256((const __m256i *) active);
+
+    for (i = 0; i < 16; i++) {
+      w[i] = _mm256_set_epi32(ngx_s3_auth__load_be32(p[7] + i * 4), ngx_s3_auth__load_be32(p[6] + i * 4),
+                              ngx_s3_auth__load_be32(p[5] + i * 4), ngx_s3_auth__load_be32(p[4] + i * 4),
+                              ngx_s3_auth__load_be32(p[3] + i * 4), ngx_s3_auth__load_be32(p[2] + i * 4),
+                              ngx_s3_auth__load_be32(p[1] + i * 4), ngx_s3_auth__load_be32(p[0] + i * 4));
+    }
+
+    for (j = 0; j < 8; j++) {
+      saved[j] = s[j];
+    }
+
+    a = s[0]; b = s[1]; c = s[2]; d = s[3];
+    e = s[4]; f = s[5]; g = s[6]; h = s[7];
+
+    for (i = 0; i < 64; i++) {
+      if (i >= 16) {
+        // w[i] = w[i-16] + s0(w[i-15]) + w[i-7] + s1(w[i-2]), in a ring of 16
+        t1 = w[(i + 1) & 15];
+        t1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(t1, 7), ROTR8(t1, 18)), _mm256_srli_epi32(t1, 3));
+        t2 = w[(i + 14) & 15];
+        t2 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(t2, 17), ROTR8(t2, 19)), _mm256_srli_epi32(t2, 10));
+        w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], t1), _mm256_add_epi32(w[(i + 9) & 15], t2));
+      }
+
+      t1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25));
+      t1 = _mm256_add_epi32(_mm256_add_epi32(h, t1),
+                            _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g)));
+      t1 = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_set1_epi32((int) sha256_k[i]), w[i & 15]));
+
+      t2 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22));
+      t2 = _mm256_add_epi32(t2, _mm256_xor_si256(_mm256_and_si256(a, b),
+                                                 _mm256_and_si256(c, _mm256_xor_si256(a, b))));
+
+      h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+      d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+    }
+
+    s[0] = a; s[1] = b; s[2] = c; s[3] = d;
+    s[4] = e; s[5] = f; s[6] = g; s[7] = h;
+
+    for (j = 0; j < 8; j++) {
+      s[j] = _mm256_blendv_epi8(saved[j], _mm256_add_epi32(saved[j], s[j]), mask);
+    }
+  }
+
+  for (j = 0; j < 8; j++) {
+    _mm256_store_si256((__m256i *) out, s[j]);
+    for (l = 0; l < n; l++) {
+      lanes[l].h[j] = out[l];
+    }
+  }
+}
+
+#undef ROTR8
+
+#endif
+
+static void ngx_s3_auth__sha256_lanes_resolve(struct ngx_s3_auth__sha256_lane *lanes, size_t n);
+
+static void (*ngx_s3_auth__sha256_lanes)(struct ngx_s3_auth__sha256_lane *lanes, size_t n)
+  = ngx_s3_auth__sha256_lanes_resolve;
+
+// eight AVX2 lanes beat one message at a time in portable C, but not the SHA
+// extensions, which do a block in fewer cycles than the lanes do eight
+ngx_uint_t ngx_s3_auth__sha256_multi_buffer(void) {
+#if defined(NGX_S3_AUTH_X86)
+  return !ngx_s3_auth__cpu_has_sha() && __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+static void ngx_s3_auth__sha256_lanes_resolve(struct ngx_s3_auth__sha256_lane *lanes, size_t n) {
+  ngx_s3_auth__sha256_lanes = ngx_s3_auth__sha256_lanes_serial;
+
+#if defined(NGX_S3_AUTH_X86)
+  if (ngx_s3_auth__sha256_multi_buffer()) {
+    ngx_s3_auth__sha256_lanes = ngx_s3_auth__sha256_lanes_avx2;
+  }
+#endif
+
+  ngx_s3_auth__sha256_lanes(lanes, n);
+}
+
+void ngx_s3_auth__sha256_batch(const ngx_str_t *blobs, u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n) {
+  struct ngx_s3_auth__sha256_lane lanes[NGX_S3_AUTH_SHA256_LANES];
+  size_t i, m;
+
+  for (/* void */; n > 0; n -= m, blobs += m, md += m) {
+    m = ngx_min(n, NGX_S3_AUTH_SHA256_LANES);
+
+    for (i = 0; i < m; i++) {
+      ngx_s3_auth__sha256_lane_init(&lanes[i], sha256_init_state, 0, blobs[i].data, blobs[i].len);
+    }
+
+    ngx_s3_auth__sha256_lanes(lanes, m);
+
+    for (i = 0; i < m; i++) {
+      ngx_s3_auth__sha256_lane_digest(&lanes[i], md[i]);
+    }
+  }
+}
+
+ngx_int_t ngx_s3_auth__hmac_sign_batch(const ngx_s3_auth__hmac_key_t *const *keys, const ngx_str_t *blobs,
+                                       u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n) {
+  struct ngx_s3_auth__sha256_lane lanes[NGX_S3_AUTH_SHA256_LANES];
+  size_t i, m;
+
+  for (/* void */; n > 0; n -= m, keys += m, blobs += m, md += m) {
+    m = ngx_min(n, NGX_S3_AUTH_SHA256_LANES);
+
+    for (i = 0; i < m; i++) {
+      ngx_s3_auth__sha256_lane_init(&lanes[i], keys[i]->inner, NGX_S3_AUTH_SHA256_BLOCK,
+                                    blobs[i].data, blobs[i].len);
+    }
+    ngx_s3_auth__sha256_lanes(lanes, m);
+
+    for (i = 0; i < m; i++) {
+      ngx_s3_auth__sha256_lane_digest(&lanes[i], md[i]);
+      ngx_s3_auth__sha256_lane_init(&lanes[i], keys[i]->outer, NGX_S3_AUTH_SHA256_BLOCK,
+                                    md[i], NGX_S3_AUTH_SHA256_LEN);
+    }
+    ngx_s3_auth__sha256_lanes(lanes, m);
+
+    for (i = 0; i < m; i++) {
+      ngx_s3_auth__sha256_lane_digest(&lanes[i], md[i]);
+    }
+  }
+
+  return NGX_OK;
+}
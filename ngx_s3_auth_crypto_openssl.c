@@ -1,41 +1,249 @@
-#include <openssl/bio.h>
-#include <openssl/buffer.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/sha.h>
 #include "ngx_s3_auth_crypto.h"
 
-static const EVP_MD* evp_md = NULL;
+struct ngx_s3_auth__sha256_ctx_s {
+  EVP_MD_CTX *md_ctx;
+};
 
-ngx_str_t* ngx_s3_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
-                                        const ngx_str_t *signing_key) {
+struct ngx_s3_auth__hmac_key_s {
+  EVP_MD_CTX *inner;   // SHA-256 state after (key ^ ipad)
+  EVP_MD_CTX *outer;   // SHA-256 state after (key ^ opad)
+  EVP_MD_CTX *scratch; // per key scratch state, see the note on thread safety in the header
+};
 
-  unsigned int md_len;
-  unsigned char md[EVP_MAX_MD_SIZE];
-  ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
+// fetched once, OpenSSL 3 would otherwise look the digest up in the
+// provider on every EVP_DigestInit_ex
+static const EVP_MD* evp_md = NULL;
 
+static const EVP_MD* ngx_s3_auth__evp_sha256(void) {
   if (evp_md==NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    evp_md = EVP_MD_fetch(NULL, "SHA256", NULL);
+#else
     evp_md = EVP_sha256();
+#endif
+  }
+  return evp_md;
+}
+
+static void ngx_s3_auth__md_ctx_cleanup(void *data) {
+  EVP_MD_CTX_free(data);
+}
+
+static EVP_MD_CTX* ngx_s3_auth__md_ctx_create(ngx_pool_t *pool) {
+  ngx_pool_cleanup_t *cln = ngx_pool_cleanup_add(pool, 0);
+  EVP_MD_CTX *md_ctx;
+
+  if (cln == NULL) {
+    return NULL;
+  }
+
+  md_ctx = EVP_MD_CTX_new();
+  if (md_ctx == NULL) {
+    return NULL;
+  }
+
+  cln->handler = ngx_s3_auth__md_ctx_cleanup;
+  cln->data = md_ctx;
+  return md_ctx;
+}
+
+static ngx_str_t* ngx_s3_auth__hex(ngx_pool_t *pool, const u_char *md, size_t md_len) {
+  ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
+
+  if (retval == NULL) {
+    return NULL;
   }
 
-  HMAC(evp_md, signing_key->data, signing_key->len, blob->data, blob->len, md, &md_len);
   retval->data = ngx_palloc(pool, md_len * 2 + 1);
+  if (retval->data == NULL) {
+    return NULL;
+  }
+
   retval->len = md_len * 2;
-  ngx_hex_dump(retval->data, md, md_len);
+  *ngx_hex_dump(retval->data, (u_char *) md, md_len) = '\0';
   return retval;
 }
 
+ngx_str_t* ngx_s3_auth__sign_sha256_hex(ngx_pool_t *pool, const ngx_str_t *blob,
+                                        const ngx_str_t *signing_key) {
+  unsigned char md[NGX_S3_AUTH_SHA256_LEN];
+
+  ngx_s3_auth__sign_sha256(blob, signing_key, md);
+  return ngx_s3_auth__hex(pool, md, sizeof(md));
+}
+
+void ngx_s3_auth__sign_sha256(const ngx_str_t *blob, const ngx_str_t *signing_key, u_char *md) {
+  unsigned int md_len;
+
+  HMAC(ngx_s3_auth__evp_sha256(), signing_key->data, signing_key->len, blob->data, blob->len, md, &md_len);
+}
+
+ngx_s3_auth__hmac_key_t* ngx_s3_auth__hmac_key_create(ngx_pool_t *pool) {
+  ngx_s3_auth__hmac_key_t *key = ngx_palloc(pool, sizeof(ngx_s3_auth__hmac_key_t));
+
+  if (key == NULL) {
+    return NULL;
+  }
+
+  key->inner = ngx_s3_auth__md_ctx_create(pool);
+  key->outer = ngx_s3_auth__md_ctx_create(pool);
+  key->scratch = ngx_s3_auth__md_ctx_create(pool);
+
+  if (key->inner == NULL || key->outer == NULL || key->scratch == NULL) {
+    return NULL;
+  }
+
+  return key;
+}
+
+static ngx_int_t ngx_s3_auth__hmac_key_pad(EVP_MD_CTX *md_ctx, const u_char *k, size_t len, u_char pad) {
+  u_char block[SHA256_CBLOCK];
+  size_t i;
+
+  for (i = 0; i < sizeof(block); i++) {
+    block[i] = (i < len ? k[i] : 0) ^ pad;
+  }
+
+  i = EVP_DigestInit_ex(md_ctx, ngx_s3_auth__evp_sha256(), NULL)
+      && EVP_DigestUpdate(md_ctx, block, sizeof(block));
+
+  OPENSSL_cleanse(block, sizeof(block));
+  return i ? NGX_OK : NGX_ERROR;
+}
+
+ngx_int_t ngx_s3_auth__hmac_key_set(ngx_s3_auth__hmac_key_t *key, const ngx_str_t *signing_key) {
+  u_char hashed[NGX_S3_AUTH_SHA256_LEN];
+  const u_char *k = signing_key->data;
+  size_t len = signing_key->len;
+  ngx_int_t rc;
+
+  if (len > SHA256_CBLOCK) {
+    if (!EVP_Digest(k, len, hashed, NULL, ngx_s3_auth__evp_sha256(), NULL)) {
+      return NGX_ERROR;
+    }
+    k = hashed;
+    len = sizeof(hashed);
+  }
+
+  rc = ngx_s3_auth__hmac_key_pad(key->inner, k, len, 0x36);
+  if (rc == NGX_OK) {
+    rc = ngx_s3_auth__hmac_key_pad(key->outer, k, len, 0x5c);
+  }
+
+  OPENSSL_cleanse(hashed, sizeof(hashed));
+  return rc;
+}
+
+ngx_int_t ngx_s3_auth__hmac_sign(const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob, u_char *md) {
+  if (!EVP_MD_CTX_copy_ex(key->scratch, key->inner)
+      || !EVP_DigestUpdate(key->scratch, blob->data, blob->len)
+      || !EVP_DigestFinal_ex(key->scratch, md, NULL)
+      || !EVP_MD_CTX_copy_ex(key->scratch, key->outer)
+      || !EVP_DigestUpdate(key->scratch, md, NGX_S3_AUTH_SHA256_LEN)
+      || !EVP_DigestFinal_ex(key->scratch, md, NULL)) {
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+ngx_str_t* ngx_s3_auth__hmac_sign_hex(ngx_pool_t *pool, const ngx_s3_auth__hmac_key_t *key, const ngx_str_t *blob) {
+  unsigned char md[NGX_S3_AUTH_SHA256_LEN];
+
+  if (ngx_s3_auth__hmac_sign(key, blob, md) != NGX_OK) {
+    return NULL;
+  }
+
+  return ngx_s3_auth__hex(pool, md, sizeof(md));
+}
+
+ngx_s3_auth__sha256_ctx_t* ngx_s3_auth__sha256_init(ngx_pool_t *pool) {
+  ngx_s3_auth__sha256_ctx_t *const ctx = ngx_palloc(pool, sizeof(ngx_s3_auth__sha256_ctx_t));
+
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  ctx->md_ctx = ngx_s3_auth__md_ctx_create(pool);
+  if (ctx->md_ctx == NULL || !EVP_DigestInit_ex(ctx->md_ctx, ngx_s3_auth__evp_sha256(), NULL)) {
+    return NULL;
+  }
+
+  return ctx;
+}
+
+void ngx_s3_auth__sha256_update(ngx_s3_auth__sha256_ctx_t *ctx, const u_char *data, size_t len) {
+  EVP_DigestUpdate(ctx->md_ctx, data, len);
+}
+
+ngx_int_t ngx_s3_auth__sha256_final(ngx_s3_auth__sha256_ctx_t *ctx, u_char *md) {
+  if (!EVP_DigestFinal_ex(ctx->md_ctx, md, NULL)
+      || !EVP_DigestInit_ex(ctx->md_ctx, ngx_s3_auth__evp_sha256(), NULL)) {
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+ngx_str_t* ngx_s3_auth__sha256_final_hex(ngx_pool_t *pool, ngx_s3_auth__sha256_ctx_t *ctx) {
+  unsigned char hash[NGX_S3_AUTH_SHA256_LEN];
+
+  if (ngx_s3_auth__sha256_final(ctx, hash) != NGX_OK) {
+    return NULL;
+  }
+
+  return ngx_s3_auth__hex(pool, hash, sizeof(hash));
+}
+
 ngx_str_t* ngx_s3_auth__hash_sha256(ngx_pool_t *pool, const ngx_str_t *blob) {
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  ngx_str_t *const retval = ngx_palloc(pool, sizeof(ngx_str_t));
+  unsigned char hash[NGX_S3_AUTH_SHA256_LEN];
+
+  if (!EVP_Digest(blob->data, blob->len, hash, NULL, ngx_s3_auth__evp_sha256(), NULL)) {
+    return NULL;
+  }
 
-  SHA256_CTX sha256;
-  SHA256_Init(&sha256);
-  SHA256_Update(&sha256, blob->data, blob->len);
-  SHA256_Final(hash, &sha256);
+  return ngx_s3_auth__hex(pool, hash, sizeof(hash));
+}
 
-  retval->data = ngx_palloc(pool, sizeof(hash) * 2 + 1);
-  retval->len = sizeof(hash) * 2;
-  ngx_hex_dump(retval->data, hash, sizeof(hash));
-  return retval;
+// OpenSSL has no multi-buffer interface, the messages are hashed one by one
+// on a context kept for the lifetime of the process, batches are only ever
+// completed on the event loop
+
+void ngx_s3_auth__sha256_batch(const ngx_str_t *blobs, u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n) {
+  static EVP_MD_CTX *md_ctx;
+  size_t i;
+
+  if (md_ctx == NULL) {
+    md_ctx = EVP_MD_CTX_new();
+  }
+
+  for (i = 0; i < n; i++) {
+    if (md_ctx == NULL
+        || !EVP_DigestInit_ex(md_ctx, ngx_s3_auth__evp_sha256(), NULL)
+        || !EVP_DigestUpdate(md_ctx, blobs[i].data, blobs[i].len)
+        || !EVP_DigestFinal_ex(md_ctx, md[i], NULL)) {
+      EVP_Digest(blobs[i].data, blobs[i].len, md[i], NULL, ngx_s3_auth__evp_sha256(), NULL);
+    }
+  }
+}
+
+ngx_int_t ngx_s3_auth__hmac_sign_batch(const ngx_s3_auth__hmac_key_t *const *keys, const ngx_str_t *blobs,
+                                       u_char (*md)[NGX_S3_AUTH_SHA256_LEN], size_t n) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (ngx_s3_auth__hmac_sign(keys[i], &blobs[i], md[i]) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+ngx_uint_t ngx_s3_auth__sha256_multi_buffer(void) {
+  return 0;
 }